@@ -172,6 +172,7 @@ struct __clo_s {
 	int dryp:1;
 	int rawp:1;
 	int verbosep:1;
+	int framedp:1;
 
 	conn_meth_t meth;
 	const char *host;
@@ -217,6 +218,8 @@ Options common to all commands:\n\
   -r, --raw             Print messages received from the server in\n\
                         raw form, i.e. without interpreting them.\n\
   -v, --verbose         Print outgoing and incoming messages.\n\
+      --framed          Send the request as length-prefixed frame\n\
+                        and expect a framed reply.\n\
 \n\
 Supported commands:\n\
 \n\
@@ -426,6 +429,58 @@ read_reply(void **closure, volatile int fd, bool rawp)
 	return rpl;
 }
 
+struct __frm_s {
+	char *buf;
+	size_t bsz;
+	size_t off;
+};
+
+static int
+read_frame(umpf_msg_t *rpl, struct __frm_s *frm, volatile int fd, bool rawp)
+{
+/* return 1 if a frame has been read completely, 0 if more data is
+ * needed and -1 on error */
+	struct umpf_frame_s fr;
+	ssize_t nrd;
+	int hsz;
+
+	while ((nrd = recv(fd, gbuf, sizeof(gbuf), 0)) > 0) {
+#if defined DEBUG_FLAG
+		fprintf(stderr, "read %zd\n", nrd);
+#endif	/* DEBUG_FLAG */
+		if (frm->off + nrd > frm->bsz) {
+			size_t nu = 2 * (frm->off + nrd);
+			char *tmp;
+
+			if (UNLIKELY((tmp = realloc(frm->buf, nu)) == NULL)) {
+				/* the old buffer's still the caller's */
+				return -1;
+			}
+			frm->buf = tmp;
+			frm->bsz = nu;
+		}
+		memcpy(frm->buf + frm->off, gbuf, nrd);
+		frm->off += nrd;
+
+		if ((hsz = umpf_parse_frame_hdr(&fr, frm->buf, frm->off)) < 0) {
+			/* not a frame, bugger off */
+			return -1;
+		} else if (hsz == 0 || frm->off < hsz + fr.len) {
+			/* not enough data yet, request more */
+			continue;
+		}
+		/* frame's complete */
+		if (UNLIKELY(rawp)) {
+			fwrite(frm->buf + hsz, fr.len, 1, stdout);
+		} else if ((*rpl = umpf_parse_frame(&fr, frm->buf + hsz)) == NULL) {
+			return -1;
+		}
+		frm->off = 0;
+		return 1;
+	}
+	return nrd < 0 && errno == EAGAIN ? 0 : -1;
+}
+
 static int
 write_request(int fd, const char *buf, size_t len)
 {
@@ -603,13 +658,24 @@ pretty_print(umpf_msg_t msg)
 
 /* main loop */
 static int
-umpf_repl(const char *buf, size_t bsz, volatile int sock, bool verbp, bool rawp)
+umpf_repl(
+	const char *buf, size_t bsz, volatile int sock,
+	bool verbp, bool rawp, bool framedp)
 {
 	ep_ctx_t epg;
 	int nfds;
 	/* track the number of bytes written */
 	size_t wrt = 0;
 	void *closure = NULL;
+	/* frame header and frame buffer for framed mode */
+	char hdr[UMPF_FRAME_HDR_SIZE];
+	size_t hsz = 0;
+	size_t hwr = 0;
+	struct __frm_s frm = {0};
+
+	if (framedp) {
+		hsz = umpf_seria_frame_hdr(hdr, bsz, UMPF_CODEC_FIXML);
+	}
 
 	/* also set up our epoll magic */
 	epg = epoll_guts(GUTS_GET);
@@ -623,7 +689,27 @@ umpf_repl(const char *buf, size_t bsz, volatile int sock, bool verbp, bool rawp)
 		/* we've only asked for one, so it would be peculiar */
 		assert(nfds == 1);
 
-		if (LIKELY(ev & EPOLLIN)) {
+		if (LIKELY(ev & EPOLLIN) && framedp) {
+			/* read a frame off the wire */
+			umpf_msg_t rpl = NULL;
+			int rc = read_frame(&rpl, &frm, fd, rawp);
+
+			if (rc < 0) {
+				nfds = -1;
+				break;
+			} else if (rc > 0) {
+				if (rpl != NULL) {
+					if (UNLIKELY(verbp)) {
+						umpf_print_msg(STDERR_FILENO, rpl);
+					}
+					pretty_print(rpl);
+					umpf_free_msg(rpl);
+				}
+				nfds = 0;
+				break;
+			}
+
+		} else if (LIKELY(ev & EPOLLIN)) {
 			/* read what's on the wire */
 			umpf_msg_t rpl = read_reply(&closure, fd, rawp);
 
@@ -641,7 +727,10 @@ umpf_repl(const char *buf, size_t bsz, volatile int sock, bool verbp, bool rawp)
 
 		} else if (ev & EPOLLOUT) {
 			/* have we got stuff to write out? */
-			if (wrt < bsz) {
+			if (hwr < hsz) {
+				/* frame header goes first */
+				hwr += write_request(fd, hdr + hwr, hsz - hwr);
+			} else if (wrt < bsz) {
 				/* write a bit of the message */
 				wrt += write_request(fd, buf + wrt, bsz - wrt);
 			}
@@ -657,6 +746,9 @@ umpf_repl(const char *buf, size_t bsz, volatile int sock, bool verbp, bool rawp)
 	/* stop waiting for events */
 	ep_fini(epg, sock);
 	(void)epoll_guts(GUTS_FREE);
+	if (frm.buf != NULL) {
+		free(frm.buf);
+	}
 	return nfds;
 }
 
@@ -1107,12 +1199,13 @@ umpf_process(struct __clo_s *clo)
 	if (LIKELY(!clo->dryp && (sock = umpf_connect(clo)) >= 0)) {
 		bool verbp = clo->verbosep;
 		bool rawp = clo->rawp;
+		bool framedp = clo->framedp;
 
 		if (UNLIKELY(verbp)) {
 			fwrite(buf, bsz, 1, stderr);
 		}
 		/* main loop */
-		res = umpf_repl(buf, bsz, sock, verbp, rawp);
+		res = umpf_repl(buf, bsz, sock, verbp, rawp, framedp);
 		/* close socket */
 		close(sock);
 	} else if (UNLIKELY(clo->dryp)) {
@@ -1358,6 +1451,9 @@ parse_args(struct __clo_s *clo, int argc, char *argv[])
 				} else if (strcmp(p, "verbose") == 0) {
 					clo->verbosep = 1;
 					continue;
+				} else if (strcmp(p, "framed") == 0) {
+					clo->framedp = 1;
+					continue;
 				} else if (strncmp(p, "timeout", 7U) == 0) {
 					timeout = strtol(argv[++i], NULL, 10);
 					continue;
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <inttypes.h>
 #include "umpf.h"
 #include "proto-fixml.h"
 #include "nifty.h"
@@ -21,6 +22,10 @@
 # define GLUE_DBGCONT(args...)
 #endif	/* DEBUG_FLAG */
 
+/* party sub id role that carries the position hash of a tag,
+ * from the user-defined range of PtySubIDTyp */
+#define PTY_SUB_R_HASH	(4000)
+
 static char*
 safe_strdup(const char *in)
 {
@@ -138,8 +143,18 @@ make_umpf_msg(struct pfix_fixml_s *fix)
 		if (rfp->npty > 0) {
 			struct pfix_pty_s *p = rfp->pty;
 			msg->pf.name = safe_strdup(p->prim.id);
-			if (p->nsub > 0) {
-				msg->pf.tag_id = strtoul(p->sub->id, NULL, 10);
+			for (size_t i = 0; i < p->nsub; i++) {
+				struct pfix_sub_s *s = p->sub + i;
+
+				const char *id = s->id;
+
+				if (id == NULL) {
+					continue;
+				} else if (s->r == PTY_SUB_R_HASH) {
+					msg->pf.hash = strtoull(id, NULL, 16);
+				} else if (msg->pf.tag_id == 0) {
+					msg->pf.tag_id = strtoul(id, NULL, 10);
+				}
 			}
 		}
 		msg->pf.stamp = rfp->txn_tm;
@@ -365,6 +380,11 @@ make_umpf_fix(umpf_msg_t msg)
 			struct pfix_sub_s *s = pty_add_sub(p);
 			asprintf(&s->id, "%lu", msg->pf.tag_id);
 		}
+		if (msg->pf.hash) {
+			struct pfix_sub_s *s = pty_add_sub(p);
+			asprintf(&s->id, "%016" PRIx64, msg->pf.hash);
+			s->r = PTY_SUB_R_HASH;
+		}
 		if (msg->hdr.mt == UMPF_MSG_GET_PF * 2 ||
 		    msg->hdr.mt == UMPF_MSG_SET_PF * 2 + 1) {
 			break;
@@ -106,4 +106,129 @@ umpf_msg_add_pos(umpf_msg_t msg, size_t npos)
 	return msg;
 }
 
+static uint64_t
+__mix64(uint64_t x)
+{
+	/* splitmix64's finaliser */
+	x ^= x >> 30U;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27U;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31U;
+	return x;
+}
+
+static uint64_t
+__dbl_bits(double x)
+{
+	uint64_t res;
+
+	if (x == 0.0) {
+		/* -0 and 0 are the same position */
+		x = 0.0;
+	}
+	memcpy(&res, &x, sizeof(res));
+	return res;
+}
+
+uint64_t
+umpf_pos_hash(const char *sym, double l, double s)
+{
+	/* fnv1a over the symbol */
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (const char *p = sym; p && *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 0x100000001b3ULL;
+	}
+	h = __mix64(h ^ __mix64(__dbl_bits(l)));
+	h = __mix64(h ^ __dbl_bits(s));
+	return h;
+}
+
+uint64_t
+umpf_pf_hash(umpf_msg_t msg)
+{
+	uint64_t res = 0U;
+
+	for (size_t i = 0; i < msg->pf.nposs; i++) {
+		const struct __ins_qty_s *iq = msg->pf.poss + i;
+
+		/* summing makes it independent of the order */
+		res += umpf_pos_hash(
+			iq->ins->sym, iq->qty->_long, iq->qty->_shrt);
+	}
+	return res ? res : 1U;
+}
+
+
+/* framing */
+size_t
+umpf_seria_frame_hdr(char *tgt, size_t len, umpf_codec_t codec)
+{
+	unsigned char *p = (unsigned char*)tgt;
+
+	p[0] = UMPF_FRAME_MAGIC;
+	p[1] = 'U';
+	p[2] = UMPF_FRAME_VERSION;
+	p[3] = (unsigned char)codec;
+	/* payload length, big-endian */
+	p[4] = (unsigned char)(len >> 24U);
+	p[5] = (unsigned char)(len >> 16U);
+	p[6] = (unsigned char)(len >> 8U);
+	p[7] = (unsigned char)(len >> 0U);
+	return UMPF_FRAME_HDR_SIZE;
+}
+
+int
+umpf_parse_frame_hdr(struct umpf_frame_s *fr, const char *buf, size_t bsz)
+{
+	const unsigned char *p = (const unsigned char*)buf;
+
+	if (UNLIKELY(bsz == 0)) {
+		return 0;
+	} else if (p[0] != UMPF_FRAME_MAGIC) {
+		/* not a frame at all */
+		return -1;
+	} else if (bsz < UMPF_FRAME_HDR_SIZE) {
+		/* looks like one but we can't tell yet */
+		return 0;
+	} else if (p[1] != 'U' || p[2] != UMPF_FRAME_VERSION) {
+		return -1;
+	} else if (p[3] >= UMPF_NCODECS) {
+		return -1;
+	}
+	fr->codec = (umpf_codec_t)p[3];
+	fr->len = ((size_t)p[4] << 24U) | ((size_t)p[5] << 16U) |
+		((size_t)p[6] << 8U) | ((size_t)p[7] << 0U);
+	return UMPF_FRAME_HDR_SIZE;
+}
+
+umpf_msg_t
+umpf_parse_frame(const struct umpf_frame_s *fr, const char *buf)
+{
+	umpf_ctx_t ctx = NULL;
+	umpf_msg_t res;
+
+	switch (fr->codec) {
+	case UMPF_CODEC_FIXML:
+		break;
+	default:
+		return NULL;
+	}
+
+	if ((res = umpf_parse_blob_r(&ctx, buf, fr->len)) != NULL) {
+		return res;
+	} else if (ctx != NULL) {
+		/* the payload ended before the document did, finalise the
+		 * push parser and give up */
+		if ((res = umpf_parse_blob_r(&ctx, buf, 0)) != NULL) {
+			/* wants to be a document after all, but that's
+			 * not what the frame said */
+			umpf_free_msg(res);
+		}
+	}
+	return NULL;
+}
+
 /* umpf.c ends here */
@@ -160,6 +160,8 @@ struct umpf_msg_pf_s {
 	time_t stamp;
 	time_t clr_dt;
 	tag_t tag_id;
+	/* canonical hash over the positions, 0 if unknown */
+	uint64_t hash;
 
 	size_t nposs;
 	struct __ins_qty_s poss[];
@@ -230,6 +232,64 @@ extern size_t umpf_seria_msg(char **tgt, size_t tsz, umpf_msg_t);
  * Resize message to take NPOS additional positions. */
 extern umpf_msg_t umpf_msg_add_pos(umpf_msg_t msg, size_t npos);
 
+/**
+ * Return the canonical hash over the positions of get_pf/set_pf
+ * message MSG, the order of positions does not matter.
+ * This is what umpfd puts into the hash slot of its replies, so
+ * clients can compare their positions against a tag without fetching
+ * it.  The hash is never 0. */
+extern uint64_t umpf_pf_hash(umpf_msg_t msg);
+
+/**
+ * Return the hash of a single position in SYM with sides L and S.
+ * `umpf_pf_hash()' is the sum of these over all positions, or 1 if
+ * that sum is 0. */
+extern uint64_t umpf_pos_hash(const char *sym, double l, double s);
+
+
+/* framing */
+/**
+ * Codecs that can be carried inside a frame. */
+typedef enum {
+	UMPF_CODEC_FIXML,
+	UMPF_NCODECS,
+} umpf_codec_t;
+
+/**
+ * Number of bytes a frame header occupies on the wire.
+ * A header is the magic byte 0xff, the letter `U', the frame version,
+ * the codec and then the payload length as 32bit big-endian integer.
+ * 0xff can never start a (utf-8) XML document, so framed and unframed
+ * peers can be told apart by the first byte. */
+#define UMPF_FRAME_HDR_SIZE	(8U)
+#define UMPF_FRAME_MAGIC	(0xffU)
+#define UMPF_FRAME_VERSION	(1U)
+
+struct umpf_frame_s {
+	umpf_codec_t codec;
+	size_t len;
+};
+
+/**
+ * Write a frame header announcing LEN bytes of payload in codec CODEC
+ * to TGT, which must be able to hold UMPF_FRAME_HDR_SIZE bytes.
+ * Return the number of bytes written. */
+extern size_t umpf_seria_frame_hdr(char *tgt, size_t len, umpf_codec_t codec);
+
+/**
+ * Read the frame header at the beginning of BUF of size BSZ into FR.
+ * Return the size of the header, 0 if BSZ bytes are not enough to
+ * decide, or -1 if BUF does not start with a valid frame header. */
+extern int
+umpf_parse_frame_hdr(struct umpf_frame_s *fr, const char *buf, size_t bsz);
+
+/**
+ * Parse the complete payload BUF of the frame described by FR.
+ * Unlike `umpf_parse_blob()' there is no context, the payload must
+ * hold exactly one document or NULL is returned. */
+extern umpf_msg_t
+umpf_parse_frame(const struct umpf_frame_s *fr, const char *buf);
+
 
 /**
  * Name space URI for FIXML 5.0 */
@@ -14,5 +14,14 @@ MEDIUMTEXT CHARSET utf8 COLLATE utf8_bin dnl
 VARCHAR($1) CHARSET ascii COLLATE ascii_bin dnl
 ])])
 define([POST], [ENGINE InnoDB CHARSET ascii COLLATE ascii_bin])
+dnl mysql can't do CREATE INDEX IF NOT EXISTS, ask the catalogue instead
+define([CREATE_INDEX], [SET @umpf_ddl = (
+	SELECT IF(COUNT(*), 'DO 0', 'CREATE INDEX N($1) ON N($2) ($3)')
+	FROM information_schema.statistics
+	WHERE table_schema = DATABASE() AND
+		table_name = '$2' AND index_name = '$1');
+PREPARE umpf_ddl FROM @umpf_ddl;
+EXECUTE umpf_ddl;
+DEALLOCATE PREPARE umpf_ddl])
 
 dnl mysql.m4 ends here
@@ -4,5 +4,7 @@ changequote(`[', `]')
 define([N], ["]$1["])
 define([ON_CONFLICT], [ON CONFLICT])
 define([POST], [])
+define([CREATE_INDEX], [CREATE INDEX IF NOT EXISTS N($1)
+	ON N($2) ($3)])
 
 dnl sqlite3.m4 ends here
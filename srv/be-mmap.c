@@ -0,0 +1,1481 @@
+/*** be-mmap.c -- memory-mapped storage backend
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if defined HAVE_CONFIG_H
+# include "config.h"
+#endif	/* HAVE_CONFIG_H */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "be-mmap.h"
+#include "nifty.h"
+
+/* every file starts with a header, records follow at MM_HDR_SIZE,
+ * NREC is the number of records, or bytes for the symbol file, NCOM
+ * is what NREC was at the last commit before there was a commit file,
+ * see mm_com_s */
+#define MM_MAGIC	"umpm"
+#define MM_VERSION	(1U)
+#define MM_HDR_SIZE	(64U)
+#define MM_INI_SIZE	(65536U)
+
+struct mm_hdr_s {
+	char magic[4U];
+	uint16_t version;
+	uint16_t rsz;
+	uint32_t pad;
+	uint64_t nrec;
+	uint64_t ncom;
+};
+
+/* the symbol dictionary, every entry is its length, the bytes and a
+ * terminator, padded to 8 bytes, entries are referred to by their
+ * offset plus 1; descriptions live there too but aren't shared */
+struct mm_sym_s {
+	uint32_t len;
+	char data[];
+};
+
+/* portfolios, HEAD is the most recently created tag */
+struct mm_pf_s {
+	uint64_t name;
+	uint64_t descr;
+	uint64_t head;
+	uint64_t ntag;
+};
+
+struct mm_sec_s {
+	uint64_t pf;
+	uint64_t name;
+	uint64_t descr;
+	uint64_t pad;
+};
+
+/* tags, PREV is the portfolio's tag created before this one, that's the
+ * per-portfolio index on disk, POS is the tag's most recent position */
+struct mm_tag_s {
+	uint64_t pf;
+	int64_t stamp;
+	uint64_t prev;
+	uint64_t pos;
+	uint64_t npos;
+	uint64_t hash;
+};
+
+/* positions, PREV is the tag's position created before this one,
+ * positions aren't changed, a new one supersedes them, SUPD is the
+ * position this one supersedes, 0 if it's the first of its security */
+struct mm_pos_s {
+	uint64_t tag;
+	uint64_t sec;
+	double l;
+	double s;
+	uint64_t prev;
+	uint64_t supd;
+};
+
+enum {
+	MM_SYM,
+	MM_PF,
+	MM_SEC,
+	MM_TAG,
+	MM_POS,
+	MM_NFILES,
+};
+
+static const struct {
+	const char *fn;
+	uint16_t rsz;
+} mm_files[MM_NFILES] = {
+	[MM_SYM] = {"sym.umpfm", 1U},
+	[MM_PF] = {"pf.umpfm", sizeof(struct mm_pf_s)},
+	[MM_SEC] = {"sec.umpfm", sizeof(struct mm_sec_s)},
+	[MM_TAG] = {"tag.umpfm", sizeof(struct mm_tag_s)},
+	[MM_POS] = {"pos.umpfm", sizeof(struct mm_pos_s)},
+};
+
+/* the commit record, NCOM is what every file's NREC was at the last
+ * commit, records below that have been written back before the
+ * record was; there are two slots of a sector each, a commit goes to
+ * the slot with the older GEN, a torn one fails the checksum SUM and
+ * the other slot is still good */
+#define MM_COM_FILE	"com.umpfm"
+#define MM_COM_SIZE	(512U)
+
+struct mm_com_s {
+	char magic[4U];
+	uint32_t pad;
+	uint64_t gen;
+	uint64_t ncom[MM_NFILES];
+	uint64_t sum;
+};
+
+/* DLO is the lowest offset written to since the last sync */
+struct mmf_s {
+	int fd;
+	char *base;
+	size_t msz;
+	size_t dlo;
+};
+
+/* ids by scope and key, open addressing, portfolios are keyed by their
+ * name's symbol in scope 0, securities by theirs in their portfolio's
+ * scope, symbols by their string's hash in scope MM_SYM_SCOPE */
+#define MM_SYM_SCOPE	(UINT64_MAX)
+
+struct mm_ent_s {
+	uint64_t scope;
+	uint64_t key;
+	uint64_t id;
+};
+
+struct mm_htab_s {
+	size_t nent;
+	size_t mask;
+	struct mm_ent_s *tbl;
+};
+
+/* old values of what's been overwritten since the outermost begin */
+struct mm_undo_s {
+	unsigned int f;
+	uint64_t off;
+	uint64_t old;
+};
+
+/* a portfolio's tags by stamp, then id */
+struct mm_tix_s {
+	uint64_t *tags;
+	size_t n;
+	size_t z;
+};
+
+struct mmdb_s {
+	struct mmf_s f[MM_NFILES];
+	/* commit file and its most recent record */
+	int cfd;
+	struct mm_com_s com;
+	struct mm_htab_s ids[1];
+	/* securities of tag HOT_TAG -> positions, for upserts */
+	struct mm_htab_s hot[1];
+	uint64_t hot_tag;
+	/* indexed by portfolio id - 1 */
+	struct mm_tix_s *tix;
+	size_t ztix;
+
+	struct mm_undo_s *undo;
+	size_t nundo;
+	size_t zundo;
+	/* undo log lengths at every begin */
+	size_t *sp;
+	size_t nsp;
+	size_t zsp;
+};
+
+
+/* mapped files */
+static int
+mmf_open(struct mmf_s *f, int dfd, unsigned int fi)
+{
+	const char *fn = mm_files[fi].fn;
+	struct mm_hdr_s *hdr;
+	struct stat st;
+	bool fresh;
+
+	if ((f->fd = openat(dfd, fn, O_RDWR | O_CREAT, 0644)) < 0) {
+		return -1;
+	} else if (fstat(f->fd, &st) < 0) {
+		goto clo;
+	} else if ((fresh = st.st_size == 0)) {
+		if (ftruncate(f->fd, MM_INI_SIZE) < 0) {
+			goto clo;
+		}
+		st.st_size = MM_INI_SIZE;
+	} else if ((size_t)st.st_size < MM_HDR_SIZE) {
+		goto clo;
+	}
+	f->msz = st.st_size;
+	f->base = mmap(
+		NULL, f->msz, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+	if (f->base == MAP_FAILED) {
+		goto clo;
+	}
+	hdr = (void*)f->base;
+	if (fresh) {
+		memcpy(hdr->magic, MM_MAGIC, sizeof(hdr->magic));
+		hdr->version = MM_VERSION;
+		hdr->rsz = mm_files[fi].rsz;
+		hdr->nrec = 0U;
+		hdr->ncom = 0U;
+	} else if (memcmp(hdr->magic, MM_MAGIC, sizeof(hdr->magic)) ||
+		   hdr->version != MM_VERSION ||
+		   hdr->rsz != mm_files[fi].rsz) {
+		/* not ours */
+		munmap(f->base, f->msz);
+		goto clo;
+	}
+	f->dlo = SIZE_MAX;
+	return 0;
+clo:
+	close(f->fd);
+	f->fd = -1;
+	return -1;
+}
+
+static void
+mmf_close(struct mmf_s *f)
+{
+	if (f->fd < 0) {
+		return;
+	}
+	(void)msync(f->base, f->msz, MS_SYNC);
+	munmap(f->base, f->msz);
+	close(f->fd);
+	f->fd = -1;
+	return;
+}
+
+static inline void
+mmf_dirty(struct mmf_s *f, size_t off)
+{
+	if (off < f->dlo) {
+		f->dlo = off;
+	}
+	return;
+}
+
+static int
+mmf_sync(struct mmf_s *f, size_t end)
+{
+/* write back what's been written to since the last sync up to END */
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	size_t lo;
+
+	if (f->dlo >= end) {
+		return 0;
+	}
+	lo = f->dlo & ~(pgsz - 1U);
+	if (msync(f->base + lo, end - lo, MS_SYNC) < 0) {
+		return -1;
+	}
+	f->dlo = SIZE_MAX;
+	return 0;
+}
+
+static int
+mmf_need(struct mmf_s *f, size_t n)
+{
+/* make sure there's room for N bytes past the header, the mapping
+ * may move, so nothing must hold on to pointers into it */
+	size_t nu = f->msz;
+	void *tmp;
+
+	if (LIKELY(MM_HDR_SIZE + n <= f->msz)) {
+		return 0;
+	}
+	while (nu < MM_HDR_SIZE + n) {
+		nu *= 2U;
+	}
+	if (ftruncate(f->fd, nu) < 0) {
+		return -1;
+	} else if ((tmp = mremap(f->base, f->msz, nu, MREMAP_MAYMOVE)) ==
+		   MAP_FAILED) {
+		return -1;
+	}
+	f->base = tmp;
+	f->msz = nu;
+	return 0;
+}
+
+
+/* accessors, none of the pointers survive an append */
+static inline struct mm_hdr_s*
+mm_hdr(mmdb_t m, unsigned int fi)
+{
+	return (void*)m->f[fi].base;
+}
+
+static inline uint64_t
+mm_nrec(mmdb_t m, unsigned int fi)
+{
+	return mm_hdr(m, fi)->nrec;
+}
+
+static inline void*
+mm_rec(mmdb_t m, unsigned int fi, uint64_t id)
+{
+	return m->f[fi].base + MM_HDR_SIZE + (id - 1U) * mm_files[fi].rsz;
+}
+
+static inline struct mm_pf_s*
+mm_pf(mmdb_t m, uint64_t id)
+{
+	return mm_rec(m, MM_PF, id);
+}
+
+static inline struct mm_sec_s*
+mm_sec(mmdb_t m, uint64_t id)
+{
+	return mm_rec(m, MM_SEC, id);
+}
+
+static inline struct mm_tag_s*
+mm_tag(mmdb_t m, uint64_t id)
+{
+	return mm_rec(m, MM_TAG, id);
+}
+
+static inline struct mm_pos_s*
+mm_pos(mmdb_t m, uint64_t id)
+{
+	return mm_rec(m, MM_POS, id);
+}
+
+static inline const struct mm_sym_s*
+mm_sym(mmdb_t m, uint64_t ref)
+{
+	return (const void*)(m->f[MM_SYM].base + MM_HDR_SIZE + ref - 1U);
+}
+
+
+/* in-place updates, logged when inside a transaction */
+static int
+mm_set(mmdb_t m, unsigned int fi, void *p, uint64_t v)
+{
+	uint64_t old;
+
+	memcpy(&old, p, sizeof(old));
+	if (m->nsp == 0U) {
+		/* not in a transaction, no way back */
+		;
+	} else if (m->nundo >= m->zundo) {
+		size_t nu = m->zundo ? m->zundo * 2U : 256U;
+		void *tmp = realloc(m->undo, nu * sizeof(*m->undo));
+
+		if (UNLIKELY(tmp == NULL)) {
+			return -1;
+		}
+		m->undo = tmp;
+		m->zundo = nu;
+	}
+	if (m->nsp > 0U) {
+		m->undo[m->nundo].f = fi;
+		m->undo[m->nundo].off = (char*)p - m->f[fi].base;
+		m->undo[m->nundo].old = old;
+		m->nundo++;
+	}
+	if ((char*)p - m->f[fi].base >= MM_HDR_SIZE) {
+		/* headers go out last, see mm_sync() */
+		mmf_dirty(m->f + fi, (char*)p - m->f[fi].base);
+	}
+	memcpy(p, &v, sizeof(v));
+	return 0;
+}
+
+static uint64_t
+mm_append(mmdb_t m, unsigned int fi, const void *rec)
+{
+/* append REC to file FI, return its id or 0 */
+	uint64_t n = mm_nrec(m, fi);
+	size_t rsz = mm_files[fi].rsz;
+
+	if (UNLIKELY(mmf_need(m->f + fi, (n + 1U) * rsz) < 0)) {
+		return 0U;
+	}
+	memcpy(mm_rec(m, fi, n + 1U), rec, rsz);
+	mmf_dirty(m->f + fi, MM_HDR_SIZE + n * rsz);
+	if (UNLIKELY(mm_set(m, fi, &mm_hdr(m, fi)->nrec, n + 1U) < 0)) {
+		return 0U;
+	}
+	return n + 1U;
+}
+
+
+/* hash tables */
+static inline size_t
+ht_hash(uint64_t scope, uint64_t key)
+{
+	uint64_t x = scope * 0x9e3779b97f4a7c15ULL ^ key;
+
+	x ^= x >> 33U;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33U;
+	return (size_t)x;
+}
+
+static uint64_t
+ht_get(const struct mm_htab_s *h, uint64_t scope, uint64_t key)
+{
+	if (h->tbl == NULL) {
+		return 0U;
+	}
+	for (size_t i = ht_hash(scope, key);; i++) {
+		const struct mm_ent_s *e = h->tbl + (i & h->mask);
+
+		if (e->id == 0U) {
+			return 0U;
+		} else if (e->scope == scope && e->key == key) {
+			return e->id;
+		}
+	}
+}
+
+static void ht_put(struct mm_htab_s *h, uint64_t s, uint64_t k, uint64_t id);
+
+static int
+ht_grow(struct mm_htab_s *h)
+{
+	struct mm_htab_s nu = {0U};
+	size_t z = h->tbl ? (h->mask + 1U) * 2U : 1024U;
+
+	if ((nu.tbl = calloc(z, sizeof(*nu.tbl))) == NULL) {
+		return -1;
+	}
+	nu.mask = z - 1U;
+	for (size_t i = 0; h->tbl != NULL && i <= h->mask; i++) {
+		const struct mm_ent_s *e = h->tbl + i;
+
+		if (e->id) {
+			ht_put(&nu, e->scope, e->key, e->id);
+		}
+	}
+	if (h->tbl != NULL) {
+		free(h->tbl);
+	}
+	*h = nu;
+	return 0;
+}
+
+static void
+ht_put(struct mm_htab_s *h, uint64_t scope, uint64_t key, uint64_t id)
+{
+	if (h->tbl == NULL || 2U * (h->nent + 1U) > h->mask + 1U) {
+		if (UNLIKELY(ht_grow(h) < 0)) {
+			return;
+		}
+	}
+	for (size_t i = ht_hash(scope, key);; i++) {
+		struct mm_ent_s *e = h->tbl + (i & h->mask);
+
+		if (e->id == 0U) {
+			e->scope = scope;
+			e->key = key;
+			e->id = id;
+			h->nent++;
+			return;
+		} else if (e->scope == scope && e->key == key) {
+			e->id = id;
+			return;
+		}
+	}
+}
+
+static void
+ht_clear(struct mm_htab_s *h)
+{
+	if (h->tbl != NULL) {
+		memset(h->tbl, 0, (h->mask + 1U) * sizeof(*h->tbl));
+	}
+	h->nent = 0U;
+	return;
+}
+
+static void
+ht_fini(struct mm_htab_s *h)
+{
+	if (h->tbl != NULL) {
+		free(h->tbl);
+	}
+	memset(h, 0, sizeof(*h));
+	return;
+}
+
+
+/* symbols */
+static uint64_t
+sym_hash(const char *s, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (const unsigned char *p = (const void*)s; n > 0; p++, n--) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t
+sym_get(mmdb_t m, const char *s)
+{
+/* find S in the dictionary, symbols with the same hash are chained up
+ * by probing, so walk the probe sequence by hand */
+	const struct mm_htab_s *h = m->ids;
+	size_t n = strlen(s);
+	uint64_t key = sym_hash(s, n);
+
+	if (h->tbl == NULL) {
+		return 0U;
+	}
+	for (size_t i = ht_hash(MM_SYM_SCOPE, key);; i++) {
+		const struct mm_ent_s *e = h->tbl + (i & h->mask);
+		const struct mm_sym_s *y;
+
+		if (e->id == 0U) {
+			return 0U;
+		} else if (e->scope != MM_SYM_SCOPE || e->key != key) {
+			continue;
+		}
+		y = mm_sym(m, e->id);
+		if (y->len == n && memcmp(y->data, s, n) == 0) {
+			return e->id;
+		}
+	}
+}
+
+static void
+sym_put(mmdb_t m, uint64_t ref)
+{
+/* like ht_put() but symbols with equal hashes are all kept */
+	struct mm_htab_s *h = m->ids;
+	const struct mm_sym_s *y = mm_sym(m, ref);
+	uint64_t key = sym_hash(y->data, y->len);
+
+	if (sym_get(m, y->data) == ref) {
+		return;
+	} else if (h->tbl == NULL || 2U * (h->nent + 1U) > h->mask + 1U) {
+		if (UNLIKELY(ht_grow(h) < 0)) {
+			return;
+		}
+	}
+	for (size_t i = ht_hash(MM_SYM_SCOPE, key);; i++) {
+		struct mm_ent_s *e = h->tbl + (i & h->mask);
+
+		if (e->id == 0U) {
+			e->scope = MM_SYM_SCOPE;
+			e->key = key;
+			e->id = ref;
+			h->nent++;
+			return;
+		}
+	}
+}
+
+static uint64_t
+sym_add(mmdb_t m, const char *s, size_t n)
+{
+/* append N bytes at S to the dictionary, return the reference or 0 */
+	uint64_t used = mm_nrec(m, MM_SYM);
+	size_t sz = (sizeof(uint32_t) + n + 1U + 7U) & ~(size_t)7U;
+	struct mm_sym_s *y;
+
+	if (UNLIKELY(n > UINT32_MAX)) {
+		return 0U;
+	} else if (UNLIKELY(mmf_need(m->f + MM_SYM, used + sz) < 0)) {
+		return 0U;
+	}
+	y = (void*)(m->f[MM_SYM].base + MM_HDR_SIZE + used);
+	y->len = (uint32_t)n;
+	memcpy(y->data, s, n);
+	memset(y->data + n, 0, sz - sizeof(uint32_t) - n);
+	mmf_dirty(m->f + MM_SYM, MM_HDR_SIZE + used);
+	if (UNLIKELY(mm_set(m, MM_SYM, &mm_hdr(m, MM_SYM)->nrec, used + sz))) {
+		return 0U;
+	}
+	return used + 1U;
+}
+
+static uint64_t
+sym_intern(mmdb_t m, const char *s)
+{
+	uint64_t res;
+
+	if ((res = sym_get(m, s)) > 0U) {
+		return res;
+	} else if ((res = sym_add(m, s, strlen(s))) > 0U) {
+		sym_put(m, res);
+	}
+	return res;
+}
+
+static struct __satell_s
+sym_dup(mmdb_t m, uint64_t ref)
+{
+	struct __satell_s res = {NULL, 0U};
+	const struct mm_sym_s *y;
+
+	if (ref == 0U) {
+		return res;
+	}
+	y = mm_sym(m, ref);
+	if ((res.data = malloc(y->len + 1U)) != NULL) {
+		memcpy(res.data, y->data, y->len + 1U);
+		res.size = y->len;
+	}
+	return res;
+}
+
+
+/* the in-memory indexes */
+static int
+tix_add(mmdb_t m, uint64_t pf, uint64_t tag)
+{
+/* file TAG into PF's index, they mostly come in order */
+	struct mm_tix_s *x;
+	int64_t stamp = mm_tag(m, tag)->stamp;
+	size_t lo, hi;
+
+	if (pf > m->ztix) {
+		size_t nu = m->ztix ? m->ztix * 2U : 64U;
+		void *tmp;
+
+		while (nu < pf) {
+			nu *= 2U;
+		}
+		if ((tmp = realloc(m->tix, nu * sizeof(*m->tix))) == NULL) {
+			return -1;
+		}
+		m->tix = tmp;
+		memset(m->tix + m->ztix, 0, (nu - m->ztix) * sizeof(*m->tix));
+		m->ztix = nu;
+	}
+	x = m->tix + (pf - 1U);
+	if (x->n >= x->z) {
+		size_t nu = x->z ? x->z * 2U : 16U;
+		void *tmp;
+
+		if ((tmp = realloc(x->tags, nu * sizeof(*x->tags))) == NULL) {
+			return -1;
+		}
+		x->tags = tmp;
+		x->z = nu;
+	}
+	/* find the first tag that's younger, or older with a larger id */
+	for (lo = 0U, hi = x->n; lo < hi;) {
+		size_t mid = (lo + hi) / 2U;
+		const struct mm_tag_s *t = mm_tag(m, x->tags[mid]);
+
+		if (t->stamp < stamp ||
+		    (t->stamp == stamp && x->tags[mid] < tag)) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+	memmove(x->tags + lo + 1U, x->tags + lo, (x->n - lo) * sizeof(tag));
+	x->tags[lo] = tag;
+	x->n++;
+	return 0;
+}
+
+static void
+mm_unindex(mmdb_t m)
+{
+	ht_clear(m->ids);
+	ht_clear(m->hot);
+	m->hot_tag = 0U;
+	for (size_t i = 0; i < m->ztix; i++) {
+		m->tix[i].n = 0U;
+	}
+	return;
+}
+
+static int
+mm_reindex(mmdb_t m)
+{
+	int res = 0;
+
+	mm_unindex(m);
+	for (uint64_t i = 1, n = mm_nrec(m, MM_PF); i <= n; i++) {
+		uint64_t name = mm_pf(m, i)->name;
+
+		sym_put(m, name);
+		ht_put(m->ids, 0U, name, i);
+	}
+	for (uint64_t i = 1, n = mm_nrec(m, MM_SEC); i <= n; i++) {
+		const struct mm_sec_s *s = mm_sec(m, i);
+
+		sym_put(m, s->name);
+		ht_put(m->ids, s->pf, s->name, i);
+	}
+	for (uint64_t i = 1, n = mm_nrec(m, MM_TAG); i <= n; i++) {
+		res |= tix_add(m, mm_tag(m, i)->pf, i);
+	}
+	return res;
+}
+
+static bool
+mm_symp(mmdb_t m, uint64_t ref)
+{
+	uint64_t used = mm_nrec(m, MM_SYM);
+
+	return ref > 0U && ref + sizeof(uint32_t) <= used &&
+		ref + sizeof(uint32_t) + mm_sym(m, ref)->len <= used;
+}
+
+/* commit records */
+static uint64_t
+mm_com_sum(const struct mm_com_s *c)
+{
+	return sym_hash((const void*)c, offsetof(struct mm_com_s, sum));
+}
+
+static int
+mm_com_read(mmdb_t m)
+{
+/* put the most recent good commit record into M's */
+	struct mm_com_s c[2U];
+	struct stat st;
+	int best = -1;
+
+	if (fstat(m->cfd, &st) < 0) {
+		return -1;
+	} else if (st.st_size == 0) {
+		/* fresh, or from before there were commit files,
+		 * either way the headers know */
+		memcpy(m->com.magic, MM_MAGIC, sizeof(m->com.magic));
+		m->com.gen = 0U;
+		for (unsigned int i = 0; i < MM_NFILES; i++) {
+			m->com.ncom[i] = mm_hdr(m, i)->ncom;
+		}
+		return 0;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (pread(m->cfd, c + i, sizeof(*c), i * MM_COM_SIZE) !=
+		    (ssize_t)sizeof(*c)) {
+			continue;
+		} else if (memcmp(c[i].magic, MM_MAGIC, sizeof(c->magic)) ||
+			   c[i].sum != mm_com_sum(c + i)) {
+			/* torn */
+			continue;
+		} else if (best < 0 || c[i].gen > c[best].gen) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		return -1;
+	}
+	m->com = c[best];
+	return 0;
+}
+
+static int
+mm_com_write(mmdb_t m, const uint64_t ncom[static MM_NFILES])
+{
+/* write and sync a commit record of NCOM to the slot M's isn't in */
+	struct mm_com_s c = m->com;
+
+	c.gen++;
+	memcpy(c.ncom, ncom, sizeof(c.ncom));
+	c.sum = mm_com_sum(&c);
+	if (pwrite(m->cfd, &c, sizeof(c), (c.gen % 2U) * MM_COM_SIZE) !=
+	    (ssize_t)sizeof(c)) {
+		return -1;
+	} else if (fdatasync(m->cfd) < 0) {
+		return -1;
+	}
+	m->com = c;
+	return 0;
+}
+
+static int
+mm_check(mmdb_t m)
+{
+/* records are only counted once they're on disk, but the fields that
+ * are updated in place might have made it there while the records of
+ * an uncommitted transaction they refer to didn't, walk the records,
+ * which never change, and point those fields back at what's there */
+	uint64_t npf, nsec, ntag, npos;
+	/* most recent tag or position, and how many, by owner - 1 */
+	struct {
+		uint64_t last;
+		uint64_t n;
+	} *pfs, *tags;
+	int res = 0;
+
+	if (mm_com_read(m) < 0) {
+		return -1;
+	}
+	for (unsigned int i = 0; i < MM_NFILES; i++) {
+		uint64_t n = m->com.ncom[i];
+
+		if (n * mm_files[i].rsz > m->f[i].msz - MM_HDR_SIZE) {
+			/* can't have been written by us */
+			return -1;
+		}
+		/* the rest never got committed */
+		mm_hdr(m, i)->nrec = n;
+	}
+	npf = mm_nrec(m, MM_PF);
+	nsec = mm_nrec(m, MM_SEC);
+	ntag = mm_nrec(m, MM_TAG);
+	npos = mm_nrec(m, MM_POS);
+	if ((pfs = calloc(npf + 1U, sizeof(*pfs))) == NULL) {
+		return -1;
+	} else if ((tags = calloc(ntag + 1U, sizeof(*tags))) == NULL) {
+		free(pfs);
+		return -1;
+	}
+	for (uint64_t i = 1; i <= ntag; i++) {
+		const struct mm_tag_s *t = mm_tag(m, i);
+
+		if (LIKELY(t->pf > 0U && t->pf <= npf)) {
+			pfs[t->pf - 1U].last = i;
+			pfs[t->pf - 1U].n++;
+		}
+	}
+	for (uint64_t i = 1; i <= npos; i++) {
+		const struct mm_pos_s *q = mm_pos(m, i);
+
+		if (LIKELY(q->tag > 0U && q->tag <= ntag)) {
+			tags[q->tag - 1U].last = i;
+			/* superseding ones don't count */
+			tags[q->tag - 1U].n += !q->supd;
+		}
+	}
+
+	for (uint64_t i = 1; i <= npf; i++) {
+		struct mm_pf_s *p = mm_pf(m, i);
+
+		if (p->head != pfs[i - 1U].last) {
+			res |= mm_set(m, MM_PF, &p->head, pfs[i - 1U].last);
+		}
+		if (p->ntag != pfs[i - 1U].n) {
+			res |= mm_set(m, MM_PF, &p->ntag, pfs[i - 1U].n);
+		}
+		if (p->descr && !mm_symp(m, p->descr)) {
+			res |= mm_set(m, MM_PF, &p->descr, 0U);
+		}
+	}
+	for (uint64_t i = 1; i <= nsec; i++) {
+		struct mm_sec_s *s = mm_sec(m, i);
+
+		if (s->descr && !mm_symp(m, s->descr)) {
+			res |= mm_set(m, MM_SEC, &s->descr, 0U);
+		}
+	}
+	for (uint64_t i = 1; i <= ntag; i++) {
+		struct mm_tag_s *t = mm_tag(m, i);
+
+		if (t->pos == tags[i - 1U].last && t->npos == tags[i - 1U].n) {
+			continue;
+		}
+		res |= mm_set(m, MM_TAG, &t->pos, tags[i - 1U].last);
+		res |= mm_set(m, MM_TAG, &t->npos, tags[i - 1U].n);
+		/* it's been hashing positions that aren't there */
+		res |= mm_set(m, MM_TAG, &t->hash, 0U);
+	}
+	free(pfs);
+	free(tags);
+	return res;
+}
+
+static int
+mm_sync(mmdb_t m)
+{
+/* write back the records, then one commit record for all files,
+ * pages are written back in no particular order otherwise */
+	uint64_t ncom[MM_NFILES];
+	bool dirty = false;
+
+	for (unsigned int i = 0; i < MM_NFILES; i++) {
+		size_t end = MM_HDR_SIZE + mm_nrec(m, i) * mm_files[i].rsz;
+
+		if (mmf_sync(m->f + i, end) < 0) {
+			return -1;
+		}
+		ncom[i] = mm_nrec(m, i);
+		dirty |= ncom[i] != m->com.ncom[i];
+	}
+	if (!dirty) {
+		/* nothing's been appended */
+		return 0;
+	}
+	return mm_com_write(m, ncom);
+}
+
+
+/* public API */
+mmdb_t
+be_mmap_open(const char *dir)
+{
+	mmdb_t res;
+	int dfd;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		return NULL;
+	} else if ((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		return NULL;
+	} else if ((res = calloc(1, sizeof(*res))) == NULL) {
+		close(dfd);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < MM_NFILES; i++) {
+		res->f[i].fd = -1;
+	}
+	res->cfd = -1;
+	for (unsigned int i = 0; i < MM_NFILES; i++) {
+		if (mmf_open(res->f + i, dfd, i) < 0) {
+			goto out;
+		}
+	}
+	/* one connexion per store */
+	if (flock(res->f[MM_PF].fd, LOCK_EX | LOCK_NB) < 0) {
+		goto out;
+	} else if ((res->cfd = openat(
+			    dfd, MM_COM_FILE, O_RDWR | O_CREAT, 0644)) < 0) {
+		goto out;
+	}
+	close(dfd);
+	if (mm_check(res) < 0 || mm_reindex(res) < 0) {
+		goto bugger;
+	}
+	return res;
+out:
+	close(dfd);
+bugger:
+	if (res->cfd >= 0) {
+		/* there's nothing of ours to commit */
+		close(res->cfd);
+		res->cfd = -1;
+	}
+	be_mmap_close(res);
+	return NULL;
+}
+
+void
+be_mmap_close(mmdb_t m)
+{
+	if (m->nsp == 0U && m->cfd >= 0) {
+		/* what's been written outside of transactions */
+		(void)mm_sync(m);
+	}
+	for (unsigned int i = 0; i < MM_NFILES; i++) {
+		mmf_close(m->f + i);
+	}
+	if (m->cfd >= 0) {
+		close(m->cfd);
+	}
+	ht_fini(m->ids);
+	ht_fini(m->hot);
+	for (size_t i = 0; i < m->ztix; i++) {
+		if (m->tix[i].tags != NULL) {
+			free(m->tix[i].tags);
+		}
+	}
+	if (m->tix != NULL) {
+		free(m->tix);
+	}
+	if (m->undo != NULL) {
+		free(m->undo);
+	}
+	if (m->sp != NULL) {
+		free(m->sp);
+	}
+	free(m);
+	return;
+}
+
+int
+be_mmap_begin(mmdb_t m)
+{
+	if (m->nsp >= m->zsp) {
+		size_t nu = m->zsp ? m->zsp * 2U : 8U;
+		void *tmp;
+
+		if ((tmp = realloc(m->sp, nu * sizeof(*m->sp))) == NULL) {
+			return -1;
+		}
+		m->sp = tmp;
+		m->zsp = nu;
+	}
+	m->sp[m->nsp++] = m->nundo;
+	return 0;
+}
+
+int
+be_mmap_commit(mmdb_t m)
+{
+	if (UNLIKELY(m->nsp == 0U)) {
+		return -1;
+	} else if (m->nsp == 1U && UNLIKELY(mm_sync(m) < 0)) {
+		/* leave it to the caller to roll back */
+		return -1;
+	} else if (--m->nsp == 0U) {
+		/* what's on disk is what's committed */
+		m->nundo = 0U;
+	}
+	return 0;
+}
+
+void
+be_mmap_rollback(mmdb_t m)
+{
+	size_t mark;
+
+	if (UNLIKELY(m->nsp == 0U)) {
+		return;
+	}
+	mark = m->sp[--m->nsp];
+	while (m->nundo > mark) {
+		const struct mm_undo_s *u = m->undo + --m->nundo;
+
+		memcpy(m->f[u->f].base + u->off, &u->old, sizeof(u->old));
+	}
+	/* cheaper than undoing them, rollbacks are rare */
+	(void)mm_reindex(m);
+	return;
+}
+
+
+uint64_t
+be_mmap_find_pf(mmdb_t m, const char *mnemo)
+{
+	uint64_t name;
+
+	if ((name = sym_get(m, mnemo)) == 0U) {
+		return 0U;
+	}
+	return ht_get(m->ids, 0U, name);
+}
+
+uint64_t
+be_mmap_pf(mmdb_t m, const char *mnemo)
+{
+	struct mm_pf_s rec = {0U};
+	uint64_t res;
+
+	if ((res = be_mmap_find_pf(m, mnemo)) > 0U) {
+		return res;
+	} else if ((rec.name = sym_intern(m, mnemo)) == 0U) {
+		return 0U;
+	} else if ((res = mm_append(m, MM_PF, &rec)) > 0U) {
+		ht_put(m->ids, 0U, rec.name, res);
+	}
+	return res;
+}
+
+uint64_t
+be_mmap_find_sec(mmdb_t m, uint64_t pf, const char *mnemo)
+{
+	uint64_t name;
+
+	if (pf == 0U || (name = sym_get(m, mnemo)) == 0U) {
+		return 0U;
+	}
+	return ht_get(m->ids, pf, name);
+}
+
+uint64_t
+be_mmap_sec(mmdb_t m, uint64_t pf, const char *mnemo)
+{
+	struct mm_sec_s rec = {0U};
+	uint64_t res;
+
+	if (pf == 0U || pf > mm_nrec(m, MM_PF)) {
+		return 0U;
+	} else if ((res = be_mmap_find_sec(m, pf, mnemo)) > 0U) {
+		return res;
+	} else if ((rec.name = sym_intern(m, mnemo)) == 0U) {
+		return 0U;
+	}
+	rec.pf = pf;
+	if ((res = mm_append(m, MM_SEC, &rec)) > 0U) {
+		ht_put(m->ids, pf, rec.name, res);
+	}
+	return res;
+}
+
+int
+be_mmap_set_pf_descr(mmdb_t m, uint64_t pf, struct __satell_s d)
+{
+	uint64_t ref;
+
+	if (pf == 0U || pf > mm_nrec(m, MM_PF)) {
+		return -1;
+	} else if ((ref = sym_add(m, d.data, d.size)) == 0U) {
+		return -1;
+	}
+	return mm_set(m, MM_PF, &mm_pf(m, pf)->descr, ref);
+}
+
+int
+be_mmap_set_sec_descr(mmdb_t m, uint64_t sec, struct __satell_s d)
+{
+	uint64_t ref;
+
+	if (sec == 0U || sec > mm_nrec(m, MM_SEC)) {
+		return -1;
+	} else if ((ref = sym_add(m, d.data, d.size)) == 0U) {
+		return -1;
+	}
+	return mm_set(m, MM_SEC, &mm_sec(m, sec)->descr, ref);
+}
+
+struct __satell_s
+be_mmap_get_pf_descr(mmdb_t m, uint64_t pf)
+{
+	if (pf == 0U || pf > mm_nrec(m, MM_PF)) {
+		return (struct __satell_s){NULL, 0U};
+	}
+	return sym_dup(m, mm_pf(m, pf)->descr);
+}
+
+struct __satell_s
+be_mmap_get_sec_descr(mmdb_t m, uint64_t sec)
+{
+	if (sec == 0U || sec > mm_nrec(m, MM_SEC)) {
+		return (struct __satell_s){NULL, 0U};
+	}
+	return sym_dup(m, mm_sec(m, sec)->descr);
+}
+
+
+uint64_t
+be_mmap_new_tag(mmdb_t m, uint64_t pf, time_t stamp)
+{
+	struct mm_tag_s rec = {0U};
+	uint64_t res;
+
+	if (pf == 0U || pf > mm_nrec(m, MM_PF)) {
+		return 0U;
+	}
+	rec.pf = pf;
+	rec.stamp = stamp;
+	rec.prev = mm_pf(m, pf)->head;
+	if ((res = mm_append(m, MM_TAG, &rec)) == 0U) {
+		return 0U;
+	} else if (mm_set(m, MM_PF, &mm_pf(m, pf)->head, res) < 0 ||
+		   mm_set(m, MM_PF, &mm_pf(m, pf)->ntag,
+			  mm_pf(m, pf)->ntag + 1U) < 0 ||
+		   tix_add(m, pf, res) < 0) {
+		return 0U;
+	}
+	return res;
+}
+
+static uint64_t
+pos_add(mmdb_t m, uint64_t tag, uint64_t sec, double l, double s, uint64_t p)
+{
+/* append a position to TAG superseding its position P in SEC, or,
+ * if P is 0, as TAG's first in SEC */
+	struct mm_pos_s rec = {0U};
+	uint64_t res;
+
+	rec.tag = tag;
+	rec.sec = sec;
+	rec.l = l;
+	rec.s = s;
+	rec.prev = mm_tag(m, tag)->pos;
+	rec.supd = p;
+	if ((res = mm_append(m, MM_POS, &rec)) == 0U) {
+		return 0U;
+	} else if (mm_set(m, MM_TAG, &mm_tag(m, tag)->pos, res) < 0) {
+		return 0U;
+	} else if (p == 0U &&
+		   mm_set(m, MM_TAG, &mm_tag(m, tag)->npos,
+			  mm_tag(m, tag)->npos + 1U) < 0) {
+		return 0U;
+	}
+	if (m->hot_tag == tag) {
+		ht_put(m->hot, tag, sec, res);
+	}
+	return res;
+}
+
+static bool
+pos_supdp(struct mm_htab_s *supd, uint64_t p, const struct mm_pos_s *q)
+{
+/* whether position P, that's Q, has been superseded, positions must
+ * come in newest first, SUPD keeps track of the superseded ones */
+	if (q->supd) {
+		ht_put(supd, 0U, q->supd, p);
+	}
+	return ht_get(supd, 0U, p) > 0U;
+}
+
+int
+be_mmap_copy_tag(mmdb_t m, uint64_t tag, uint64_t from)
+{
+	struct mm_htab_s supd = {0U};
+	uint64_t *ps;
+	size_t n = 0U;
+	int res = 0;
+
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return -1;
+	} else if (from == 0U) {
+		return 0;
+	} else if (from > mm_nrec(m, MM_TAG)) {
+		return -1;
+	} else if ((ps = malloc(mm_tag(m, from)->npos * sizeof(*ps))) == NULL &&
+		   mm_tag(m, from)->npos > 0U) {
+		return -1;
+	}
+	for (uint64_t p = mm_tag(m, from)->pos; p; p = mm_pos(m, p)->prev) {
+		if (pos_supdp(&supd, p, mm_pos(m, p))) {
+			continue;
+		}
+#if defined UMPF_AUTO_PRUNE
+		if (mm_pos(m, p)->l == 0.0 && mm_pos(m, p)->s == 0.0) {
+			continue;
+		}
+#endif	/* UMPF_AUTO_PRUNE */
+		if (UNLIKELY(n >= mm_tag(m, from)->npos)) {
+			/* lost track of the superseded ones */
+			res = -1;
+			break;
+		}
+		ps[n++] = p;
+	}
+	/* oldest first so the copy's in the same order */
+	while (n > 0U && res == 0) {
+		const struct mm_pos_s *q = mm_pos(m, ps[--n]);
+
+		if (pos_add(m, tag, q->sec, q->l, q->s, 0U) == 0U) {
+			res = -1;
+		}
+	}
+	if (ps != NULL) {
+		free(ps);
+	}
+	ht_fini(&supd);
+	return res;
+}
+
+uint64_t
+be_mmap_get_tag(mmdb_t m, uint64_t pf, const time_t *stamp, time_t *tstamp)
+{
+	const struct mm_tix_s *x;
+	size_t lo, hi;
+
+	if (pf == 0U || pf > m->ztix || (x = m->tix + (pf - 1U))->n == 0U) {
+		return 0U;
+	} else if (stamp == NULL) {
+		lo = x->n;
+	} else {
+		/* find the first tag that's younger than *STAMP */
+		for (lo = 0U, hi = x->n; lo < hi;) {
+			size_t mid = (lo + hi) / 2U;
+
+			if (mm_tag(m, x->tags[mid])->stamp <= *stamp) {
+				lo = mid + 1U;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == 0U) {
+			return 0U;
+		}
+	}
+	if (tstamp != NULL) {
+		*tstamp = mm_tag(m, x->tags[lo - 1U])->stamp;
+	}
+	return x->tags[lo - 1U];
+}
+
+uint64_t
+be_mmap_get_hash(mmdb_t m, uint64_t tag)
+{
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return 0U;
+	}
+	return mm_tag(m, tag)->hash;
+}
+
+int
+be_mmap_set_hash(mmdb_t m, uint64_t tag, uint64_t hash)
+{
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return -1;
+	}
+	return mm_set(m, MM_TAG, &mm_tag(m, tag)->hash, hash);
+}
+
+uint64_t
+be_mmap_find_hash(mmdb_t m, uint64_t pf, uint64_t hash)
+{
+	if (pf == 0U || pf > mm_nrec(m, MM_PF)) {
+		return 0U;
+	}
+	for (uint64_t t = mm_pf(m, pf)->head; t; t = mm_tag(m, t)->prev) {
+		if (mm_tag(m, t)->hash == hash) {
+			return t;
+		}
+	}
+	return 0U;
+}
+
+static uint64_t
+pos_find(mmdb_t m, uint64_t tag, uint64_t sec)
+{
+/* the position of SEC in TAG, the tag that's being written to keeps
+ * its positions in the hot table */
+	if (m->hot_tag != tag) {
+		uint64_t p = mm_tag(m, tag)->pos;
+
+		ht_clear(m->hot);
+		for (; p; p = mm_pos(m, p)->prev) {
+			uint64_t sec = mm_pos(m, p)->sec;
+
+			if (!ht_get(m->hot, tag, sec)) {
+				/* newest first, older ones are superseded */
+				ht_put(m->hot, tag, sec, p);
+			}
+		}
+		m->hot_tag = tag;
+	}
+	return ht_get(m->hot, tag, sec);
+}
+
+int
+be_mmap_set_pos(mmdb_t m, uint64_t tag, uint64_t sec, double l, double s)
+{
+	uint64_t p;
+
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return -1;
+	} else if (sec == 0U || sec > mm_nrec(m, MM_SEC)) {
+		return -1;
+	} else if ((p = pos_find(m, tag, sec)) > 0U &&
+		   mm_pos(m, p)->l == l && mm_pos(m, p)->s == s) {
+		/* nothing to supersede it with */
+		return 0;
+	}
+	/* a new position, superseding the one there is, if any */
+	return pos_add(m, tag, sec, l, s, p) > 0U ? 0 : -1;
+}
+
+struct __qty_s
+be_mmap_add_pos(mmdb_t m, uint64_t tag, uint64_t sec, double l, double s)
+{
+	struct __qty_s res = {._long = NAN, ._shrt = NAN};
+	uint64_t p;
+
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return res;
+	} else if (sec == 0U || sec > mm_nrec(m, MM_SEC)) {
+		return res;
+	} else if ((p = pos_find(m, tag, sec)) > 0U) {
+		l += mm_pos(m, p)->l;
+		s += mm_pos(m, p)->s;
+	}
+	if (pos_add(m, tag, sec, l, s, p) > 0U) {
+		res._long = l;
+		res._shrt = s;
+	}
+	return res;
+}
+
+size_t
+be_mmap_get_npos(mmdb_t m, uint64_t tag)
+{
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return 0U;
+	}
+	return mm_tag(m, tag)->npos;
+}
+
+void
+be_mmap_get_pos(
+	mmdb_t m, uint64_t tag,
+	int(*cb)(char*, double, double, void*), void *clo)
+{
+	struct mm_htab_s supd = {0U};
+
+	if (tag == 0U || tag > mm_nrec(m, MM_TAG)) {
+		return;
+	}
+	for (uint64_t p = mm_tag(m, tag)->pos; p; p = mm_pos(m, p)->prev) {
+		const struct mm_pos_s *q = mm_pos(m, p);
+		const struct mm_sym_s *y = mm_sym(m, mm_sec(m, q->sec)->name);
+
+		if (pos_supdp(&supd, p, q)) {
+			continue;
+		}
+#if defined UMPF_AUTO_PRUNE
+		if (q->l == 0.0 && q->s == 0.0) {
+			/* flattened */
+			continue;
+		}
+#endif	/* UMPF_AUTO_PRUNE */
+		if (cb(strndup(y->data, y->len), q->l, q->s, clo)) {
+			break;
+		}
+	}
+	ht_fini(&supd);
+	return;
+}
+
+
+void
+be_mmap_lst_pf(mmdb_t m, int(*cb)(char*, void*), void *clo)
+{
+	for (uint64_t i = 1, n = mm_nrec(m, MM_PF); i <= n; i++) {
+		const struct mm_sym_s *y = mm_sym(m, mm_pf(m, i)->name);
+
+		if (cb(strndup(y->data, y->len), clo)) {
+			break;
+		}
+	}
+	return;
+}
+
+void
+be_mmap_lst_tag(
+	mmdb_t m, uint64_t pf, int(*cb)(uint64_t, time_t, void*), void *clo)
+{
+	const struct mm_tix_s *x;
+
+	if (pf == 0U || pf > m->ztix) {
+		return;
+	}
+	x = m->tix + (pf - 1U);
+	for (size_t i = 0; i < x->n; i++) {
+		if (cb(x->tags[i], mm_tag(m, x->tags[i])->stamp, clo)) {
+			break;
+		}
+	}
+	return;
+}
+
+/* be-mmap.c ends here */
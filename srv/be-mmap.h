@@ -0,0 +1,182 @@
+/*** be-mmap.h -- memory-mapped storage backend
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if !defined INCLUDED_be_mmap_h_
+#define INCLUDED_be_mmap_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "umpf.h"
+
+#if defined __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* portfolios, tags and positions in memory-mapped files of fixed-size
+ * records, which are only ever appended to, plus a dictionary of the
+ * symbols they refer to; a store is meant for one connexion only.
+ * Portfolios, securities, tags and positions are identified by their
+ * record number plus 1, so 0 is never a valid id. */
+typedef struct mmdb_s *mmdb_t;
+
+
+/**
+ * Open (or create) the store in directory DIR. */
+extern mmdb_t be_mmap_open(const char *dir);
+
+/**
+ * Close store M, writing back whatever's still in the page cache.
+ * Changes made outside of transactions are committed, those of an
+ * open transaction are lost. */
+extern void be_mmap_close(mmdb_t m);
+
+/**
+ * Start a transaction on M, nested ones are savepoints.
+ * Return 0 on success, -1 otherwise. */
+extern int be_mmap_begin(mmdb_t m);
+
+/**
+ * Commit the innermost transaction on M, return 0 on success.
+ * The outermost one is written back to disk before it returns, on
+ * failure it's still open and should be rolled back. */
+extern int be_mmap_commit(mmdb_t m);
+
+/**
+ * Undo everything since the innermost `be_mmap_begin()'. */
+extern void be_mmap_rollback(mmdb_t m);
+
+
+/**
+ * Return the id of portfolio MNEMO, creating it if need be, or 0. */
+extern uint64_t be_mmap_pf(mmdb_t m, const char *mnemo);
+
+/**
+ * Return the id of portfolio MNEMO, or 0 if there's no such thing. */
+extern uint64_t be_mmap_find_pf(mmdb_t m, const char *mnemo);
+
+/**
+ * Return the id of security MNEMO in portfolio PF, creating it if need
+ * be, or 0. */
+extern uint64_t be_mmap_sec(mmdb_t m, uint64_t pf, const char *mnemo);
+
+/**
+ * Return the id of security MNEMO in portfolio PF, or 0. */
+extern uint64_t be_mmap_find_sec(mmdb_t m, uint64_t pf, const char *mnemo);
+
+/**
+ * Set the description of portfolio PF, or of security SEC, to DESCR.
+ * Return 0 on success, -1 otherwise. */
+extern int be_mmap_set_pf_descr(mmdb_t m, uint64_t pf, struct __satell_s d);
+extern int be_mmap_set_sec_descr(mmdb_t m, uint64_t sec, struct __satell_s d);
+
+/**
+ * Return a copy of the description of portfolio PF, or of security SEC,
+ * to be free()d by the caller. */
+extern struct __satell_s be_mmap_get_pf_descr(mmdb_t m, uint64_t pf);
+extern struct __satell_s be_mmap_get_sec_descr(mmdb_t m, uint64_t sec);
+
+
+/**
+ * Create an empty tag for portfolio PF at STAMP, return its id or 0. */
+extern uint64_t be_mmap_new_tag(mmdb_t m, uint64_t pf, time_t stamp);
+
+/**
+ * Copy the positions of tag FROM into the fresh tag TAG.
+ * Return 0 on success, -1 otherwise. */
+extern int be_mmap_copy_tag(mmdb_t m, uint64_t tag, uint64_t from);
+
+/**
+ * Return the most recent tag of PF whose stamp isn't younger than
+ * *STAMP, or the most recent tag if STAMP is NULL, and put its stamp
+ * into *TSTAMP.  Ties go to the younger tag, 0 if there's none. */
+extern uint64_t
+be_mmap_get_tag(mmdb_t m, uint64_t pf, const time_t *stamp, time_t *tstamp);
+
+/**
+ * Return the hash over the positions of TAG, 0 if none's been set. */
+extern uint64_t be_mmap_get_hash(mmdb_t m, uint64_t tag);
+
+/**
+ * Record HASH as the hash over the positions of TAG. */
+extern int be_mmap_set_hash(mmdb_t m, uint64_t tag, uint64_t hash);
+
+/**
+ * Return the most recently created tag of PF with hash HASH, or 0. */
+extern uint64_t be_mmap_find_hash(mmdb_t m, uint64_t pf, uint64_t hash);
+
+/**
+ * Set the position of security SEC in TAG to L long and S short.
+ * Return 0 on success, -1 otherwise. */
+extern int
+be_mmap_set_pos(mmdb_t m, uint64_t tag, uint64_t sec, double l, double s);
+
+/**
+ * Add L and S to the position of security SEC in TAG, return the sums
+ * or NANs on failure. */
+extern struct __qty_s
+be_mmap_add_pos(mmdb_t m, uint64_t tag, uint64_t sec, double l, double s);
+
+/**
+ * Return the number of positions in TAG. */
+extern size_t be_mmap_get_npos(mmdb_t m, uint64_t tag);
+
+/**
+ * Call CB with a copy of the security mnemonic, to be free()d by the
+ * callee, and the long and short side of every position in TAG, until
+ * CB returns non-0. */
+extern void
+be_mmap_get_pos(
+	mmdb_t m, uint64_t tag,
+	int(*cb)(char*, double, double, void*), void *clo);
+
+
+/**
+ * Call CB with a copy of every portfolio mnemonic, to be free()d by the
+ * callee, until CB returns non-0. */
+extern void be_mmap_lst_pf(mmdb_t m, int(*cb)(char*, void*), void *clo);
+
+/**
+ * Call CB with every tag of PF, by stamp, until CB returns non-0. */
+extern void
+be_mmap_lst_tag(
+	mmdb_t m, uint64_t pf, int(*cb)(uint64_t, time_t, void*), void *clo);
+
+#if defined __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* INCLUDED_be_mmap_h_ */
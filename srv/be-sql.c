@@ -39,15 +39,21 @@
 # include "config.h"
 #endif	/* HAVE_CONFIG_H */
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
 #if defined WITH_MYSQL
 # include <mysql/mysql.h>
+# include <mysql/errmsg.h>
+# include <mysql/mysqld_error.h>
 #endif	/* WITH_MYSQL */
 #if defined WITH_SQLITE
 # include <sqlite3.h>
 #endif	/* WITH_SQLITE */
 #include "nifty.h"
 #include "be-sql.h"
+#include "be-mmap.h"
 
 #if defined UMPF_MOD
 # define BE_SQL		"/sql"
@@ -81,6 +87,8 @@ typedef enum {
 	BE_SQL_UNK,
 	BE_SQL_MYSQL,
 	BE_SQL_SQLITE,
+	/* not sql at all, but the same entry points */
+	BE_SQL_MMAP,
 } be_sql_type_t;
 
 typedef enum {
@@ -108,27 +116,240 @@ struct __bind_s {
 	size_t len;
 };
 
+/* mnemonic<->id caches, ids are never reused so the caches are good
+ * for as long as the connexion, entries are keyed by a scope (the
+ * portfolio id for securities, 0 for portfolios) and the mnemonic */
+typedef struct __idc_s *__idc_t;
+typedef struct __idc_ent_s *__idc_ent_t;
+
+struct __idc_ent_s {
+	__idc_ent_t chain;
+	__idc_ent_t rchain;
+	uint64_t scope;
+	uint64_t id;
+	unsigned int hash;
+	char key[];
+};
+
+struct __idc_s {
+	size_t nent;
+	size_t mask;
+	/* by scope and key, and by id */
+	__idc_ent_t *tbl;
+	__idc_ent_t *rtbl;
+};
+
+/* prepared statements, keyed by the (static) query string they were
+ * prepared from, a statement in use is marked busy so that another
+ * prep of the same query gets a fresh (uncached) statement */
+#define BE_SQL_NSTMT	(64U)
+
+struct __stmt_s {
+	const char *qry;
+	void *stmt;
+	unsigned int busy;
+};
+
+struct __conn_s {
+	be_sql_type_t type;
+	void *h;
+	/* portfolio short -> portfolio_id */
+	struct __idc_s pfs[1];
+	/* portfolio_id, security short -> security_id, and back */
+	struct __idc_s secs[1];
+	/* statement cache, open addressing on the query pointer */
+	struct __stmt_s stmts[BE_SQL_NSTMT];
+	/* transaction nesting depth, nested ones are savepoints */
+	unsigned int txn;
+	/* whether the open transaction has created portfolios */
+	unsigned int newpf;
+	/* mysql's id for the session the cached statements belong to */
+	unsigned long int sid;
+};
+
 static inline dbconn_t
-be_sql_set_type(void *conn, be_sql_type_t type)
+be_sql_make_conn(void *conn, be_sql_type_t type)
 {
-	return (void*)((long int)conn | type);
+	struct __conn_s *res;
+
+	if (UNLIKELY(conn == NULL)) {
+		return NULL;
+	}
+	res = xnew(*res);
+	memset(res, 0, sizeof(*res));
+	res->type = type;
+	res->h = conn;
+	return res;
 }
 
 static inline be_sql_type_t
 be_sql_get_type(dbconn_t conn)
 {
-	/* we abuse the last 3 bits of the conn pointer */
-	return (be_sql_type_t)((long int)conn & 0x07);
+	if (UNLIKELY(conn == NULL)) {
+		return BE_SQL_UNK;
+	}
+	return ((struct __conn_s*)conn)->type;
 }
 
 static inline void*
 be_sql_get_conn(dbconn_t conn)
 {
-	/* we abuse the last 3 bits of the conn pointer */
-	return (void*)((long int)conn & ~0x07);
+	return ((struct __conn_s*)conn)->h;
 }
 
-static char gbuf[4096];
+static inline __idc_t
+be_sql_pfs(dbconn_t conn)
+{
+	return ((struct __conn_s*)conn)->pfs;
+}
+
+static inline __idc_t
+be_sql_secs(dbconn_t conn)
+{
+	return ((struct __conn_s*)conn)->secs;
+}
+
+static inline struct __stmt_s*
+be_sql_stmts(dbconn_t conn)
+{
+	return ((struct __conn_s*)conn)->stmts;
+}
+
+/* scratch space for binding, one per thread as workers share this */
+static __thread char gbuf[4096];
+
+
+
+static unsigned int
+__idc_hash(uint64_t scope, const char *key)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)scope ^ (uint32_t)(scope >> 32U);
+
+	/* fnv-1a */
+	for (const unsigned char *p = (const void*)key; *p; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static inline size_t
+__idc_rslot(__idc_t c, uint64_t id)
+{
+	return (size_t)(id * 0x9e3779b97f4a7c15ULL >> 32U) & c->mask;
+}
+
+static uint64_t
+__idc_get(__idc_t c, uint64_t scope, const char *key)
+{
+	unsigned int h;
+
+	if (c->tbl == NULL) {
+		return 0UL;
+	}
+	h = __idc_hash(scope, key);
+	for (__idc_ent_t e = c->tbl[h & c->mask]; e != NULL; e = e->chain) {
+		if (e->hash == h && e->scope == scope && !strcmp(e->key, key)) {
+			return e->id;
+		}
+	}
+	return 0UL;
+}
+
+static const char*
+__idc_rget(__idc_t c, uint64_t id)
+{
+	if (c->rtbl == NULL) {
+		return NULL;
+	}
+	for (__idc_ent_t e = c->rtbl[__idc_rslot(c, id)]; e; e = e->rchain) {
+		if (e->id == id) {
+			return e->key;
+		}
+	}
+	return NULL;
+}
+
+static void
+__idc_grow(__idc_t c)
+{
+	size_t nu_mask = c->tbl ? (c->mask + 1U) * 2U - 1U : 255U;
+	__idc_ent_t *nu_tbl = calloc(nu_mask + 1U, sizeof(*nu_tbl));
+	__idc_ent_t *nu_rtbl = calloc(nu_mask + 1U, sizeof(*nu_rtbl));
+	size_t ol_mask = c->mask;
+
+	if (UNLIKELY(nu_tbl == NULL || nu_rtbl == NULL)) {
+		free(nu_tbl);
+		free(nu_rtbl);
+		return;
+	}
+	c->mask = nu_mask;
+	for (size_t i = 0; c->tbl != NULL && i <= ol_mask; i++) {
+		for (__idc_ent_t e = c->tbl[i], nx; e != NULL; e = nx) {
+			size_t rs = __idc_rslot(c, e->id);
+
+			nx = e->chain;
+			e->chain = nu_tbl[e->hash & nu_mask];
+			nu_tbl[e->hash & nu_mask] = e;
+			e->rchain = nu_rtbl[rs];
+			nu_rtbl[rs] = e;
+		}
+	}
+	free(c->tbl);
+	free(c->rtbl);
+	c->tbl = nu_tbl;
+	c->rtbl = nu_rtbl;
+	return;
+}
+
+static void
+__idc_put(__idc_t c, uint64_t scope, const char *key, uint64_t id)
+{
+	size_t ksz = strlen(key);
+	__idc_ent_t e;
+	size_t rs;
+
+	if (UNLIKELY(id == 0UL)) {
+		return;
+	} else if (c->tbl == NULL || c->nent >= c->mask) {
+		__idc_grow(c);
+		if (UNLIKELY(c->tbl == NULL)) {
+			return;
+		}
+	}
+	if (__idc_get(c, scope, key)) {
+		/* ids don't change */
+		return;
+	} else if ((e = malloc(sizeof(*e) + ksz + 1U)) == NULL) {
+		return;
+	}
+	e->scope = scope;
+	e->id = id;
+	e->hash = __idc_hash(scope, key);
+	memcpy(e->key, key, ksz + 1U);
+	e->chain = c->tbl[e->hash & c->mask];
+	c->tbl[e->hash & c->mask] = e;
+	rs = __idc_rslot(c, id);
+	e->rchain = c->rtbl[rs];
+	c->rtbl[rs] = e;
+	c->nent++;
+	return;
+}
+
+static void
+__idc_fini(__idc_t c)
+{
+	for (size_t i = 0; c->tbl != NULL && i <= c->mask; i++) {
+		for (__idc_ent_t e = c->tbl[i], nx; e != NULL; e = nx) {
+			nx = e->chain;
+			free(e);
+		}
+	}
+	free(c->tbl);
+	free(c->rtbl);
+	memset(c, 0, sizeof(*c));
+	return;
+}
 
 
 #if defined WITH_MYSQL
@@ -165,6 +386,36 @@ be_mysql_prep(dbconn_t conn, const char *qry, size_t qlen)
 	return NULL;
 }
 
+static int
+be_mysql_exec(dbstmt_t stmt)
+{
+/* execute STMT and buffer its result set, if any, in one go,
+ * return -2 if STMT is beyond repair, -1 on other errors */
+	if (mysql_stmt_execute(stmt) == 0 &&
+	    (mysql_stmt_field_count(stmt) == 0 ||
+	     mysql_stmt_store_result(stmt) == 0)) {
+		return 0;
+	}
+	switch (mysql_stmt_errno(stmt)) {
+	case CR_SERVER_LOST:
+	case CR_SERVER_GONE_ERROR:
+	case ER_UNKNOWN_STMT_HANDLER:
+		/* the reconnect leaves prepared statements behind */
+		return -2;
+	default:
+		break;
+	}
+	return -1;
+}
+
+static void
+be_mysql_reset(dbstmt_t stmt)
+{
+	(void)mysql_stmt_free_result(stmt);
+	(void)mysql_stmt_reset(stmt);
+	return;
+}
+
 static uint64_t
 be_mysql_last_rowid(dbconn_t conn)
 {
@@ -186,6 +437,117 @@ be_sqlite_open(const char *file)
 	sqlite3 *res;
 	sqlite3_open(file, &res);
 	sqlite3_exec(res, "PRAGMA synchronous=OFF;", NULL, NULL, NULL);
+	/* other connexions (workers) might hold the lock, be patient */
+	sqlite3_busy_timeout(res, 5000);
+	return res;
+}
+
+static dbconn_t
+be_sqlite_open_ro(const char *file)
+{
+	sqlite3 *res;
+
+	if (sqlite3_open_v2(file, &res, SQLITE_OPEN_READONLY, NULL)) {
+		sqlite3_close(res);
+		return NULL;
+	}
+	/* in wal mode readers only wait for checkpoints */
+	sqlite3_busy_timeout(res, 5000);
+	return res;
+}
+
+static int
+be_sqlite_copy(sqlite3 *to, sqlite3 *from)
+{
+/* copy the main database of FROM over that of TO */
+	sqlite3_backup *b;
+
+	if ((b = sqlite3_backup_init(to, "main", from, "main")) == NULL) {
+		return -1;
+	}
+	(void)sqlite3_backup_step(b, -1);
+	if (sqlite3_backup_finish(b) != SQLITE_OK) {
+		return -1;
+	}
+	return 0;
+}
+
+static dbconn_t
+be_sqlite_open_mem(const char *file, unsigned int *mark)
+{
+	sqlite3 *res;
+	sqlite3 *src;
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_open(":memory:", &res)) {
+		sqlite3_close(res);
+		return NULL;
+	} else if (sqlite3_open_v2(file, &src, SQLITE_OPEN_READONLY, NULL)) {
+		sqlite3_close(src);
+		sqlite3_close(res);
+		return NULL;
+	} else if (be_sqlite_copy(res, src) < 0) {
+		sqlite3_close(src);
+		sqlite3_close(res);
+		return NULL;
+	}
+	sqlite3_close(src);
+
+	/* the snapshot's mark lives in the user version */
+	*mark = 0U;
+	if (sqlite3_prepare_v2(
+		    res, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			*mark = (unsigned int)sqlite3_column_int(stmt, 0);
+		}
+		sqlite3_finalize(stmt);
+	}
+	return res;
+}
+
+static int
+be_sqlite_snapshot(sqlite3 *conn, const char *file, unsigned int mark)
+{
+	size_t fsz = strlen(file);
+	char qry[64U];
+	char tmp[fsz + sizeof(".tmp")];
+	char dir[fsz + 2U];
+	const char *sl;
+	sqlite3 *tgt;
+	int dfd;
+	int res = -1;
+
+	snprintf(qry, sizeof(qry), "PRAGMA user_version=%d", (int)mark);
+	if (sqlite3_exec(conn, qry, NULL, NULL, NULL) != SQLITE_OK) {
+		return -1;
+	}
+	/* go through a temporary so FILE is always a whole snapshot */
+	memcpy(tmp, file, fsz);
+	memcpy(tmp + fsz, ".tmp", sizeof(".tmp"));
+	(void)unlink(tmp);
+	if (sqlite3_open(tmp, &tgt) == SQLITE_OK &&
+	    be_sqlite_copy(tgt, conn) == 0) {
+		res = 0;
+	}
+	sqlite3_close(tgt);
+	if (res < 0 || rename(tmp, file) < 0) {
+		(void)unlink(tmp);
+		return -1;
+	}
+	/* the rename only sticks once FILE's directory is synced, and
+	 * the caller's about to drop the journal */
+	if ((sl = strrchr(file, '/')) != NULL) {
+		memcpy(dir, file, sl - file + 1U);
+		dir[sl - file + 1U] = '\0';
+	} else {
+		memcpy(dir, ".", 2U);
+	}
+	if ((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		return -1;
+	} else if (fsync(dfd) < 0) {
+		res = -1;
+	}
+	close(dfd);
 	return res;
 }
 
@@ -199,6 +561,15 @@ be_sqlite_prep(dbconn_t conn, const char *qry, size_t qlen)
 	return stmt;
 }
 
+static void
+be_sqlite_reset(dbstmt_t stmt)
+{
+	/* bindings may point to gbuf or the caller's strings */
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return;
+}
+
 static uint64_t
 be_sqlite_last_rowid(dbconn_t conn)
 {
@@ -214,14 +585,14 @@ be_sql_open(const char *h, const char *u, const char *pw, const char *sch)
 	if (h == NULL && u == NULL && pw == NULL && sch != NULL) {
 #if defined WITH_SQLITE
 		void *tmp = be_sqlite_open(sch);
-		res = be_sql_set_type(tmp, BE_SQL_SQLITE);
+		res = be_sql_make_conn(tmp, BE_SQL_SQLITE);
 #else  /* !WITH_SQLITE */
 		res = NULL;
 #endif	/* WITH_SQLITE */
 	} else {
 #if defined WITH_MYSQL
 		void *tmp = be_mysql_open(h, u, pw, sch);
-		res = be_sql_set_type(tmp, BE_SQL_MYSQL);
+		res = be_sql_make_conn(tmp, BE_SQL_MYSQL);
 #else  /* !WITH_MYSQL */
 		res = NULL;
 #endif	/* WITH_MYSQL */
@@ -230,9 +601,73 @@ be_sql_open(const char *h, const char *u, const char *pw, const char *sch)
 	return res;
 }
 
+DEFUN dbconn_t
+be_sql_open_ro(const char *sch)
+{
+	dbconn_t res = NULL;
+#if defined WITH_SQLITE
+	void *tmp = be_sqlite_open_ro(sch);
+	res = be_sql_make_conn(tmp, BE_SQL_SQLITE);
+#endif	/* WITH_SQLITE */
+	BESQL_INFO_LOG("read-only db handle %p\n", res);
+	return res;
+}
+
+DEFUN dbconn_t
+be_sql_open_mmap(const char *dir)
+{
+	dbconn_t res;
+	mmdb_t tmp;
+
+	if ((tmp = be_mmap_open(dir)) == NULL) {
+		BESQL_ERR_LOG("cannot open store in %s\n", dir);
+		return NULL;
+	}
+	res = be_sql_make_conn(tmp, BE_SQL_MMAP);
+	BESQL_INFO_LOG("mmap store handle %p\n", res);
+	return res;
+}
+
+DEFUN dbconn_t
+be_sql_open_mem(const char *file, unsigned int *mark)
+{
+	dbconn_t res = NULL;
+#if defined WITH_SQLITE
+	void *tmp = be_sqlite_open_mem(file, mark);
+	res = be_sql_make_conn(tmp, BE_SQL_SQLITE);
+#endif	/* WITH_SQLITE */
+	BESQL_INFO_LOG("in-memory db handle %p\n", res);
+	return res;
+}
+
+DEFUN int
+be_sql_snapshot(dbconn_t conn, const char *file, unsigned int mark)
+{
+	if (be_sql_get_type(conn) != BE_SQL_SQLITE) {
+		return -1;
+	} else if (((struct __conn_s*)conn)->txn) {
+		/* only committed stuff goes into snapshots */
+		return -1;
+	}
+#if defined WITH_SQLITE
+	if (be_sqlite_snapshot(be_sql_get_conn(conn), file, mark) < 0) {
+		BESQL_ERR_LOG("cannot snapshot to %s\n", file);
+		return -1;
+	}
+	return 0;
+#else  /* !WITH_SQLITE */
+	return -1;
+#endif	/* WITH_SQLITE */
+}
+
+static void be_sql_fin_all(dbconn_t conn);
+
 DEFUN void
 be_sql_close(dbconn_t conn)
 {
+	if (conn != NULL) {
+		be_sql_fin_all(conn);
+	}
 	switch (be_sql_get_type(conn)) {
 	case BE_SQL_UNK:
 	default:
@@ -248,13 +683,136 @@ be_sql_close(dbconn_t conn)
 		be_sqlite_close(be_sql_get_conn(conn));
 #endif	/* WITH_SQLITE */
 		break;
+	case BE_SQL_MMAP:
+		be_mmap_close(be_sql_get_conn(conn));
+		break;
 	}
+	if (conn != NULL) {
+		__idc_fini(be_sql_pfs(conn));
+		__idc_fini(be_sql_secs(conn));
+		xfree(conn);
+	}
+	return;
+}
+
+DEFUN void
+be_sql_thread_init(void)
+{
+#if defined WITH_MYSQL
+	mysql_thread_init();
+#endif	/* WITH_MYSQL */
+	return;
+}
+
+DEFUN void
+be_sql_thread_fini(void)
+{
+#if defined WITH_MYSQL
+	mysql_thread_end();
+#endif	/* WITH_MYSQL */
+	return;
+}
+
+static struct __stmt_s*
+__stmt_slot(dbconn_t conn, const char *qry)
+{
+/* return the slot caching QRY or the empty slot it would go to,
+ * or NULL if the cache is full */
+	struct __stmt_s *stmts = be_sql_stmts(conn);
+	size_t i = ((uintptr_t)qry >> 4U) & (BE_SQL_NSTMT - 1);
+
+	for (size_t j = 0; j < BE_SQL_NSTMT; j++) {
+		struct __stmt_s *s = stmts + ((i + j) & (BE_SQL_NSTMT - 1));
+
+		if (s->qry == qry || s->qry == NULL) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static struct __stmt_s*
+__stmt_find(dbconn_t conn, dbstmt_t stmt)
+{
+	struct __stmt_s *stmts = be_sql_stmts(conn);
+
+	for (size_t i = 0; i < BE_SQL_NSTMT; i++) {
+		if (stmts[i].stmt == stmt) {
+			return stmts + i;
+		}
+	}
+	return NULL;
+}
+
+static void
+__stmt_close(dbconn_t conn, dbstmt_t stmt)
+{
+	switch (be_sql_get_type(conn)) {
+	case BE_SQL_UNK:
+	default:
+		/* don't know what to do */
+		break;
+
+	case BE_SQL_MYSQL:
+#if defined WITH_MYSQL
+		mysql_stmt_close(stmt);
+#endif	/* WITH_MYSQL */
+		break;
+
+	case BE_SQL_SQLITE:
+#if defined WITH_SQLITE
+		sqlite3_finalize(stmt);
+#endif	/* WITH_SQLITE */
+		break;
+	}
+	return;
+}
+
+static void
+__stmt_flush(dbconn_t conn)
+{
+/* forget about the cached statements, those in use are finalised by
+ * be_sql_fin() which won't find them in the cache anymore */
+	struct __stmt_s *stmts = be_sql_stmts(conn);
+
+	for (size_t i = 0; i < BE_SQL_NSTMT; i++) {
+		if (stmts[i].stmt != NULL && !stmts[i].busy) {
+			__stmt_close(conn, stmts[i].stmt);
+		}
+	}
+	memset(stmts, 0, BE_SQL_NSTMT * sizeof(*stmts));
 	return;
 }
 
 static dbstmt_t
 be_sql_prep(dbconn_t conn, const char *qry, size_t qlen)
 {
+	struct __stmt_s *s;
+	dbstmt_t res = NULL;
+
+	if (UNLIKELY(conn == NULL)) {
+		return NULL;
+	}
+#if defined WITH_MYSQL
+	if (be_sql_get_type(conn) == BE_SQL_MYSQL) {
+		struct __conn_s *c = conn;
+		unsigned long int sid = mysql_thread_id(be_sql_get_conn(conn));
+
+		if (UNLIKELY(c->sid != sid)) {
+			/* reconnected, the cached statements went with
+			 * the old session */
+			__stmt_flush(conn);
+			c->sid = sid;
+		}
+	}
+#endif	/* WITH_MYSQL */
+	if ((s = __stmt_slot(conn, qry)) != NULL &&
+		   s->stmt != NULL && !s->busy) {
+		/* reset and unbound already */
+		s->busy = 1U;
+		return s->stmt;
+	}
+
 	switch (be_sql_get_type(conn)) {
 	case BE_SQL_UNK:
 	default:
@@ -263,43 +821,79 @@ be_sql_prep(dbconn_t conn, const char *qry, size_t qlen)
 
 	case BE_SQL_MYSQL:
 #if defined WITH_MYSQL
-		return be_mysql_prep(be_sql_get_conn(conn), qry, qlen);
+		res = be_mysql_prep(be_sql_get_conn(conn), qry, qlen);
 #endif	/* WITH_MYSQL */
 		break;
 
 	case BE_SQL_SQLITE:
 #if defined WITH_SQLITE
-		return be_sqlite_prep(be_sql_get_conn(conn), qry, qlen);
+		res = be_sqlite_prep(be_sql_get_conn(conn), qry, qlen);
 #endif	/* WITH_SQLITE */
 		break;
 	}
-	return NULL;
+	if (res != NULL && s != NULL && s->stmt == NULL) {
+		s->qry = qry;
+		s->stmt = res;
+		s->busy = 1U;
+	}
+	return res;
 }
 
 static void
-be_sql_fin(dbconn_t conn, dbstmt_t stmt)
+be_sql_reset(dbconn_t conn, dbstmt_t stmt)
 {
+/* make STMT ready for another round of bind and exec */
 	switch (be_sql_get_type(conn)) {
 	case BE_SQL_UNK:
 	default:
-		/* don't know what to do */
 		break;
 
 	case BE_SQL_MYSQL:
 #if defined WITH_MYSQL
-		mysql_stmt_close(stmt);
+		be_mysql_reset(stmt);
 #endif	/* WITH_MYSQL */
 		break;
 
 	case BE_SQL_SQLITE:
 #if defined WITH_SQLITE
-		sqlite3_finalize(stmt);
+		be_sqlite_reset(stmt);
 #endif	/* WITH_SQLITE */
 		break;
 	}
 	return;
 }
 
+static void
+be_sql_fin(dbconn_t conn, dbstmt_t stmt)
+{
+/* hand STMT back to the cache, or finalise it if it isn't cached */
+	struct __stmt_s *s;
+
+	if (UNLIKELY(stmt == NULL)) {
+		return;
+	} else if ((s = __stmt_find(conn, stmt)) == NULL) {
+		__stmt_close(conn, stmt);
+		return;
+	}
+	be_sql_reset(conn, stmt);
+	s->busy = 0U;
+	return;
+}
+
+static void
+be_sql_fin_all(dbconn_t conn)
+{
+	struct __stmt_s *stmts = be_sql_stmts(conn);
+
+	for (size_t i = 0; i < BE_SQL_NSTMT; i++) {
+		if (stmts[i].stmt != NULL) {
+			__stmt_close(conn, stmts[i].stmt);
+		}
+	}
+	memset(stmts, 0, BE_SQL_NSTMT * sizeof(*stmts));
+	return;
+}
+
 static uint64_t
 be_sql_last_rowid(dbconn_t conn)
 {
@@ -680,74 +1274,275 @@ be_sqlite_fetch(dbstmt_t stmt, __bind_t b, size_t nb)
 		return -1;
 	}
 }
-#endif	/* WITH_SQLITE */
+#endif	/* WITH_SQLITE */
+
+static int
+be_sql_fetch(dbconn_t conn, dbstmt_t stmt, __bind_t b, size_t nb)
+{
+	int res = -1;
+
+	switch (be_sql_get_type(conn)) {
+	case BE_SQL_UNK:
+	default:
+		break;
+
+	case BE_SQL_MYSQL: {
+#if defined WITH_MYSQL
+		res = be_mysql_fetch(stmt, b, nb);
+#endif	/* WITH_MYSQL */
+		break;
+	}
+
+	case BE_SQL_SQLITE:
+#if defined WITH_SQLITE
+		res = be_sqlite_fetch(stmt, b, nb);
+#endif	/* WITH_SQLITE */
+		break;
+	}
+	return res;
+}
+
+static int
+be_sql_exec_stmt(dbconn_t conn, dbstmt_t stmt)
+{
+	switch (be_sql_get_type(conn)) {
+	case BE_SQL_UNK:
+	default:
+		return -1;
+
+	case BE_SQL_MYSQL: {
+#if defined WITH_MYSQL
+		int rc = be_mysql_exec(stmt);
+
+		if (UNLIKELY(rc == -2)) {
+			/* have everything prepared afresh */
+			__stmt_flush(conn);
+		}
+		return rc < 0 ? -1 : 0;
+#else  /* !WITH_MYSQL */
+		return -1;
+#endif	/* WITH_MYSQL */
+	}
+
+	case BE_SQL_SQLITE:
+		/* there is no explicit execute, we do the step here,
+		 * then when we fetch results we do another step */
+#if defined WITH_SQLITE
+		switch (sqlite3_step(stmt)) {
+		case SQLITE_DONE:
+		case SQLITE_ROW:
+			return 0;
+		default:
+			break;
+		}
+#endif	/* WITH_SQLITE */
+		return -1;
+	}
+}
+
+
+/* actual actions */
+/* tag mumbo jumbo */
+struct __tag_s {
+	uint64_t pf_id;
+	uint64_t tag_id;
+	time_t tag_stamp;
+	time_t log_stamp;
+};
+
+/* bumped whenever a portfolio is created, by any thread */
+static unsigned long int pf_gen;
+
+/* transactions */
+static int
+be_sql_exec(dbconn_t conn, const char *sql, size_t UNUSED(len))
+{
+/* run SQL which takes no parameters and yields no rows, sqlite goes
+ * by SQL's terminator rather than LEN */
+	switch (be_sql_get_type(conn)) {
+	case BE_SQL_UNK:
+	default:
+		break;
+
+	case BE_SQL_MYSQL:
+#if defined WITH_MYSQL
+		if (mysql_real_query(be_sql_get_conn(conn), sql, len) == 0) {
+			return 0;
+		}
+#endif	/* WITH_MYSQL */
+		break;
+
+	case BE_SQL_SQLITE:
+#if defined WITH_SQLITE
+		if (sqlite3_exec(
+			    be_sql_get_conn(conn), sql,
+			    NULL, NULL, NULL) == SQLITE_OK) {
+			return 0;
+		}
+#endif	/* WITH_SQLITE */
+		break;
+	}
+	BESQL_ERR_LOG("cannot execute %s\n", sql);
+	return -1;
+}
+
+DEFUN int
+be_sql_wal(dbconn_t conn)
+{
+	static const char qry[] = "PRAGMA journal_mode=WAL";
+
+	if (be_sql_get_type(conn) != BE_SQL_SQLITE) {
+		return -1;
+	}
+	return be_sql_exec(conn, qry, countof_m1(qry));
+}
+
+DEFUN int
+be_sql_pragma(dbconn_t conn, const char *key, const char *val)
+{
+	char qry[256U];
+	int len;
+
+	if (be_sql_get_type(conn) != BE_SQL_SQLITE) {
+		return -1;
+	}
+	/* keys come from our own list, values are plain words or numbers */
+	for (const char *p = val; *p; p++) {
+		if (!((*p >= '0' && *p <= '9') ||
+		      (*p >= 'A' && *p <= 'Z') ||
+		      (*p >= 'a' && *p <= 'z') ||
+		      *p == '-' || *p == '_')) {
+			BESQL_ERR_LOG("bogus value for %s: %s\n", key, val);
+			return -1;
+		}
+	}
+	len = snprintf(qry, sizeof(qry), "PRAGMA %s=%s", key, val);
+	if (len <= 0 || (size_t)len >= sizeof(qry)) {
+		return -1;
+	}
+	return be_sql_exec(conn, qry, len);
+}
+
+static int
+__savepoint(dbconn_t conn, const char *verb, unsigned int lvl)
+{
+/* VERB the savepoint for nesting level LVL, VERB is one of
+ * SAVEPOINT, RELEASE SAVEPOINT or ROLLBACK TO SAVEPOINT */
+	char qry[64U];
+	int len;
+
+	len = snprintf(qry, sizeof(qry), "%s umpf_%u", verb, lvl);
+	return be_sql_exec(conn, qry, len);
+}
+
+static void
+__txn_forget(dbconn_t conn)
+{
+	/* ids handed out since the begin are gone (and might be handed
+	 * out again), so forget everything we know */
+	__idc_fini(be_sql_pfs(conn));
+	__idc_fini(be_sql_secs(conn));
+	__atomic_add_fetch(&pf_gen, 1UL, __ATOMIC_RELEASE);
+	return;
+}
 
-static int
-be_sql_fetch(dbconn_t conn, dbstmt_t stmt, __bind_t b, size_t nb)
+static void
+__pf_created(dbconn_t conn)
 {
-	int res = -1;
-
-	switch (be_sql_get_type(conn)) {
-	case BE_SQL_UNK:
-	default:
-		break;
+/* portfolio lists are out of date, but only once it's committed,
+ * other connexions would list and cache the old state otherwise */
+	struct __conn_s *c = conn;
 
-	case BE_SQL_MYSQL: {
-#if defined WITH_MYSQL
-		res = be_mysql_fetch(stmt, b, nb);
-#endif	/* WITH_MYSQL */
-		break;
+	if (c->txn > 0U) {
+		c->newpf = 1U;
+		return;
 	}
+	__atomic_add_fetch(&pf_gen, 1UL, __ATOMIC_RELEASE);
+	return;
+}
 
-	case BE_SQL_SQLITE:
-#if defined WITH_SQLITE
-		res = be_sqlite_fetch(stmt, b, nb);
-#endif	/* WITH_SQLITE */
-		break;
+DEFUN int
+be_sql_begin(dbconn_t conn)
+{
+	static const char my_qry[] = "START TRANSACTION";
+	/* take the write lock now rather than failing to upgrade later */
+	static const char lite_qry[] = "BEGIN IMMEDIATE";
+	struct __conn_s *c = conn;
+	int res = -1;
+
+	if (UNLIKELY(conn == NULL)) {
+		return -1;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		/* nests by itself */
+		res = be_mmap_begin(be_sql_get_conn(conn));
+	} else if (c->txn > 0) {
+		/* nested, so it can fail on its own */
+		res = __savepoint(conn, "SAVEPOINT", c->txn);
+	} else if (be_sql_get_type(conn) == BE_SQL_MYSQL) {
+		res = be_sql_exec(conn, my_qry, countof_m1(my_qry));
+	} else if (be_sql_get_type(conn) == BE_SQL_SQLITE) {
+		res = be_sql_exec(conn, lite_qry, countof_m1(lite_qry));
+	}
+	if (res == 0) {
+		c->txn++;
 	}
 	return res;
 }
 
-static int
-be_sql_exec_stmt(dbconn_t conn, dbstmt_t stmt)
+DEFUN int
+be_sql_commit(dbconn_t conn)
 {
-	switch (be_sql_get_type(conn)) {
-	case BE_SQL_UNK:
-	default:
-		return -1;
+	static const char qry[] = "COMMIT";
+	struct __conn_s *c = conn;
 
-	case BE_SQL_MYSQL:
-#if defined WITH_MYSQL
-		return mysql_stmt_execute(stmt);
-#else  /* !WITH_MYSQL */
+	if (UNLIKELY(conn == NULL || c->txn == 0U)) {
 		return -1;
-#endif	/* WITH_MYSQL */
-
-	case BE_SQL_SQLITE:
-		/* there is no explicit execute, we do the step here,
-		 * then when we fetch results we do another step */
-#if defined WITH_SQLITE
-		switch (sqlite3_step(stmt)) {
-		case SQLITE_DONE:
-		case SQLITE_ROW:
-			return 0;
-		default:
-			break;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		if (be_mmap_commit(be_sql_get_conn(conn)) < 0) {
+			be_sql_rollback(conn);
+			return -1;
 		}
-#endif	/* WITH_SQLITE */
+	} else if (c->txn > 1U) {
+		if (__savepoint(conn, "RELEASE SAVEPOINT", c->txn - 1U) < 0) {
+			be_sql_rollback(conn);
+			return -1;
+		}
+	} else if (be_sql_exec(conn, qry, countof_m1(qry)) < 0) {
+		be_sql_rollback(conn);
 		return -1;
 	}
+	if (--c->txn == 0U && c->newpf) {
+		c->newpf = 0U;
+		__atomic_add_fetch(&pf_gen, 1UL, __ATOMIC_RELEASE);
+	}
+	return 0;
 }
 
-
-/* actual actions */
-/* tag mumbo jumbo */
-struct __tag_s {
-	uint64_t pf_id;
-	uint64_t tag_id;
-	time_t tag_stamp;
-	time_t log_stamp;
-};
+DEFUN void
+be_sql_rollback(dbconn_t conn)
+{
+	static const char qry[] = "ROLLBACK";
+	struct __conn_s *c = conn;
+
+	if (UNLIKELY(conn == NULL || c->txn == 0U)) {
+		return;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		c->txn--;
+		be_mmap_rollback(be_sql_get_conn(conn));
+	} else if (--c->txn > 0) {
+		/* undo the nested part only, then drop the savepoint */
+		(void)__savepoint(conn, "ROLLBACK TO SAVEPOINT", c->txn);
+		(void)__savepoint(conn, "RELEASE SAVEPOINT", c->txn);
+	} else {
+		(void)be_sql_exec(conn, qry, countof_m1(qry));
+	}
+	if (c->txn == 0U) {
+		/* bumped by __txn_forget() anyway */
+		c->newpf = 0U;
+	}
+	__txn_forget(conn);
+	return;
+}
 
 static uint64_t
 __get_pf_id(dbconn_t conn, const char *mnemo)
@@ -764,6 +1559,17 @@ INSERT INTO aou_umpf_portfolio (short) VALUES (?)";
 
 	if (UNLIKELY(mnemo == NULL)) {
 		return 0;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		if ((pf_id = be_mmap_find_pf(m, mnemo)) > 0) {
+			return pf_id;
+		} else if ((pf_id = be_mmap_pf(m, mnemo)) > 0) {
+			__pf_created(conn);
+		}
+		return pf_id;
+	} else if ((pf_id = __idc_get(be_sql_pfs(conn), 0UL, mnemo)) > 0) {
+		return pf_id;
 	}
 
 	mnlen = strlen(mnemo);
@@ -797,6 +1603,7 @@ INSERT INTO aou_umpf_portfolio (short) VALUES (?)";
 	be_sql_fin(conn, stmt);
 
 	if (pf_id > 0) {
+		__idc_put(be_sql_pfs(conn), 0UL, mnemo, pf_id);
 		return pf_id;
 	}
 	/* otherwise create a new one */
@@ -806,9 +1613,11 @@ INSERT INTO aou_umpf_portfolio (short) VALUES (?)";
 	/* execute */
 	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
 		pf_id = be_sql_last_rowid(conn);
+		__pf_created(conn);
 	}
 
 	be_sql_fin(conn, stmt);
+	__idc_put(be_sql_pfs(conn), 0UL, mnemo, pf_id);
 	return pf_id;
 }
 
@@ -823,6 +1632,7 @@ WHERE aou_umpf_portfolio.short = ? AND aou_umpf_security.short = ?";
 	size_t pf_mnlen = strlen(pf_mnemo);
 	size_t sec_mnlen = strlen(sec_mnemo);
 	uint64_t sec_id = 0UL;
+	uint64_t pf_id;
 	dbstmt_t stmt;
 	/* for our parameter binding later on */
 #if defined __C1X
@@ -844,7 +1654,16 @@ WHERE aou_umpf_portfolio.short = ? AND aou_umpf_security.short = ?";
 	b[1].txt = sec_mnemo;
 	b[1].len = sec_mnlen;
 #endif
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		pf_id = be_mmap_find_pf(m, pf_mnemo);
+		return be_mmap_find_sec(m, pf_id, sec_mnemo);
+	}
+	if ((pf_id = __idc_get(be_sql_pfs(conn), 0UL, pf_mnemo)) > 0 &&
+	    (sec_id = __idc_get(be_sql_secs(conn), pf_id, sec_mnemo)) > 0) {
+		return sec_id;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
 		return 0UL;
 	}
 
@@ -885,6 +1704,10 @@ INSERT INTO aou_umpf_security (portfolio_id, short) VALUES (?, ?)";
 
 	if (UNLIKELY(mnemo == NULL)) {
 		return 0UL;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return be_mmap_sec(be_sql_get_conn(conn), pf_id, mnemo);
+	} else if ((sec_id = __idc_get(be_sql_secs(conn), pf_id, mnemo)) > 0) {
+		return sec_id;
 	}
 
 	mnlen = strlen(mnemo);
@@ -920,6 +1743,7 @@ INSERT INTO aou_umpf_security (portfolio_id, short) VALUES (?, ?)";
 	be_sql_fin(conn, stmt);
 
 	if (sec_id > 0) {
+		__idc_put(be_sql_secs(conn), pf_id, mnemo, sec_id);
 		return sec_id;
 	}
 	/* otherwise create a new one */
@@ -931,9 +1755,143 @@ INSERT INTO aou_umpf_security (portfolio_id, short) VALUES (?, ?)";
 		sec_id = be_sql_last_rowid(conn);
 	}
 	be_sql_fin(conn, stmt);
+	__idc_put(be_sql_secs(conn), pf_id, mnemo, sec_id);
 	return sec_id;
 }
 
+static void
+__load_secs(dbconn_t conn, uint64_t pf_id)
+{
+/* put all securities of PF_ID into the id cache */
+	static const char qry[] = "\
+SELECT security_id, short FROM aou_umpf_security WHERE portfolio_id = ?";
+	dbstmt_t stmt;
+#if defined __C1X
+	struct __bind_s b[1] = {{
+			.type = BE_BIND_TYPE_INT64,
+			.i64 = pf_id,
+		}};
+#else
+	struct __bind_s b[1];
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = pf_id;
+#endif
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return;
+	}
+	/* bind the params */
+	be_sql_bind(conn, stmt, b, countof(b));
+	/* execute */
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[2];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		rb[1].type = BE_BIND_TYPE_TEXT;
+		rb[1].ptr = NULL;
+		for (; be_sql_fetch(conn, stmt, rb, countof(rb)) == 0;
+		     rb[1].ptr = NULL) {
+			if (rb[1].ptr != NULL) {
+				__idc_put(
+					be_sql_secs(conn), pf_id,
+					rb[1].ptr, rb[0].i64);
+				free(rb[1].ptr);
+			}
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return;
+}
+
+static const char*
+__get_sec_short(dbconn_t conn, uint64_t sec_id)
+{
+/* look up the short of SEC_ID, whatever portfolio it's in */
+	static const char qry[] = "\
+SELECT portfolio_id, short FROM aou_umpf_security WHERE security_id = ?";
+	dbstmt_t stmt;
+#if defined __C1X
+	struct __bind_s b[1] = {{
+			.type = BE_BIND_TYPE_INT64,
+			.i64 = sec_id,
+		}};
+#else
+	struct __bind_s b[1];
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = sec_id;
+#endif
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return NULL;
+	}
+	/* bind the params */
+	be_sql_bind(conn, stmt, b, countof(b));
+	/* execute */
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[2];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		rb[1].type = BE_BIND_TYPE_TEXT;
+		rb[1].ptr = NULL;
+		if (be_sql_fetch(conn, stmt, rb, countof(rb)) == 0 &&
+		    rb[1].ptr != NULL) {
+			__idc_put(
+				be_sql_secs(conn), rb[0].i64, rb[1].ptr, sec_id);
+			free(rb[1].ptr);
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return __idc_rget(be_sql_secs(conn), sec_id);
+}
+
+static int
+__set_last(dbconn_t conn, uint64_t pf_id, uint64_t tag_id, time_t stamp)
+{
+/* make TAG_ID the last tag of PF_ID unless there's a more recent one,
+ * ties go to the newer tag, just like in __get_tag() */
+	static const char my_qry[] = "\
+INSERT INTO aou_umpf_last (portfolio_id, tag_id) VALUES (?, ?) \
+ON DUPLICATE KEY UPDATE tag_id = IF(EXISTS(\
+SELECT 1 FROM aou_umpf_tag t \
+WHERE t.tag_id = aou_umpf_last.tag_id AND t.tag_stamp > ?), \
+tag_id, VALUES(tag_id))";
+	static const char lite_qry[] = "\
+INSERT INTO aou_umpf_last (portfolio_id, tag_id) VALUES (?, ?) \
+ON CONFLICT (portfolio_id) DO UPDATE SET tag_id = excluded.tag_id \
+WHERE NOT EXISTS (\
+SELECT 1 FROM aou_umpf_tag t \
+WHERE t.tag_id = aou_umpf_last.tag_id AND t.tag_stamp > ?)";
+	dbstmt_t stmt;
+	struct __bind_s b[3];
+	int res = -1;
+
+	switch (be_sql_get_type(conn)) {
+	case BE_SQL_MYSQL:
+		stmt = be_sql_prep(conn, my_qry, countof_m1(my_qry));
+		break;
+	case BE_SQL_SQLITE:
+		stmt = be_sql_prep(conn, lite_qry, countof_m1(lite_qry));
+		break;
+	default:
+		stmt = NULL;
+		break;
+	}
+	if (stmt == NULL) {
+		return -1;
+	}
+
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = pf_id;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = tag_id;
+	b[2].type = BE_BIND_TYPE_STAMP;
+	b[2].tm = stamp;
+	be_sql_bind(conn, stmt, b, countof(b));
+	res = be_sql_exec_stmt(conn, stmt);
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
 static uint64_t
 __new_tag_id(dbconn_t conn, uint64_t pf_id, time_t stamp)
 {
@@ -956,7 +1914,10 @@ INSERT INTO aou_umpf_tag (portfolio_id, tag_stamp) VALUES (?, ?)";
 	b[1].type = BE_BIND_TYPE_STAMP;
 	b[1].tm = stamp;
 #endif
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		/* the store keeps track of the last tag itself */
+		return be_mmap_new_tag(be_sql_get_conn(conn), pf_id, stamp);
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
 		return 0UL;
 	}
 
@@ -967,6 +1928,11 @@ INSERT INTO aou_umpf_tag (portfolio_id, tag_stamp) VALUES (?, ?)";
 		tag_id = be_sql_last_rowid(conn);
 	}
 	be_sql_fin(conn, stmt);
+	/* the caller's transaction keeps this and the tag together */
+	if (tag_id && UNLIKELY(__set_last(conn, pf_id, tag_id, stamp) < 0)) {
+		BESQL_ERR_LOG("cannot record last tag of %lu\n", pf_id);
+		return 0UL;
+	}
 	return tag_id;
 }
 
@@ -1013,44 +1979,175 @@ LIMIT 1";
 #else
 		struct __bind_s rb[1];
 		rb[0].type = BE_BIND_TYPE_INT64;
-		rb[0].i64 = 0UL,
-#endif
-		be_sql_fetch(conn, stmt, rb, countof(rb));
-		tag_id = rb[0].i64;
+		rb[0].i64 = 0UL,
+#endif
+		be_sql_fetch(conn, stmt, rb, countof(rb));
+		tag_id = rb[0].i64;
+	}
+	be_sql_fin(conn, stmt);
+	return tag_id;
+}
+
+static int
+__mmap_get_tag(
+	struct __tag_s *tag, dbconn_t conn, uint64_t pf_id, const time_t *stamp)
+{
+/* __get_last() for the mmap store, where it's the only way */
+	time_t ts;
+
+	tag->tag_id = be_mmap_get_tag(be_sql_get_conn(conn), pf_id, stamp, &ts);
+	if (tag->tag_id == 0UL) {
+		return -1;
+	}
+	tag->pf_id = pf_id;
+	tag->tag_stamp = ts;
+	tag->log_stamp = 0;
+	return 0;
+}
+
+static int
+__get_last(
+	struct __tag_s *tag, dbconn_t conn, uint64_t pf_id, const time_t *stamp)
+{
+/* look up the last tag of PF_ID in aou_umpf_last, if STAMP is non-NULL
+ * only if the tag isn't younger than *STAMP */
+	static const char qry[] = "\
+SELECT t.tag_id, t.tag_stamp, t.log_stamp \
+FROM aou_umpf_last l \
+JOIN aou_umpf_tag t ON t.tag_id = l.tag_id \
+WHERE l.portfolio_id = ?";
+	static const char stamp_qry[] = "\
+SELECT t.tag_id, t.tag_stamp, t.log_stamp \
+FROM aou_umpf_last l \
+JOIN aou_umpf_tag t ON t.tag_id = l.tag_id \
+WHERE l.portfolio_id = ? AND t.tag_stamp <= ?";
+	struct __bind_s b[2];
+	dbstmt_t stmt;
+	int res = -1;
+
+	if (stamp == NULL) {
+		stmt = be_sql_prep(conn, qry, countof_m1(qry));
+	} else {
+		stmt = be_sql_prep(conn, stamp_qry, countof_m1(stamp_qry));
+	}
+	if (stmt == NULL) {
+		return -1;
+	}
+
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = pf_id;
+	if (stamp != NULL) {
+		b[1].type = BE_BIND_TYPE_STAMP;
+		b[1].tm = *stamp;
+	}
+	be_sql_bind(conn, stmt, b, stamp != NULL ? 2U : 1U);
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[3];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		rb[1].type = BE_BIND_TYPE_STAMP;
+		rb[2].type = BE_BIND_TYPE_STAMP;
+
+		if (be_sql_fetch(conn, stmt, rb, countof(rb)) == 0) {
+			res = 0;
+			tag->tag_id = rb[0].i64;
+			tag->pf_id = pf_id;
+			tag->tag_stamp = rb[1].tm;
+			tag->log_stamp = rb[2].tm;
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+static int
+__get_tag(struct __tag_s *tag, dbconn_t conn, uint64_t pf_id, time_t stamp)
+{
+/* like __get_tag_id() but also find out about the time stamp */
+	static const char qry[] = "\
+SELECT tag_id, tag_stamp, log_stamp \
+FROM aou_umpf_tag \
+WHERE portfolio_id = ? AND tag_stamp <= ? \
+ORDER BY tag_stamp DESC, tag_id DESC \
+LIMIT 1";
+	dbstmt_t stmt;
+#if defined __C1X
+	struct __bind_s b[2] = {{
+			.type = BE_BIND_TYPE_INT64,
+			.i64 = pf_id,
+		}, {
+			.type = BE_BIND_TYPE_STAMP,
+			.tm = stamp,
+		}};
+#else
+	struct __bind_s b[2];
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = pf_id;
+	b[1].type = BE_BIND_TYPE_STAMP;
+	b[1].tm = stamp;
+#endif
+	int res = -1;
+
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return __mmap_get_tag(tag, conn, pf_id, &stamp);
+	} else if (__get_last(tag, conn, pf_id, &stamp) == 0) {
+		/* that's the common case, STAMP is now or thereabouts */
+		return 0;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
+	}
+
+	/* bind the params */
+	be_sql_bind(conn, stmt, b, countof(b));
+	/* execute */
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[3];
+
+		/* just assign the type wishes for the results */
+		rb[0].type = BE_BIND_TYPE_INT64;
+		rb[1].type = BE_BIND_TYPE_STAMP;
+		rb[2].type = BE_BIND_TYPE_STAMP;
+
+		if (LIKELY(be_sql_fetch(conn, stmt, rb, countof(rb)) == 0)) {
+			res = 0;
+			tag->tag_id = rb[0].i64;
+			tag->pf_id = pf_id;
+			tag->tag_stamp = rb[1].tm;
+			tag->log_stamp = rb[2].tm;
+		}
 	}
 	be_sql_fin(conn, stmt);
-	return tag_id;
+	return res;
 }
-
 static int
-__get_tag(struct __tag_s *tag, dbconn_t conn, uint64_t pf_id, time_t stamp)
+__get_last_tag(struct __tag_s *tag, dbconn_t conn, uint64_t pf_id)
 {
-/* like __get_tag_id() but also find out about the time stamp */
+/* like __get_tag() but don't care about the time stamp */
 	static const char qry[] = "\
 SELECT tag_id, tag_stamp, log_stamp \
 FROM aou_umpf_tag \
-WHERE portfolio_id = ? AND tag_stamp <= ? \
+WHERE portfolio_id = ? \
 ORDER BY tag_stamp DESC, tag_id DESC \
 LIMIT 1";
 	dbstmt_t stmt;
 #if defined __C1X
-	struct __bind_s b[2] = {{
+	struct __bind_s b[1] = {{
 			.type = BE_BIND_TYPE_INT64,
 			.i64 = pf_id,
-		}, {
-			.type = BE_BIND_TYPE_STAMP,
-			.tm = stamp,
 		}};
 #else
-	struct __bind_s b[2];
+	struct __bind_s b[1];
 	b[0].type = BE_BIND_TYPE_INT64;
 	b[0].i64 = pf_id;
-	b[1].type = BE_BIND_TYPE_STAMP;
-	b[1].tm = stamp;
 #endif
 	int res = -1;
 
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return __mmap_get_tag(tag, conn, pf_id, NULL);
+	} else if (__get_last(tag, conn, pf_id, NULL) == 0) {
+		/* primary key hit */
+		return 0;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
 		return -1;
 	}
 
@@ -1099,6 +2196,11 @@ UPDATE aou_umpf_portfolio SET description = ? WHERE portfolio_id = ?";
 
 	if (LIKELY(descr.data == NULL)) {
 		return (dbobj_t)pf_id;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		(void)be_mmap_set_pf_descr(m, pf_id, descr);
+		return (dbobj_t)pf_id;
 	}
 	/* otherwise there's more work to be done */
 	stmt = be_sql_prep(conn, pre, countof_m1(pre));
@@ -1144,6 +2246,10 @@ SELECT description FROM aou_umpf_portfolio WHERE short = ?";
 	if (UNLIKELY(pf_mnemo == NULL)) {
 		BESQL_ERR_LOG("get_descr(): mnemonic of size 0 not allowed\n");
 		return res;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		return be_mmap_get_pf_descr(m, be_mmap_find_pf(m, pf_mnemo));
 	}
 
 	/* get them statements prepared */
@@ -1219,31 +2325,143 @@ be_sql_new_tag_pf(dbconn_t conn, dbobj_t pf, time_t stamp)
 	return (dbobj_t)tag;
 }
 
-DEFUN dbobj_t
-be_sql_copy_tag(dbconn_t conn, const char *mnemo, time_t stamp)
-{
 #if defined UMPF_AUTO_PRUNE
 # define UMPF_PRUNE_SEXP	" AND (long_qty != 0.0 OR short_qty != 0.0)"
 #else  /* !UMPF_AUTO_PRUNE */
 # define UMPF_PRUNE_SEXP	""
 #endif	/* UMPF_AUTO_PRUNE */
-	struct __tag_s *tag, tmp;
-	uint64_t tag_id_old;
+
+/* copies of tags are sparse, they hold the positions that changed
+ * and refer to their parent for the rest, every UMPF_TAG_DEPTH-th
+ * copy is a full one so that chains stay short, 1 for full copies
+ * throughout */
+#if !defined UMPF_TAG_DEPTH
+# define UMPF_TAG_DEPTH		(16U)
+#endif	/* !UMPF_TAG_DEPTH */
+
+/* a tag and its ancestors, nearest first */
+#define UMPF_CHAIN_CTE	"\
+WITH RECURSIVE chain (tag_id) AS (\
+SELECT CAST(? AS SIGNED INTEGER) \
+UNION ALL \
+SELECT tp.parent_id FROM aou_umpf_tag_parent tp \
+JOIN chain ON tp.tag_id = chain.tag_id) "
+
+/* rows P holding their security's position in the nearest tag of
+ * the chain, the first clause keeps it from scanning all positions */
+#define UMPF_CHAIN_NEAREST	"\
+p.tag_id IN (SELECT tag_id FROM chain) AND \
+p.tag_id = (\
+SELECT MAX(q.tag_id) FROM aou_umpf_position q \
+WHERE q.security_id = p.security_id AND \
+q.tag_id IN (SELECT tag_id FROM chain))"
+
+/* the position of each security in the nearest tag of the chain */
+#define UMPF_CHAIN_POS	"\
+SELECT ?, p.security_id, p.long_qty, p.short_qty \
+FROM aou_umpf_position p \
+WHERE " UMPF_CHAIN_NEAREST
+
+static unsigned int
+__tag_depth(dbconn_t conn, uint64_t tag_id)
+{
+/* return the number of parents between TAG_ID and a full tag */
 	static const char qry[] = "\
-INSERT INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
-SELECT ? AS tag_id, security_id, long_qty, short_qty \
-FROM aou_umpf_position \
-WHERE tag_id = ?" UMPF_PRUNE_SEXP;
+SELECT depth FROM aou_umpf_tag_parent WHERE tag_id = ?";
+	struct __bind_s b[1];
+	unsigned int res = 0U;
+	dbstmt_t stmt;
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return 0U;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = tag_id;
+	be_sql_bind(conn, stmt, b, countof(b));
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[1];
+
+		rb[0].type = BE_BIND_TYPE_INT32;
+		if (be_sql_fetch(conn, stmt, rb, countof(rb)) == 0) {
+			res = (unsigned int)rb[0].i32;
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+static int
+__copy_tag(dbconn_t conn, uint64_t tag_id, uint64_t from)
+{
+/* make the fresh tag TAG_ID a copy of FROM, by reference or,
+ * if that makes the chain too long, by value */
+	static const char parq[] = "\
+INSERT INTO aou_umpf_tag_parent (tag_id, parent_id, depth) \
+VALUES (?, ?, ?)";
+	static const char my_fullq[] = "\
+INSERT INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) "
+		UMPF_CHAIN_CTE UMPF_CHAIN_POS UMPF_PRUNE_SEXP;
+	static const char lite_fullq[] = UMPF_CHAIN_CTE "\
+INSERT INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) "
+		UMPF_CHAIN_POS UMPF_PRUNE_SEXP;
+	unsigned int depth;
+	struct __bind_s b[3];
 	dbstmt_t stmt;
+	int res;
+
+	if (from == 0UL) {
+		/* nothing to copy */
+		return 0;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		/* always by value, positions are cheap there */
+		return be_mmap_copy_tag(be_sql_get_conn(conn), tag_id, from);
+	} else if ((depth = __tag_depth(conn, from) + 1U) < UMPF_TAG_DEPTH) {
+		stmt = be_sql_prep(conn, parq, countof_m1(parq));
+		b[0].type = BE_BIND_TYPE_INT64;
+		b[0].i64 = tag_id;
+		b[1].type = BE_BIND_TYPE_INT64;
+		b[1].i64 = from;
+		b[2].type = BE_BIND_TYPE_INT32;
+		b[2].i32 = depth;
+	} else {
+		switch (be_sql_get_type(conn)) {
+		case BE_SQL_MYSQL:
+			stmt = be_sql_prep(conn, my_fullq, countof_m1(my_fullq));
+			break;
+		case BE_SQL_SQLITE:
+			stmt = be_sql_prep(
+				conn, lite_fullq, countof_m1(lite_fullq));
+			break;
+		default:
+			stmt = NULL;
+			break;
+		}
+		/* the chain starts at FROM, the copies are TAG_ID's */
+		b[0].type = BE_BIND_TYPE_INT64;
+		b[0].i64 = from;
+		b[1].type = BE_BIND_TYPE_INT64;
+		b[1].i64 = tag_id;
+		depth = 0U;
+	}
+	if (stmt == NULL) {
+		return -1;
+	}
+	be_sql_bind(conn, stmt, b, depth ? 3U : 2U);
+	res = be_sql_exec_stmt(conn, stmt);
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+DEFUN dbobj_t
+be_sql_copy_tag(dbconn_t conn, const char *mnemo, time_t stamp)
+{
+	struct __tag_s *tag, tmp;
+	uint64_t tag_id_old;
 
 	/* get portfolio */
 	if ((tmp.pf_id = __get_pf_id(conn, mnemo)) == 0) {
 		BESQL_ERR_LOG("copy_tag(): no portfolio id for %s\n", mnemo);
 		return NULL;
-	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
-		/* query prep must happen now or else we create a broken
-		 * tag in the next statement (or later in __new_tag_id) */
-		return NULL;
 	} else if (__get_tag(&tmp, conn, tmp.pf_id, stamp) == 0) {
 		/* everything's fine */
 		tag_id_old = tmp.tag_id;
@@ -1251,8 +2469,9 @@ WHERE tag_id = ?" UMPF_PRUNE_SEXP;
 		tag_id_old = 0;
 	}
 	/* create the new tag */
-	if ((tmp.tag_id = __new_tag_id(conn, tmp.pf_id, stamp)) == 0) {
-		/* fuck */
+	if ((tmp.tag_id = __new_tag_id(conn, tmp.pf_id, stamp)) == 0 ||
+	    __copy_tag(conn, tmp.tag_id, tag_id_old) < 0) {
+		/* fuck, the caller's transaction has to go */
 		BESQL_ERR_LOG("copy_tag(): cannot copy portfolio %s\n", mnemo);
 		return NULL;
 	}
@@ -1260,33 +2479,82 @@ WHERE tag_id = ?" UMPF_PRUNE_SEXP;
 	tmp.tag_stamp = stamp;
 	tag = xnew(*tag);
 	*tag = tmp;
-	/* copy the positions */
-	{
-#if defined __C1X
-		struct __bind_s b[2] = {{
-				.type = BE_BIND_TYPE_INT64,
-				.i64 = tag->tag_id,
-			}, {
-				.type = BE_BIND_TYPE_INT64,
-				.i64 = tag_id_old,
-			}};
-#else
-		struct __bind_s b[2];
-		b[0].type = BE_BIND_TYPE_INT64;
-		b[0].i64 = tag->tag_id;
-		b[1].type = BE_BIND_TYPE_INT64;
-		b[1].i64 = tag_id_old;
-#endif
-		be_sql_bind(conn, stmt, b, countof(b));
-		/* execute */
-		be_sql_exec_stmt(conn, stmt);
-		be_sql_fin(conn, stmt);
-	}
 
 	UMPF_DEBUG("tag_id <- %lu for pf_id %lu\n", tag->tag_id, tag->pf_id);
 	return (dbobj_t)tag;
 }
 
+DEFUN dbobj_t
+be_sql_copy_tag_pf(dbconn_t conn, dbobj_t pf, time_t stamp, tag_t from)
+{
+	struct __tag_s *tag;
+
+	if (from == 0UL) {
+		/* nothing to copy */
+		return be_sql_new_tag_pf(conn, pf, stamp);
+	}
+	tag = xnew(*tag);
+	tag->pf_id = (uint64_t)pf;
+	if ((tag->tag_id = __new_tag_id(conn, tag->pf_id, stamp)) == 0 ||
+	    __copy_tag(conn, tag->tag_id, from) < 0) {
+		BESQL_ERR_LOG("copy_tag(): cannot copy tag %lu\n", from);
+		xfree(tag);
+		return NULL;
+	}
+	tag->tag_stamp = stamp;
+	return (dbobj_t)tag;
+}
+
+DEFUN tag_t
+be_sql_find_hash(dbconn_t conn, const char *mnemo, uint64_t hash)
+{
+	static const char qry[] = "\
+SELECT tag_id FROM aou_umpf_tag_hash \
+WHERE portfolio_id = ? AND hash = ? \
+ORDER BY tag_id DESC \
+LIMIT 1";
+	struct __bind_s b[2];
+	tag_t res = 0UL;
+	dbstmt_t stmt;
+
+	if ((b[0].i64 = __get_pf_id(conn, mnemo)) == 0) {
+		return 0UL;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		return be_mmap_find_hash(m, b[0].i64, hash);
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return 0UL;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = (int64_t)hash;
+	be_sql_bind(conn, stmt, b, countof(b));
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[1];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		if (be_sql_fetch(conn, stmt, rb, countof(rb)) == 0) {
+			res = rb[0].i64;
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+DEFUN dbobj_t
+be_sql_alias_tag(dbconn_t conn, const char *mnemo, time_t stamp, tag_t from)
+{
+	uint64_t pf_id;
+
+	if ((pf_id = __get_pf_id(conn, mnemo)) == 0) {
+		BESQL_ERR_LOG("alias_tag(): no portfolio id for %s\n", mnemo);
+		return NULL;
+	}
+	/* a copy by reference is all an alias is */
+	return be_sql_copy_tag_pf(conn, (dbobj_t)pf_id, stamp, from);
+}
+
 DEFUN dbobj_t
 be_sql_get_tag(dbconn_t conn, const char *mnemo, time_t stamp)
 {
@@ -1309,6 +2577,36 @@ be_sql_get_tag(dbconn_t conn, const char *mnemo, time_t stamp)
 	return (dbobj_t)tag;
 }
 
+DEFUN dbobj_t
+be_sql_get_tag_pf(dbconn_t UNUSED(conn), dbobj_t pf, tag_t id, time_t stamp)
+{
+	struct __tag_s *tag = xnew(*tag);
+
+	tag->pf_id = (uint64_t)pf;
+	tag->tag_id = id;
+	tag->tag_stamp = stamp;
+	tag->log_stamp = 0;
+	return (dbobj_t)tag;
+}
+
+DEFUN dbobj_t
+be_sql_get_last_tag(dbconn_t conn, const char *mnemo)
+{
+	struct __tag_s *tag, tmp;
+	uint64_t pf_id;
+
+	/* get portfolio */
+	if ((pf_id = __get_pf_id(conn, mnemo)) == 0) {
+		BESQL_ERR_LOG("get_tag(): no portfolio id for %s\n", mnemo);
+		return NULL;
+	} else if (__get_last_tag(&tmp, conn, pf_id) != 0) {
+		return NULL;
+	}
+	tag = xnew(*tag);
+	*tag = tmp;
+	return (dbobj_t)tag;
+}
+
 DEFUN void
 be_sql_free_tag(dbconn_t UNUSED(conn), dbobj_t tag)
 {
@@ -1323,62 +2621,217 @@ be_sql_tag_get_id(dbconn_t UNUSED(conn), dbobj_t tag)
 	return t->tag_id;
 }
 
-DEFUN void
+DEFUN dbobj_t
+be_sql_tag_get_pf(dbconn_t UNUSED(conn), dbobj_t tag)
+{
+	struct __tag_s *t = (void*)tag;
+	return (dbobj_t)t->pf_id;
+}
+
+DEFUN uint64_t
+be_sql_tag_get_hash(dbconn_t conn, dbobj_t tag)
+{
+	static const char qry[] = "\
+SELECT hash FROM aou_umpf_tag_hash WHERE tag_id = ?";
+	struct __tag_s *t = (void*)tag;
+	struct __bind_s b[1];
+	uint64_t res = 0U;
+	dbstmt_t stmt;
+
+	if (t == NULL) {
+		return 0U;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return be_mmap_get_hash(be_sql_get_conn(conn), t->tag_id);
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return 0U;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = t->tag_id;
+	be_sql_bind(conn, stmt, b, countof(b));
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[1];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		if (be_sql_fetch(conn, stmt, rb, countof(rb)) == 0) {
+			res = (uint64_t)rb[0].i64;
+		}
+	}
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+DEFUN int
+be_sql_tag_set_hash(dbconn_t conn, dbobj_t tag, uint64_t hash)
+{
+	static const char qry[] = "\
+INSERT INTO aou_umpf_tag_hash (tag_id, portfolio_id, hash) \
+VALUES (?, ?, ?)";
+	struct __tag_s *t = (void*)tag;
+	struct __bind_s b[3];
+	dbstmt_t stmt;
+	int res;
+
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		return be_mmap_set_hash(m, t->tag_id, hash);
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = t->tag_id;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = t->pf_id;
+	b[2].type = BE_BIND_TYPE_INT64;
+	b[2].i64 = (int64_t)hash;
+	be_sql_bind(conn, stmt, b, countof(b));
+	res = be_sql_exec_stmt(conn, stmt);
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+/* we use replace into since auto-sparsity might be in effect */
+static const char set_pos_qry[] = "\
+REPLACE INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
+VALUES (?, ?, ?, ?)";
+
+static int
+__set_pos(
+	dbconn_t c, dbstmt_t stmt,
+	uint64_t tag_id, uint64_t sec_id, double l, double s)
+{
+#if defined __C1X
+	struct __bind_s b[4] = {{
+			.type = BE_BIND_TYPE_INT64,
+			.i64 = tag_id,
+		}, {
+			.type = BE_BIND_TYPE_INT64,
+			.i64 = sec_id,
+		}, {
+			.type = BE_BIND_TYPE_DOUBLE,
+			.dbl = l,
+		}, {
+			.type = BE_BIND_TYPE_DOUBLE,
+			.dbl = s,
+		}};
+#else
+	struct __bind_s b[4];
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = tag_id;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = sec_id;
+	b[2].type = BE_BIND_TYPE_DOUBLE;
+	b[2].dbl = l;
+	b[3].type = BE_BIND_TYPE_DOUBLE;
+	b[3].dbl = s;
+#endif
+	be_sql_bind(c, stmt, b, countof(b));
+	/* execute */
+	return be_sql_exec_stmt(c, stmt) == 0 ? 0 : -1;
+}
+
+DEFUN int
 be_sql_set_pos(dbconn_t c, dbobj_t tag, const char *mnemo, double l, double s)
 {
 	struct __tag_s *t = tag;
 	/* get security */
 	uint64_t sec_id;
 	dbstmt_t stmt;
-	/* we use replace into since auto-sparsity might be in effect */
-	static const char qry[] = "\
-REPLACE INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
-VALUES (?, ?, ?, ?)";
+	int res;
+
+	/* obtain a sec id first, get/creator */
+	if ((sec_id = __get_sec_id(c, t->pf_id, mnemo)) == 0UL) {
+		BESQL_ERR_LOG(
+			"set_pos(): no security id for pf %lu %s\n",
+			t->pf_id, mnemo);
+		return -1;
+	} else if (be_sql_get_type(c) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(c);
+
+		return be_mmap_set_pos(m, t->tag_id, sec_id, l, s);
+	} else if ((stmt = be_sql_prep(
+			    c, set_pos_qry, countof_m1(set_pos_qry))) == NULL) {
+		return -1;
+	}
+	res = __set_pos(c, stmt, t->tag_id, sec_id, l, s);
+	be_sql_fin(c, stmt);
+	return res;
+}
+
+DEFUN int
+be_sql_set_poss(
+	dbconn_t c, dbobj_t tag, const struct __ins_qty_s *poss, size_t nposs)
+{
+	struct __tag_s *t = tag;
+	uint64_t *sec_ids;
+	dbstmt_t stmt;
+	int res = 0;
 
-	/* obtain a sec id first, get/creator */
-	if ((sec_id = __get_sec_id(c, t->pf_id, mnemo)) == 0UL) {
-		BESQL_ERR_LOG(
-			"set_pos(): no security id for pf %lu %s\n",
-			t->pf_id, mnemo);
-		return;
-	} else if ((stmt = be_sql_prep(c, qry, countof_m1(qry))) == NULL) {
-		return;
+	if (UNLIKELY(nposs == 0)) {
+		return 0;
+	} else if (be_sql_get_type(c) == BE_SQL_MMAP) {
+		/* no round trips to save */
+		for (size_t i = 0; i < nposs && res == 0; i++) {
+			res = be_sql_set_pos(
+				c, tag, poss[i].ins->sym,
+				poss[i].qty->_long, poss[i].qty->_shrt);
+		}
+		return res;
+	} else if (UNLIKELY((sec_ids = malloc(
+					 nposs * sizeof(*sec_ids))) == NULL)) {
+		return -1;
 	}
-	/* bind the params */
-	{
-#if defined __C1X
-		struct __bind_s b[4] = {{
-				.type = BE_BIND_TYPE_INT64,
-				.i64 = t->tag_id,
-			}, {
-				.type = BE_BIND_TYPE_INT64,
-				.i64 = sec_id,
-			}, {
-				.type = BE_BIND_TYPE_DOUBLE,
-				.dbl = l,
-			}, {
-				.type = BE_BIND_TYPE_DOUBLE,
-				.dbl = s,
-			}};
-#else
-		struct __bind_s b[4];
-		b[0].type = BE_BIND_TYPE_INT64;
-		b[0].i64 = t->tag_id;
-		b[1].type = BE_BIND_TYPE_INT64;
-		b[1].i64 = sec_id;
-		b[2].type = BE_BIND_TYPE_DOUBLE;
-		b[2].dbl = l;
-		b[3].type = BE_BIND_TYPE_DOUBLE;
-		b[3].dbl = s;
-#endif
-		be_sql_bind(c, stmt, b, countof(b));
-		/* execute */
-		be_sql_exec_stmt(c, stmt);
-		be_sql_fin(c, stmt);
+	/* resolve all security ids first, if one is unknown we bulk-load
+	 * the portfolio's securities rather than asking one by one */
+	for (size_t i = 0, loaded = 0; i < nposs; i++) {
+		const char *mnemo = poss[i].ins->sym;
+
+		if (UNLIKELY(mnemo == NULL)) {
+			res = -1;
+			break;
+		} else if ((sec_ids[i] = __idc_get(
+				    be_sql_secs(c), t->pf_id, mnemo)) > 0) {
+			continue;
+		} else if (!loaded++) {
+			__load_secs(c, t->pf_id);
+		}
+		if ((sec_ids[i] = __get_sec_id(c, t->pf_id, mnemo)) == 0UL) {
+			BESQL_ERR_LOG(
+				"set_poss(): no security id for pf %lu %s\n",
+				t->pf_id, mnemo);
+			res = -1;
+			break;
+		}
 	}
-	return;
+	if (res < 0) {
+		goto out;
+	} else if ((stmt = be_sql_prep(
+			    c, set_pos_qry, countof_m1(set_pos_qry))) == NULL) {
+		res = -1;
+		goto out;
+	}
+	/* one statement, rebound for every row */
+	for (size_t i = 0; i < nposs && res == 0; i++) {
+		double l = poss[i].qty->_long;
+		double s = poss[i].qty->_shrt;
+
+		if (i > 0) {
+			be_sql_reset(c, stmt);
+		}
+		res = __set_pos(c, stmt, t->tag_id, sec_ids[i], l, s);
+	}
+	be_sql_fin(c, stmt);
+out:
+	free(sec_ids);
+	return res;
 }
 
+/* additive upserts, sqlite can hand back the sums right away, mysql
+ * has to be asked again */
+#if defined WITH_SQLITE && SQLITE_VERSION_NUMBER >= 3035000
+# define UMPF_UPSERT_RETURNING
+#endif	/* SQLITE_VERSION_NUMBER */
+
 DEFUN struct __qty_s
 be_sql_add_pos(dbconn_t c, dbobj_t tag, const char *mnemo, double l, double s)
 {
@@ -1386,12 +2839,39 @@ be_sql_add_pos(dbconn_t c, dbobj_t tag, const char *mnemo, double l, double s)
 	/* get security */
 	uint64_t sec_id;
 	dbstmt_t stmt;
+	static const char my_upsq[] = "\
+INSERT INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
+VALUES (?, ?, ?, ?) \
+ON DUPLICATE KEY UPDATE \
+long_qty = long_qty + VALUES(long_qty), \
+short_qty = short_qty + VALUES(short_qty)";
+	static const char lite_upsq[] = "\
+INSERT INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
+VALUES (?, ?, ?, ?) \
+ON CONFLICT (tag_id, security_id) DO UPDATE SET \
+long_qty = long_qty + excluded.long_qty, \
+short_qty = short_qty + excluded.short_qty"
+#if defined UMPF_UPSERT_RETURNING
+		" RETURNING long_qty, short_qty"
+#endif	/* UMPF_UPSERT_RETURNING */
+		;
 	static const char selq[] = "\
 SELECT long_qty, short_qty FROM aou_umpf_position \
 WHERE tag_id = ? AND security_id = ?";
-	static const char repq[] = "\
-REPLACE INTO aou_umpf_position (tag_id, security_id, long_qty, short_qty) \
-VALUES (?, ?, ?, ?)";
+	/* sparse tags get their own copy of the position first */
+	static const char my_cowq[] = "\
+INSERT IGNORE INTO aou_umpf_position \
+(tag_id, security_id, long_qty, short_qty) "
+		UMPF_CHAIN_CTE "\
+SELECT ?, security_id, long_qty, short_qty FROM aou_umpf_position \
+WHERE security_id = ? AND tag_id IN (SELECT tag_id FROM chain) \
+ORDER BY tag_id DESC LIMIT 1";
+	static const char lite_cowq[] = UMPF_CHAIN_CTE "\
+INSERT OR IGNORE INTO aou_umpf_position \
+(tag_id, security_id, long_qty, short_qty) \
+SELECT ?, security_id, long_qty, short_qty FROM aou_umpf_position \
+WHERE security_id = ? AND tag_id IN (SELECT tag_id FROM chain) \
+ORDER BY tag_id DESC LIMIT 1";
 	struct __bind_s b[4];
 	struct __qty_s res = {._long = NAN, ._shrt = NAN};
 
@@ -1401,42 +2881,93 @@ VALUES (?, ?, ?, ?)";
 			"add_pos(): no security id for pf %lu %s\n",
 			t->pf_id, mnemo);
 		return res;
-	} else if ((stmt = be_sql_prep(c, selq, countof_m1(selq))) == NULL) {
+	} else if (be_sql_get_type(c) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(c);
+
+		return be_mmap_add_pos(m, t->tag_id, sec_id, l, s);
+	}
+
+	switch (be_sql_get_type(c)) {
+	case BE_SQL_MYSQL:
+		stmt = be_sql_prep(c, my_cowq, countof_m1(my_cowq));
+		break;
+	case BE_SQL_SQLITE:
+		stmt = be_sql_prep(c, lite_cowq, countof_m1(lite_cowq));
+		break;
+	default:
+		stmt = NULL;
+		break;
+	}
+	if (stmt == NULL) {
 		return res;
 	}
-		
-	/* try and get the current positions */
 	b[0].type = BE_BIND_TYPE_INT64;
 	b[0].i64 = t->tag_id;
 	b[1].type = BE_BIND_TYPE_INT64;
-	b[1].i64 = sec_id;
-
-	be_sql_bind(c, stmt, b, 2);
-	/* execute */
-	be_sql_exec_stmt(c, stmt);
-	/* fetch results, reuse b[2]/b[3] */
-	b[2].type = BE_BIND_TYPE_DOUBLE;
-	b[2].dbl = 0.0;
-	b[3].type = BE_BIND_TYPE_DOUBLE;
-	b[3].dbl = 0.0;
-	be_sql_fetch(c, stmt, b + 2, 2);
-	/* and finish this part of the exercise */
+	b[1].i64 = t->tag_id;
+	b[2].type = BE_BIND_TYPE_INT64;
+	b[2].i64 = sec_id;
+	be_sql_bind(c, stmt, b, 3U);
+	if (UNLIKELY(be_sql_exec_stmt(c, stmt) < 0)) {
+		be_sql_fin(c, stmt);
+		return res;
+	}
 	be_sql_fin(c, stmt);
 
-	if ((stmt = be_sql_prep(c, repq, countof_m1(repq))) == NULL) {
-		/* fuck off silently */
+	switch (be_sql_get_type(c)) {
+	case BE_SQL_MYSQL:
+		stmt = be_sql_prep(c, my_upsq, countof_m1(my_upsq));
+		break;
+	case BE_SQL_SQLITE:
+		stmt = be_sql_prep(c, lite_upsq, countof_m1(lite_upsq));
+		break;
+	default:
+		stmt = NULL;
+		break;
+	}
+	if (stmt == NULL) {
 		return res;
 	}
 
-	/* fill in the new position values, reuse b[0] and b[1] */
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[0].i64 = t->tag_id;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = sec_id;
 	b[2].type = BE_BIND_TYPE_DOUBLE;
-	res._long = b[2].dbl += l;
+	b[2].dbl = l;
 	b[3].type = BE_BIND_TYPE_DOUBLE;
-	res._shrt = b[3].dbl += s;
+	b[3].dbl = s;
 
 	be_sql_bind(c, stmt, b, countof(b));
 	/* execute */
-	be_sql_exec_stmt(c, stmt);
+	if (UNLIKELY(be_sql_exec_stmt(c, stmt) < 0)) {
+		be_sql_fin(c, stmt);
+		return res;
+	}
+#if defined UMPF_UPSERT_RETURNING
+	if (be_sql_get_type(c) == BE_SQL_SQLITE) {
+		/* the sums are our result set, reuse b[2]/b[3] */
+		if (be_sql_fetch(c, stmt, b + 2, 2) == 0) {
+			res._long = b[2].dbl;
+			res._shrt = b[3].dbl;
+		}
+		be_sql_fin(c, stmt);
+		return res;
+	}
+#endif	/* UMPF_UPSERT_RETURNING */
+	be_sql_fin(c, stmt);
+
+	/* ask for the sums */
+	if ((stmt = be_sql_prep(c, selq, countof_m1(selq))) == NULL) {
+		return res;
+	}
+	be_sql_bind(c, stmt, b, 2);
+	/* execute */
+	if (LIKELY(be_sql_exec_stmt(c, stmt) == 0) &&
+	    be_sql_fetch(c, stmt, b + 2, 2) == 0) {
+		res._long = b[2].dbl;
+		res._shrt = b[3].dbl;
+	}
 	be_sql_fin(c, stmt);
 	return res;
 }
@@ -1453,9 +2984,10 @@ be_sql_get_npos(dbconn_t conn, dbobj_t tag)
 {
 	struct __tag_s *t = tag;
 	dbstmt_t stmt;
-	static const char qry[] = "\
-SELECT COUNT(security_id) FROM aou_umpf_position \
-WHERE tag_id = ?";
+	/* flattened positions don't count, just like in get_pos() */
+	static const char qry[] = UMPF_CHAIN_CTE "\
+SELECT COUNT(*) FROM aou_umpf_position p \
+WHERE " UMPF_CHAIN_NEAREST UMPF_PRUNE_SEXP;
 #if defined __C1X
 	struct __bind_s b[1] = {{
 			.type = BE_BIND_TYPE_INT64,
@@ -1468,7 +3000,9 @@ WHERE tag_id = ?";
 #endif
 	size_t npos = 0UL;
 
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return be_mmap_get_npos(be_sql_get_conn(conn), t->tag_id);
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
 		return 0UL;
 	}
 	/* bind the params */
@@ -1493,17 +3027,19 @@ WHERE tag_id = ?";
 	return npos;
 }
 
-DEFUN void
+DEFUN int
 be_sql_get_pos(
 	dbconn_t conn, dbobj_t tag,
 	int(*cb)(char*, double, double, void*), void *clo)
 {
 	struct __tag_s *t = tag;
 	dbstmt_t stmt;
-	static const char qry[] = "\
-SELECT short, long_qty, short_qty FROM aou_umpf_position \
-LEFT JOIN aou_umpf_security USING (security_id) \
-WHERE tag_id = ?";
+	/* security names come out of the id cache, each security's row
+	 * of the nearest tag in the chain comes first */
+	static const char qry[] = UMPF_CHAIN_CTE "\
+SELECT security_id, long_qty, short_qty FROM aou_umpf_position \
+WHERE tag_id IN (SELECT tag_id FROM chain) \
+ORDER BY security_id, tag_id DESC";
 #if defined __C1X
 	struct __bind_s b[1] = {{
 			.type = BE_BIND_TYPE_INT64,
@@ -1514,25 +3050,97 @@ WHERE tag_id = ?";
 	b[0].type = BE_BIND_TYPE_INT64;
 	b[0].i64 = t->tag_id;
 #endif
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
-		return;
+	struct {
+		uint64_t sec_id;
+		double l;
+		double s;
+	} *rows = NULL;
+	size_t nrows = 0UL;
+	bool loadp = false;
+	int res = -1;
+
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		/* straight off the mapped pages */
+		be_mmap_get_pos(be_sql_get_conn(conn), t->tag_id, cb, clo);
+		return 0;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
 	}
 	/* bind the params */
 	be_sql_bind(conn, stmt, b, countof(b));
-	/* execute */
+	/* execute, rows are buffered so that the names can be
+	 * looked up without another statement being in flight */
 	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
 		struct __bind_s mb[3];
 
 		/* just assign the type wishes for the results */
-		mb[0].type = BE_BIND_TYPE_TEXT;
+		mb[0].type = BE_BIND_TYPE_INT64;
 		mb[1].type = BE_BIND_TYPE_DOUBLE;
 		mb[2].type = BE_BIND_TYPE_DOUBLE;
 
-		while (be_sql_fetch(conn, stmt, mb, countof(mb)) == 0 &&
-		       cb(mb[0].ptr, mb[1].dbl, mb[2].dbl, clo) == 0);
+		res = 0;
+		while (be_sql_fetch(conn, stmt, mb, countof(mb)) == 0) {
+			if (nrows && rows[nrows - 1U].sec_id ==
+			    (uint64_t)mb[0].i64) {
+				/* overridden by a younger tag */
+				continue;
+			}
+			if ((nrows % 256U) == 0U) {
+				void *nu = realloc(
+					rows, (nrows + 256U) * sizeof(*rows));
+
+				if (UNLIKELY(nu == NULL)) {
+					/* half a portfolio is no portfolio */
+					BESQL_ERR_LOG("\
+get_pos(): cannot buffer positions of tag %lu\n", t->tag_id);
+					res = -1;
+					break;
+				}
+				rows = nu;
+			}
+			rows[nrows].sec_id = mb[0].i64;
+			rows[nrows].l = mb[1].dbl;
+			rows[nrows].s = mb[2].dbl;
+			if (__idc_rget(be_sql_secs(conn), mb[0].i64) == NULL) {
+				loadp = true;
+			}
+			nrows++;
+		}
 	}
 	be_sql_fin(conn, stmt);
-	return;
+	if (UNLIKELY(res < 0)) {
+		goto out;
+	}
+
+	if (loadp) {
+		/* one go for all the names we don't know yet */
+		__load_secs(conn, t->pf_id);
+	}
+	for (size_t i = 0; i < nrows; i++) {
+		const char *sym = __idc_rget(be_sql_secs(conn), rows[i].sec_id);
+		char *dup;
+
+#if defined UMPF_AUTO_PRUNE
+		if (rows[i].l == 0.0 && rows[i].s == 0.0) {
+			/* flattened in a sparse tag */
+			continue;
+		}
+#endif	/* UMPF_AUTO_PRUNE */
+		if (UNLIKELY(sym == NULL)) {
+			/* must be some other portfolio's */
+			sym = __get_sec_short(conn, rows[i].sec_id);
+		}
+		dup = sym != NULL ? strdup(sym) : NULL;
+
+		if (cb(dup, rows[i].l, rows[i].s, clo)) {
+			break;
+		}
+	}
+out:
+	if (rows != NULL) {
+		free(rows);
+	}
+	return res;
 }
 
 DEFUN dbobj_t
@@ -1564,6 +3172,11 @@ UPDATE aou_umpf_security SET description = ? WHERE security_id = ?";
 	if (UNLIKELY(descr.data == NULL)) {
 		/* journey ends here */
 		return (dbobj_t)sec_id;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		(void)be_mmap_set_sec_descr(m, sec_id, descr);
+		return (dbobj_t)sec_id;
 	}
 
 	stmt = be_sql_prep(conn, pre, countof_m1(pre));
@@ -1617,6 +3230,11 @@ UPDATE aou_umpf_security SET description = ? WHERE security_id = ?";
 
 	if (UNLIKELY(descr.data == NULL)) {
 		return (dbobj_t)sec_id;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		(void)be_mmap_set_sec_descr(m, sec_id, descr);
+		return (dbobj_t)sec_id;
 	}
 	/* otherwise there's more work to be done */
 	stmt = be_sql_prep(conn, pre, countof_m1(pre));
@@ -1668,6 +3286,8 @@ SELECT description FROM aou_umpf_security WHERE security_id = ?";
 		/* portfolio getter is fucked */
 		BESQL_ERR_LOG("get_sec(): could not obtain security id\n");
 		return res;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		return be_mmap_get_sec_descr(be_sql_get_conn(conn), sec_id);
 	}
 
 	/* get them statements prepared */
@@ -1715,13 +3335,22 @@ be_sql_free_sec(dbconn_t UNUSED(conn), dbobj_t UNUSED(pf))
 	return;
 }
 
+DEFUN unsigned long int
+be_sql_pf_gen(void)
+{
+	return __atomic_load_n(&pf_gen, __ATOMIC_ACQUIRE);
+}
+
 DEFUN void
 be_sql_lst_pf(dbconn_t conn, int(*cb)(char*, void*), void *clo)
 {
 	dbstmt_t stmt;
 	static const char qry[] = "SELECT `short` FROM `aou_umpf_portfolio`";
 
-	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+	if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		be_mmap_lst_pf(be_sql_get_conn(conn), cb, clo);
+		return;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
 		return;
 	}
 	/* execute */
@@ -1755,6 +3384,11 @@ ORDER BY tag_stamp, tag_id";
 
 	if (UNLIKELY(mnemo == NULL)) {
 		return;
+	} else if (be_sql_get_type(conn) == BE_SQL_MMAP) {
+		mmdb_t m = be_sql_get_conn(conn);
+
+		be_mmap_lst_tag(m, be_mmap_find_pf(m, mnemo), cb, clo);
+		return;
 	}
 
 	mnlen = strlen(mnemo);
@@ -1781,4 +3415,297 @@ ORDER BY tag_stamp, tag_id";
 	return;
 }
 
+
+/* the fill ledger */
+DEFUN int
+be_sql_add_fill(
+	dbconn_t conn, const char *mnemo, time_t stamp,
+	const char *sec, double l, double s)
+{
+	static const char qry[] = "\
+INSERT INTO aou_umpf_ledger \
+(portfolio_id, security_id, fill_stamp, long_qty, short_qty) \
+VALUES (?, ?, ?, ?, ?)";
+	struct __bind_s b[5];
+	dbstmt_t stmt;
+	int res;
+
+	if ((b[0].i64 = __get_pf_id(conn, mnemo)) == 0) {
+		BESQL_ERR_LOG("add_fill(): no portfolio id for %s\n", mnemo);
+		return -1;
+	} else if ((b[1].i64 = __get_sec_id(conn, b[0].i64, sec)) == 0) {
+		BESQL_ERR_LOG("add_fill(): no security id for %s\n", sec);
+		return -1;
+	} else if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[2].type = BE_BIND_TYPE_STAMP;
+	b[2].tm = stamp;
+	b[3].type = BE_BIND_TYPE_DOUBLE;
+	b[3].dbl = l;
+	b[4].type = BE_BIND_TYPE_DOUBLE;
+	b[4].dbl = s;
+	be_sql_bind(conn, stmt, b, countof(b));
+	res = be_sql_exec_stmt(conn, stmt);
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+struct __fill_s {
+	uint64_t fill_id;
+	time_t stamp;
+	uint64_t sec_id;
+	double l;
+	double s;
+};
+
+static int
+__fill_cmp(const void *x, const void *y)
+{
+/* within a stamp fills are summed up per security */
+	const struct __fill_s *a = x;
+	const struct __fill_s *b = y;
+
+	return (a->sec_id > b->sec_id) - (a->sec_id < b->sec_id);
+}
+
+DEFUN int
+be_sql_fold(dbconn_t conn, const char *mnemo, tag_t *last)
+{
+	static const char selq[] = "\
+SELECT fill_id, fill_stamp, security_id, long_qty, short_qty \
+FROM aou_umpf_ledger WHERE portfolio_id = ? ORDER BY fill_id";
+	static const char delq[] = "\
+DELETE FROM aou_umpf_ledger WHERE portfolio_id = ? AND fill_id <= ?";
+	struct __fill_s *rows = NULL;
+	size_t nrows = 0UL;
+	struct __bind_s b[2];
+	dbobj_t tag = NULL;
+	dbstmt_t stmt;
+	bool loadp = false;
+	int res = -1;
+
+	if ((b[0].i64 = __get_pf_id(conn, mnemo)) == 0) {
+		BESQL_ERR_LOG("fold(): no portfolio id for %s\n", mnemo);
+		return -1;
+	} else if ((stmt = be_sql_prep(conn, selq, countof_m1(selq))) == NULL) {
+		return -1;
+	}
+	b[0].type = BE_BIND_TYPE_INT64;
+	be_sql_bind(conn, stmt, b, 1U);
+	/* buffer the fills, the tags need statements of their own */
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s mb[5];
+
+		mb[0].type = BE_BIND_TYPE_INT64;
+		mb[1].type = BE_BIND_TYPE_STAMP;
+		mb[2].type = BE_BIND_TYPE_INT64;
+		mb[3].type = BE_BIND_TYPE_DOUBLE;
+		mb[4].type = BE_BIND_TYPE_DOUBLE;
+
+		while (be_sql_fetch(conn, stmt, mb, countof(mb)) == 0) {
+			if ((nrows % 256U) == 0U) {
+				void *nu = realloc(
+					rows, (nrows + 256U) * sizeof(*rows));
+
+				if (UNLIKELY(nu == NULL)) {
+					be_sql_fin(conn, stmt);
+					goto out;
+				}
+				rows = nu;
+			}
+			rows[nrows].fill_id = mb[0].i64;
+			rows[nrows].stamp = mb[1].tm;
+			rows[nrows].sec_id = mb[2].i64;
+			rows[nrows].l = mb[3].dbl;
+			rows[nrows].s = mb[4].dbl;
+			if (__idc_rget(be_sql_secs(conn), mb[2].i64) == NULL) {
+				loadp = true;
+			}
+			nrows++;
+		}
+	}
+	be_sql_fin(conn, stmt);
+
+	if (nrows == 0UL) {
+		/* nothing pending */
+		res = 0;
+		goto out;
+	} else if (loadp) {
+		__load_secs(conn, b[0].i64);
+	}
+	for (size_t i = 0, j; i < nrows; i = j) {
+		time_t stamp = rows[i].stamp;
+
+		/* fills of one stamp, one tag */
+		for (j = i + 1U; j < nrows && rows[j].stamp == stamp; j++);
+		qsort(rows + i, j - i, sizeof(*rows), __fill_cmp);
+
+		be_sql_free_tag(conn, tag);
+		if ((tag = be_sql_copy_tag(conn, mnemo, stamp)) == NULL) {
+			goto out;
+		}
+		for (size_t k = i, n; k < j; k = n) {
+			uint64_t sec_id = rows[k].sec_id;
+			struct __qty_s q = {rows[k].l, rows[k].s};
+			const char *sym;
+
+			for (n = k + 1U; n < j; n++) {
+				if (rows[n].sec_id != sec_id) {
+					break;
+				}
+				q._long += rows[n].l;
+				q._shrt += rows[n].s;
+			}
+			sym = __idc_rget(be_sql_secs(conn), sec_id);
+			if (UNLIKELY(sym == NULL)) {
+				sym = __get_sec_short(conn, sec_id);
+			}
+			if (UNLIKELY(sym == NULL)) {
+				goto out;
+			}
+			q = be_sql_add_pos(conn, tag, sym, q._long, q._shrt);
+			if (UNLIKELY(isnan(q._long))) {
+				goto out;
+			}
+		}
+	}
+
+	/* the fills live on in the tags now */
+	if ((stmt = be_sql_prep(conn, delq, countof_m1(delq))) == NULL) {
+		goto out;
+	}
+	b[1].type = BE_BIND_TYPE_INT64;
+	/* fill ids went out of order when sorting by security */
+	b[1].i64 = 0;
+	for (size_t i = 0; i < nrows; i++) {
+		if ((uint64_t)b[1].i64 < rows[i].fill_id) {
+			b[1].i64 = rows[i].fill_id;
+		}
+	}
+	be_sql_bind(conn, stmt, b, countof(b));
+	if (LIKELY((res = be_sql_exec_stmt(conn, stmt)) == 0)) {
+		res = (int)nrows;
+	}
+	be_sql_fin(conn, stmt);
+	if (last != NULL && res > 0) {
+		*last = be_sql_tag_get_id(conn, tag);
+	}
+out:
+	be_sql_free_tag(conn, tag);
+	if (rows != NULL) {
+		free(rows);
+	}
+	return res;
+}
+
+DEFUN void
+be_sql_lst_fold(dbconn_t conn, int(*cb)(char*, void*), void *clo)
+{
+	static const char qry[] = "\
+SELECT DISTINCT p.short \
+FROM aou_umpf_ledger AS l \
+LEFT JOIN aou_umpf_portfolio AS p USING (portfolio_id)";
+	char **pfs = NULL;
+	size_t npfs = 0UL;
+	dbstmt_t stmt;
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return;
+	}
+	/* collect first, the callback is likely to fold */
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s mb[1];
+
+		mb[0].type = BE_BIND_TYPE_TEXT;
+		for (mb[0].ptr = NULL;
+		     be_sql_fetch(conn, stmt, mb, countof(mb)) == 0;
+		     mb[0].ptr = NULL) {
+			if ((npfs % 16U) == 0U) {
+				void *nu = realloc(
+					pfs, (npfs + 16U) * sizeof(*pfs));
+
+				if (UNLIKELY(nu == NULL)) {
+					free(mb[0].ptr);
+					break;
+				}
+				pfs = nu;
+			}
+			pfs[npfs++] = mb[0].ptr;
+		}
+	}
+	be_sql_fin(conn, stmt);
+
+	for (size_t i = 0; i < npfs; i++) {
+		if (pfs[i] == NULL) {
+			continue;
+		} else if (cb(pfs[i], clo)) {
+			/* the rest is ours to free */
+			for (size_t j = i + 1U; j < npfs; j++) {
+				free(pfs[j]);
+			}
+			break;
+		}
+	}
+	if (pfs != NULL) {
+		free(pfs);
+	}
+	return;
+}
+
+
+/* write-behind journals */
+DEFUN int
+be_sql_get_mark(dbconn_t conn, unsigned int id, uint32_t *mark)
+{
+	static const char qry[] = "\
+SELECT seq FROM aou_umpf_journal WHERE journal_id = ?";
+	struct __bind_s b[1];
+	dbstmt_t stmt;
+	int res = -1;
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
+	}
+	b[0].type = BE_BIND_TYPE_INT32;
+	b[0].i32 = id;
+	be_sql_bind(conn, stmt, b, countof(b));
+	if (LIKELY(be_sql_exec_stmt(conn, stmt) == 0)) {
+		struct __bind_s rb[1];
+
+		rb[0].type = BE_BIND_TYPE_INT64;
+		rb[0].i64 = 0;
+		/* no row means nothing's been written behind yet */
+		(void)be_sql_fetch(conn, stmt, rb, countof(rb));
+		*mark = (uint32_t)rb[0].i64;
+		res = 0;
+	}
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
+DEFUN int
+be_sql_set_mark(dbconn_t conn, unsigned int id, uint32_t mark)
+{
+	static const char qry[] = "\
+REPLACE INTO aou_umpf_journal (journal_id, seq) VALUES (?, ?)";
+	struct __bind_s b[2];
+	dbstmt_t stmt;
+	int res;
+
+	if ((stmt = be_sql_prep(conn, qry, countof_m1(qry))) == NULL) {
+		return -1;
+	}
+	b[0].type = BE_BIND_TYPE_INT32;
+	b[0].i32 = id;
+	b[1].type = BE_BIND_TYPE_INT64;
+	b[1].i64 = mark;
+	be_sql_bind(conn, stmt, b, countof(b));
+	res = be_sql_exec_stmt(conn, stmt);
+	be_sql_fin(conn, stmt);
+	return res;
+}
+
 /* be-sql.c ends here */
@@ -39,6 +39,7 @@
 #define INCLUDED_be_sql_h_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 /* just some convenience aliases */
@@ -53,6 +54,65 @@ be_sql_open(
 	const char *passwd, const char *dbname);
 DECLF void be_sql_close(dbconn_t conn);
 
+/**
+ * Open the sqlite database DBNAME read-only, other backends aren't
+ * supported and yield NULL. */
+DECLF dbconn_t be_sql_open_ro(const char *dbname);
+
+/**
+ * Open a private in-memory sqlite database and load the snapshot in
+ * the file DBNAME into it, the mark the snapshot was taken with is put
+ * into MARK.  Other backends aren't supported and yield NULL. */
+DECLF dbconn_t be_sql_open_mem(const char *dbname, unsigned int *mark);
+
+/**
+ * Open the memory-mapped store in directory DIR, see be-mmap.h.
+ * All actions below work on it, the fill ledger and journal marks
+ * aside, and so do transactions; there's no sql behind it though. */
+DECLF dbconn_t be_sql_open_mmap(const char *dir);
+
+/**
+ * Write the committed state of the in-memory database CONN to the file
+ * DBNAME, atomically, along with the mark MARK.
+ * Return 0 on success, -1 otherwise. */
+DECLF int be_sql_snapshot(dbconn_t conn, const char *dbname, unsigned int mark);
+
+/**
+ * Switch the sqlite database behind CONN to write-ahead logging, so
+ * readers on other connexions don't block and aren't blocked by the
+ * writer.  Return 0 on success, -1 otherwise or for other backends. */
+DECLF int be_sql_wal(dbconn_t conn);
+
+/**
+ * Set sqlite's pragma KEY to VAL on CONN.
+ * Return 0 on success, -1 otherwise or for other backends. */
+DECLF int be_sql_pragma(dbconn_t conn, const char *key, const char *val);
+
+/**
+ * Prepare the calling thread for the use of connexions that were
+ * opened by another thread. */
+DECLF void be_sql_thread_init(void);
+
+/**
+ * Counterpart to `be_sql_thread_init()', call before the thread exits. */
+DECLF void be_sql_thread_fini(void);
+
+/**
+ * Start a transaction on CONN, return 0 on success, -1 otherwise.
+ * Transactions nest, inner ones are savepoints which can be committed
+ * or rolled back without affecting the outer transaction, but nothing
+ * is durable before the outermost commit. */
+DECLF int be_sql_begin(dbconn_t conn);
+
+/**
+ * Commit the transaction started by `be_sql_begin()'.
+ * Return 0 on success, or -1 if the transaction has been rolled back. */
+DECLF int be_sql_commit(dbconn_t conn);
+
+/**
+ * Roll back the transaction started by `be_sql_begin()'. */
+DECLF void be_sql_rollback(dbconn_t conn);
+
 
 /* actual actions */
 /**
@@ -84,12 +144,41 @@ DECLF dbobj_t be_sql_new_tag_pf(dbconn_t, dbobj_t pf, time_t stamp);
  * \param STAMP is the time stamp at which positions are to be recorded. */
 DECLF dbobj_t be_sql_copy_tag(dbconn_t, const char *mnemo, time_t stamp);
 
+/**
+ * Like `be_sql_copy_tag()' but for portfolio objects, and with the
+ * tag to copy the positions from, FROM, known already.
+ * A FROM of 0 creates an empty tag. */
+DECLF dbobj_t
+be_sql_copy_tag_pf(dbconn_t, dbobj_t pf, time_t stamp, tag_t from);
+
+/**
+ * Return the most recent tag of portfolio MNEMO whose positions hash
+ * to HASH, as per `umpf_pf_hash()', or 0 if there is none. */
+DECLF tag_t be_sql_find_hash(dbconn_t, const char *mnemo, uint64_t hash);
+
+/**
+ * Create a new tag for MNEMO at STAMP that shares the positions of the
+ * tag FROM, as found by `be_sql_find_hash()'. */
+DECLF dbobj_t
+be_sql_alias_tag(dbconn_t, const char *mnemo, time_t stamp, tag_t from);
+
 /**
  * Corresponds to the first part of UMPF_MSG_GET_PF.
  * \param MNEMO is the mnemonic of the portfolio.
  * \param STAMP is the time stamp at which positions have been recorded. */
 DECLF dbobj_t be_sql_get_tag(dbconn_t, const char *mnemo, time_t stamp);
 
+/**
+ * Like `be_sql_get_tag()' but for portfolio objects and a tag whose
+ * id ID and time stamp STAMP are known already, no questions asked. */
+DECLF dbobj_t
+be_sql_get_tag_pf(dbconn_t, dbobj_t pf, tag_t id, time_t stamp);
+
+/**
+ * Like `be_sql_get_tag()' but return the most recent tag, no matter
+ * its time stamp. */
+DECLF dbobj_t be_sql_get_last_tag(dbconn_t, const char *mnemo);
+
 /**
  * Free resources associated with TAG as obtained by `be_sql_new_tag()'. */
 DECLF void be_sql_free_tag(dbconn_t, dbobj_t tag);
@@ -100,15 +189,37 @@ DECLF void be_sql_free_tag(dbconn_t, dbobj_t tag);
  * \param STAMP is the time stamp at which positions have been recorded. */
 DECLF tag_t be_sql_tag_get_id(dbconn_t, dbobj_t tag);
 
+/**
+ * Return the portfolio object TAG belongs to. */
+DECLF dbobj_t be_sql_tag_get_pf(dbconn_t, dbobj_t tag);
+
+/**
+ * Return the hash over TAG's positions or 0 if none has been recorded. */
+DECLF uint64_t be_sql_tag_get_hash(dbconn_t, dbobj_t tag);
+
+/**
+ * Record HASH as the hash over TAG's positions.
+ * Return 0 on success, -1 otherwise. */
+DECLF int be_sql_tag_set_hash(dbconn_t, dbobj_t tag, uint64_t hash);
+
 /**
  * Corresponds to the iteration part of UMPF_MSG_SET_PF.
+ * Return 0 if the position has been recorded, -1 otherwise.
  * \param TAG is the portfolio tag as obtained by `be_sql_new_tag()'.
  * \param MNEMO is the mnemonic of the security.
  * \param L is the long side of the position.
  * \param S is the short side of the position. */
-DECLF void
+DECLF int
 be_sql_set_pos(dbconn_t, dbobj_t tag, const char *mnemo, double l, double s);
 
+/**
+ * Like `be_sql_set_pos()' but for the NPOSS positions in POSS.
+ * Return 0 if all positions have been recorded, -1 otherwise, in which
+ * case the caller should roll back the surrounding transaction. */
+DECLF int
+be_sql_set_poss(
+	dbconn_t, dbobj_t tag, const struct __ins_qty_s *poss, size_t nposs);
+
 /**
  * Return the number of positions in the tag TAG. */
 DECLF size_t be_sql_get_npos(dbconn_t c, dbobj_t tag);
@@ -123,8 +234,10 @@ DECLF time_t be_sql_get_stamp(dbconn_t c, dbobj_t tag);
  * long and short position respectively and fourth is a closure pointer.
  * Iterating over the result set is stopped once the callback returns a
  * non-0 value.
- * Free()ing the mnemonic string is up to the caller. */
-DECLF void
+ * Free()ing the mnemonic string is up to the caller.
+ * Return 0 on success, -1 if the positions couldn't be read, in which
+ * case CB might have seen some of them. */
+DECLF int
 be_sql_get_pos(
 	dbconn_t conn, dbobj_t tag,
 	int(*cb)(char*, double, double, void*), void *clo);
@@ -161,6 +274,12 @@ be_sql_get_sec(dbconn_t, const char *pf_mnemo, const char *sec_mnemo);
  * Frees any resources used by get_sec/set_sec calls. */
 DECLF void be_sql_free_sec(dbconn_t, dbobj_t sec);
 
+/**
+ * Return a number that changes whenever a portfolio has been created
+ * (by this process) and committed, so that the result of
+ * `be_sql_lst_pf()' can be told to be out of date. */
+DECLF unsigned long int be_sql_pf_gen(void);
+
 /**
  * Corresponds to UMPF_MSG_LST_PF */
 DECLF void be_sql_lst_pf(dbconn_t conn, int(*cb)(char*, void*), void *clo);
@@ -172,4 +291,38 @@ be_sql_lst_tag(
 	dbconn_t conn, const char *pf,
 	int(*cb)(uint64_t, time_t, void*), void *clo);
 
+/**
+ * Append a fill of L long and S short in security SEC at STAMP to the
+ * ledger of portfolio MNEMO, instead of patching a tag.
+ * Return 0 on success, -1 otherwise. */
+DECLF int
+be_sql_add_fill(
+	dbconn_t, const char *mnemo, time_t stamp,
+	const char *sec, double l, double s);
+
+/**
+ * Fold the ledger of portfolio MNEMO into tags, fills of the same stamp
+ * go into one tag which is made like UMPF_MSG_PATCH would have.
+ * Return the number of fills folded and, if LAST is non-NULL, put the
+ * id of the last tag made there, or return -1 on failure in which case
+ * the caller should roll back the surrounding transaction. */
+DECLF int be_sql_fold(dbconn_t, const char *mnemo, tag_t *last);
+
+/**
+ * Call CB for every portfolio with fills in the ledger, first argument
+ * is the portfolio mnemonic, to be free()d by the callee. */
+DECLF void be_sql_lst_fold(dbconn_t, int(*cb)(char*, void*), void *clo);
+
+/**
+ * Put the sequence number of the last record of journal ID that's been
+ * written to the database into *MARK, 0 if there's none.
+ * Return 0 on success, -1 otherwise. */
+DECLF int be_sql_get_mark(dbconn_t, unsigned int id, uint32_t *mark);
+
+/**
+ * Record MARK as the last record of journal ID in the database, this
+ * is meant to go into the transaction that writes the records.
+ * Return 0 on success, -1 otherwise. */
+DECLF int be_sql_set_mark(dbconn_t, unsigned int id, uint32_t mark);
+
 #endif	/* INCLUDED_be_sql_h_ */
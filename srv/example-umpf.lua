@@ -16,10 +16,99 @@ load_module(
 	sock = "/tmp/.s.umpf",
 	-- tcp socket port to listen to
 	port = 8642,
+	-- number of worker threads, portfolios are sharded across them,
+	-- default 1, -1 serves requests in the I/O thread which then
+	-- stalls on every query
+	-- workers = 4,
+	-- number of additional worker threads with read-only connexions
+	-- serving GET_PF, GET_SEC, GET_DESCR, LST_PF and LST_TAG, sqlite
+	-- only, switches the database to wal mode, default 0
+	-- readers = 4,
+	-- number of server processes forked off and supervised by
+	-- the master, they share the unix socket and each binds its
+	-- own tcp socket to the same port (SO_REUSEPORT)
+	-- prefork = 4,
+	-- event loop backend, auto, select, poll, epoll, linuxaio,
+	-- iouring or kqueue, subject to what libev and the kernel support
+	-- backend = "iouring",
+	-- largest request in bytes, bigger ones are rejected,
+	-- default 16MB
+	-- max_request = 16777216,
+	-- memory budget in bytes for caching the latest tag of hot
+	-- portfolios and, once as-of GET_PFs or LST_TAGs ask for it,
+	-- their timeline of tags, split across workers, -1 switches
+	-- the cache off, default 16MB, always off in prefork mode;
+	-- the cache assumes nobody else writes to the database
+	-- pf_cache = 16777216,
+	-- memory budget in bytes for serialised replies to GET_PF (of
+	-- the latest tag, needs pf_cache), LST_PF, LST_TAG, GET_SEC and
+	-- GET_DESCR, same rules as pf_cache
+	-- reply_cache = 16777216,
+	-- number of writes (SET_PF, PATCH, ...) a worker commits in one
+	-- transaction, each write still succeeds or fails on its own but
+	-- replies are held back until the commit, -1 commits every write
+	-- by itself, default 64
+	-- group_commit = 64,
+	-- microseconds a worker waits for more writes before committing
+	-- the group, default 0, i.e. commit whatever arrived meanwhile
+	-- group_window = 500,
+	-- in-order PATCH fills are appended to a per-portfolio ledger
+	-- instead of making a tag each, the ledger is folded into tags
+	-- by GET_PF, SET_PF, LST_TAG, snapshots and once it holds that
+	-- many fills; needs pf_cache, no readers, default 0 (no ledger)
+	-- ledger = 1024,
 	db = {
 		host = "localhost",
 		user = "testuser",
 		pass = "password",
 		schema = "test",
+		-- write behind, each worker journals its writes to
+		-- journal.N.umpfj and replies once they're on disk,
+		-- the database is brought up to date every so many
+		-- seconds (default 1) and journals are replayed at
+		-- startup; needs workers, no readers and no prefork,
+		-- works with sqlite files too but with 1 worker only;
+		-- writes are applied to the database after the reply,
+		-- so set_pf replies carry no tag ids, get_pf has them
+		-- journal = "/var/lib/umpf/wal",
+		-- flush = 1,
 	},
+	-- or for sqlite
+	-- db = {
+	-- 	file = "/var/lib/umpf/umpf.sqlt",
+	-- 	-- storage tuning, passed on as pragmas when a connexion
+	-- 	-- is opened, unset ones keep sqlite's defaults except for
+	-- 	-- synchronous (OFF) and busy_timeout (5000ms)
+	-- 	journal_mode = "WAL",
+	-- 	synchronous = "NORMAL",
+	-- 	mmap_size = 268435456,
+	-- 	cache_size = -65536,
+	-- 	-- only takes effect on new databases or after a VACUUM
+	-- 	page_size = 8192,
+	-- 	temp_store = "MEMORY",
+	-- 	busy_timeout = 5000,
+	-- 	-- profile for SET_PF and PATCH of at least that many
+	-- 	-- positions, may set synchronous, cache_size, mmap_size
+	-- 	-- and temp_store, it's switched back afterwards
+	-- 	bulk = {
+	-- 		positions = 10000,
+	-- 		synchronous = "OFF",
+	-- 		cache_size = -1048576,
+	-- 	},
+	-- 	-- keep the database in memory, file is loaded at startup
+	-- 	-- and must exist, writes are journalled to file.umpfj and
+	-- 	-- the database is written back to file every so many
+	-- 	-- seconds (default 60) and at shutdown; 1 worker at most,
+	-- 	-- no readers and no prefork
+	-- 	mode = "memory",
+	-- 	snapshot = 60,
+	-- },
+	-- or without sql, portfolios, tags and positions are kept in
+	-- memory-mapped files of fixed-size records in directory file,
+	-- which is created if need be; 1 worker at most, no readers,
+	-- no prefork and no ledger
+	-- db = {
+	-- 	file = "/var/lib/umpf/store",
+	-- 	mode = "mmap",
+	-- },
 });
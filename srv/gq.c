@@ -38,6 +38,7 @@
 # include "config.h"
 #endif	/* HAVE_CONFIG_H */
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <sys/mman.h>
@@ -50,6 +51,9 @@
 # define assert(x)
 #endif	/* DEBUG_FLAG */
 
+/* minimum number of items per chunk */
+#define GQ_MIN_NPER	(64U)
+
 static size_t __attribute__((const, pure))
 gq_nmemb(size_t mbsz, size_t n)
 {
@@ -61,120 +65,101 @@ gq_nmemb(size_t mbsz, size_t n)
 	return (n * mbsz + (pgsz - 1)) & ~(pgsz - 1);
 }
 
-void
-gq_rbld_ll(gq_ll_t dll, ptrdiff_t df)
+static inline gq_item_t
+gq_item(gq_t q, size_t idx)
 {
-	if (UNLIKELY(df == 0)) {
-		/* thank you thank you thank you */
-		return;
-	}
-
-	if (dll->i1st) {
-		dll->i1st += df;
-	}
-	if (dll->ilst) {
-		dll->ilst += df;
-	}
-	return;
+	char *c = q->chunks[idx / q->nper];
+	return (void*)(c + (idx % q->nper) * q->mbsz);
 }
 
-static ptrdiff_t
-gq_rbld(gq_t q, gq_item_t nu_ref, size_t mbsz)
+int
+init_gq(gq_t q, size_t mbsz, size_t at_least)
 {
-	ptrdiff_t df = nu_ref - q->items;
-
-	if (UNLIKELY(df == 0)) {
-		/* thank you thank you thank you */
-		return 0;
+	if (q->nper == 0U) {
+		/* first go, chunks are page multiples of at least
+		 * GQ_MIN_NPER members */
+		q->mbsz = mbsz;
+		q->nper = gq_nmemb(mbsz, GQ_MIN_NPER) / mbsz;
 	}
+	assert(q->mbsz == mbsz);
+
+	while (q->nitems < at_least) {
+		const size_t csz = gq_nmemb(q->mbsz, q->nper);
+		size_t nitems = q->nitems + q->nper;
+		char **nu_chunks;
+		size_t *nu_free;
+		char *c;
+
+		/* only the book-keeping arrays move, never the items */
+		nu_chunks = realloc(q->chunks, (q->nchunks + 1) * sizeof(c));
+		if (UNLIKELY(nu_chunks == NULL)) {
+			return -1;
+		}
+		q->chunks = nu_chunks;
+		nu_free = realloc(q->free, nitems * sizeof(*nu_free));
+		if (UNLIKELY(nu_free == NULL)) {
+			return -1;
+		}
+		q->free = nu_free;
+		c = mmap(NULL, csz, PROT_MEM, MAP_MEM, -1, 0);
+		if (UNLIKELY(c == MAP_FAILED)) {
+			return -1;
+		}
+		q->chunks[q->nchunks++] = c;
 
-	/* rebuild the free dll */
-	gq_rbld_ll(q->free, df);
-	/* hop along all items and up the next and prev pointers */
-	for (char *sp = (void*)nu_ref, *ep = sp + q->nitems; sp < ep; sp += mbsz) {
-		gq_item_t ip = (void*)sp;
+		/* push the new indices so that lower ones come out first */
+		for (size_t i = nitems; i > q->nitems;) {
+			gq_item_t ip;
 
-		if (ip->next) {
-			ip->next += df;
-		}
-		if (ip->prev) {
-			ip->prev += df;
+			i--;
+			ip = gq_item(q, i);
+			ip->idx = i;
+			q->free[q->nfree++] = i;
 		}
+		q->nitems = nitems;
 	}
-	return df;
+	return 0;
 }
 
-ptrdiff_t
-init_gq(gq_t q, size_t mbsz, size_t at_least)
+void
+fini_gq(gq_t q)
 {
-	size_t nusz = gq_nmemb(mbsz, at_least);
-	size_t olsz = q->nitems;
-	gq_item_t ol_items = q->items;
-	gq_item_t nu_items;
-	ptrdiff_t res = 0;
-
-	if (q->nitems > nusz) {
-		return 0;
-	}
-	/* get some new items */
-	nu_items = mmap(ol_items, nusz, PROT_MEM, MAP_MEM, -1, 0);
+	const size_t csz = gq_nmemb(q->mbsz, q->nper);
 
-	if (q->items) {
-		/* aha, resize */
-		memcpy(nu_items, ol_items, olsz);
+	for (size_t i = 0; i < q->nchunks; i++) {
+		munmap(q->chunks[i], csz);
+	}
+	if (q->chunks) {
+		free(q->chunks);
+	}
+	if (q->free) {
+		free(q->free);
+	}
+	memset(q, 0, sizeof(*q));
+	return;
+}
 
-		/* fix up all lists */
-		res = gq_rbld(q, nu_items, mbsz);
+gq_item_t
+gq_pop_free(gq_t q)
+{
+	gq_item_t res;
+	size_t idx;
 
-		/* unmap the old guy */
-		munmap(ol_items, olsz);
-	}
-	/* reassign */
-	q->items = nu_items;
-	q->nitems = nusz;
-
-	/* fixup sizes for the free list fiddling */
-	olsz -= olsz % mbsz;
-	nusz -= nusz % mbsz;
-	/* fill up the free list */
-	{
-		char *const ep = (char*)nu_items + olsz;
-		char *const eep = ep + (nusz - olsz);
-		gq_item_t eip = (void*)ep;
-
-		for (char *sp = ep; sp < eep; sp += mbsz) {
-			gq_item_t ip = (void*)sp;
-
-			if (sp + mbsz < eep) {
-				ip->next = (void*)(sp + mbsz);
-			}
-			if (sp > ep) {
-				ip->prev = (void*)(sp - mbsz);
-			}
-		}
-		/* attach new list to free list */
-		eip->prev = q->free->ilst;
-		if (q->free->ilst) {
-			q->free->ilst->next = eip;
-		} else {
-			assert(q->free->i1st == NULL);
-		}
-		if (q->free->i1st == NULL) {
-			q->free->i1st = eip;
-			q->free->ilst = (void*)(eep - mbsz);
-		}
+	if (UNLIKELY(q->nfree == 0U)) {
+		return NULL;
 	}
+	idx = q->free[--q->nfree];
+	res = gq_item(q, idx);
+	res->next = res->prev = NULL;
+	assert(res->idx == idx);
 	return res;
 }
 
 void
-fini_gq(gq_t q)
+gq_push_free(gq_t q, gq_item_t i)
 {
-	if (q->items) {
-		munmap(q->items, q->nitems);
-		q->items = NULL;
-		q->nitems = 0;
-	}
+	assert(q->nfree < q->nitems);
+	q->free[q->nfree++] = i->idx;
 	return;
 }
 
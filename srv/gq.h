@@ -52,6 +52,8 @@ typedef struct gq_item_s *gq_item_t;
 struct gq_item_s {
 	gq_item_t next;
 	gq_item_t prev;
+	/* slot number within the pool, constant over the item's life */
+	size_t idx;
 
 	char data[];
 };
@@ -61,18 +63,37 @@ struct gq_ll_s {
 	gq_item_t ilst;
 };
 
+/* pools are slabs of equally sized chunks, chunks are never moved
+ * or given back before fini_gq(), so items stay where they are */
 struct gq_s {
-	gq_item_t items;
+	/* member size, members per chunk */
+	size_t mbsz;
+	size_t nper;
+	/* chunks and total number of items in them */
+	char **chunks;
+	size_t nchunks;
 	size_t nitems;
 
-	struct gq_ll_s free[1];
+	/* stack of free item indices */
+	size_t *free;
+	size_t nfree;
 };
 
 
-extern ptrdiff_t init_gq(gq_t, size_t mbsz, size_t at_least);
+/**
+ * Make sure Q can hold AT_LEAST items of size MBSZ, growing it by
+ * whole chunks if need be.  Return 0 on success, -1 otherwise. */
+extern int init_gq(gq_t, size_t mbsz, size_t at_least);
 extern void fini_gq(gq_t);
-extern void gq_rbld_ll(gq_ll_t dll, ptrdiff_t);
 
+/**
+ * Return a free item of Q or NULL if there's none left. */
+extern gq_item_t gq_pop_free(gq_t);
+/**
+ * Give item I back to Q. */
+extern void gq_push_free(gq_t, gq_item_t i);
+
+/* doubly linked lists of items */
 extern gq_item_t gq_pop_head(gq_ll_t);
 extern void gq_push_tail(gq_ll_t, gq_item_t);
 extern void gq_pop_item(gq_ll_t dll, gq_item_t i);
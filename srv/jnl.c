@@ -0,0 +1,464 @@
+/*** jnl.c -- journals of write requests
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if defined HAVE_CONFIG_H
+# include "config.h"
+#endif	/* HAVE_CONFIG_H */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "jnl.h"
+#include "nifty.h"
+
+struct jnl_s {
+	int fd;
+	uint32_t seq;
+	/* whether there's been a jnl_add() since the last jnl_sync() */
+	int dirty;
+	/* encoding buffer */
+	char *buf;
+	size_t bsz;
+	size_t blen;
+};
+
+/* on disk every record is a header followed by LEN bytes of payload,
+ * SUM is the fnv-1a of the payload so torn records can be told */
+struct jnl_hdr_s {
+	uint32_t len;
+	uint32_t seq;
+	uint32_t sum;
+};
+
+#define JNL_NIL		(0xffffffffU)
+/* the quantity part of a position, quantities or qsides */
+#define JNL_QSZ		(sizeof(struct __ins_qty_s) - sizeof(struct __ins_s))
+
+static uint32_t
+jnl_sum(const char *p, size_t n)
+{
+	uint32_t h = 2166136261U;
+
+	for (const unsigned char *x = (const void*)p; n > 0; x++, n--) {
+		h ^= *x;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/* encoding */
+static int
+enc_need(jnl_t j, size_t n)
+{
+	if (j->blen + n > j->bsz) {
+		size_t nu = j->bsz ? j->bsz : 4096U;
+		char *tmp;
+
+		while (nu < j->blen + n) {
+			nu *= 2U;
+		}
+		if ((tmp = realloc(j->buf, nu)) == NULL) {
+			return -1;
+		}
+		j->buf = tmp;
+		j->bsz = nu;
+	}
+	return 0;
+}
+
+static int
+enc_raw(jnl_t j, const void *p, size_t n)
+{
+	if (UNLIKELY(enc_need(j, n) < 0)) {
+		return -1;
+	}
+	memcpy(j->buf + j->blen, p, n);
+	j->blen += n;
+	return 0;
+}
+
+static int
+enc_u32(jnl_t j, uint32_t x)
+{
+	return enc_raw(j, &x, sizeof(x));
+}
+
+static int
+enc_blob(jnl_t j, const char *p, size_t n)
+{
+	if (p == NULL) {
+		return enc_u32(j, JNL_NIL);
+	} else if (enc_u32(j, (uint32_t)n) < 0) {
+		return -1;
+	}
+	return enc_raw(j, p, n);
+}
+
+static int
+enc_str(jnl_t j, const char *s)
+{
+/* strings go with their terminator so they can be used in place */
+	return enc_blob(j, s, s ? strlen(s) + 1U : 0U);
+}
+
+static int
+enc_msg(jnl_t j, umpf_msg_t msg)
+{
+	int res = enc_u32(j, msg->hdr.mt);
+
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_NEW_PF:
+	case UMPF_MSG_SET_DESCR:
+		res |= enc_str(j, msg->new_pf.name);
+		res |= enc_blob(
+			j, msg->new_pf.satellite->data,
+			msg->new_pf.satellite->size);
+		break;
+
+	case UMPF_MSG_SET_PF:
+	case UMPF_MSG_PATCH: {
+		int64_t stamp = msg->pf.stamp;
+		int64_t clr_dt = msg->pf.clr_dt;
+
+		res |= enc_str(j, msg->pf.name);
+		res |= enc_raw(j, &stamp, sizeof(stamp));
+		res |= enc_raw(j, &clr_dt, sizeof(clr_dt));
+		res |= enc_u32(j, (uint32_t)msg->pf.nposs);
+		for (size_t i = 0; i < msg->pf.nposs; i++) {
+			const struct __ins_qty_s *iq = msg->pf.poss + i;
+
+			res |= enc_str(j, iq->ins->sym);
+			res |= enc_raw(j, iq->qty, JNL_QSZ);
+		}
+		break;
+	}
+
+	case UMPF_MSG_NEW_SEC:
+	case UMPF_MSG_SET_SEC:
+		res |= enc_str(j, msg->new_sec.pf_mnemo);
+		res |= enc_str(j, msg->new_sec.ins->sym);
+		res |= enc_blob(
+			j, msg->new_sec.satellite->data,
+			msg->new_sec.satellite->size);
+		break;
+
+	default:
+		return -1;
+	}
+	return res;
+}
+
+
+/* decoding, P points into a record of which EP marks the end */
+static int
+dec_raw(void *tgt, size_t n, const char **p, const char *ep)
+{
+	if (UNLIKELY(*p + n > ep)) {
+		return -1;
+	}
+	memcpy(tgt, *p, n);
+	*p += n;
+	return 0;
+}
+
+static const char*
+dec_blob(size_t *n, const char **p, const char *ep)
+{
+/* return a pointer to the blob in the record, or NULL */
+	uint32_t len;
+	const char *res;
+
+	if (dec_raw(&len, sizeof(len), p, ep) < 0 || len == JNL_NIL) {
+		*n = 0U;
+		return NULL;
+	} else if (UNLIKELY(*p + len > ep)) {
+		*n = 0U;
+		*p = ep;
+		return NULL;
+	}
+	res = *p;
+	*p += len;
+	*n = len;
+	return res;
+}
+
+static char*
+dec_sym(const char **p, const char *ep)
+{
+/* return the string in the record */
+	size_t n;
+	const char *s;
+
+	if ((s = dec_blob(&n, p, ep)) == NULL || n == 0U || s[n - 1U]) {
+		return NULL;
+	}
+	return (char*)s;
+}
+
+static char*
+dec_str(const char **p, const char *ep)
+{
+/* return a copy of the string in the record */
+	const char *s;
+
+	if ((s = dec_sym(p, ep)) == NULL) {
+		return NULL;
+	}
+	return strdup(s);
+}
+
+static umpf_msg_t
+dec_msg(const char *rec, size_t len)
+{
+/* security symbols point into REC */
+	const char *p = rec;
+	const char *ep = rec + len;
+	umpf_msg_t msg;
+	uint32_t mt;
+
+	if (dec_raw(&mt, sizeof(mt), &p, ep) < 0) {
+		return NULL;
+	} else if ((msg = calloc(1, sizeof(*msg))) == NULL) {
+		return NULL;
+	}
+	msg->hdr.mt = mt;
+
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_NEW_PF:
+	case UMPF_MSG_SET_DESCR: {
+		const char *d;
+		size_t n;
+
+		msg->new_pf.name = dec_str(&p, ep);
+		if ((d = dec_blob(&n, &p, ep)) != NULL) {
+			msg->new_pf.satellite->data = strndup(d, n);
+			msg->new_pf.satellite->size = n;
+		}
+		break;
+	}
+
+	case UMPF_MSG_SET_PF:
+	case UMPF_MSG_PATCH: {
+		int64_t stamp;
+		int64_t clr_dt;
+		uint32_t nposs;
+
+		msg->pf.name = dec_str(&p, ep);
+		if (dec_raw(&stamp, sizeof(stamp), &p, ep) < 0 ||
+		    dec_raw(&clr_dt, sizeof(clr_dt), &p, ep) < 0 ||
+		    dec_raw(&nposs, sizeof(nposs), &p, ep) < 0) {
+			goto bugger;
+		}
+		msg->pf.stamp = (time_t)stamp;
+		msg->pf.clr_dt = (time_t)clr_dt;
+		msg = umpf_msg_add_pos(msg, nposs);
+		for (size_t i = 0; i < nposs; i++) {
+			struct __ins_qty_s *iq = msg->pf.poss + i;
+
+			if ((iq->ins->sym = dec_sym(&p, ep)) == NULL ||
+			    dec_raw(iq->qty, JNL_QSZ, &p, ep) < 0) {
+				goto bugger;
+			}
+		}
+		break;
+	}
+
+	case UMPF_MSG_NEW_SEC:
+	case UMPF_MSG_SET_SEC: {
+		const char *d;
+		size_t n;
+
+		msg->new_sec.pf_mnemo = dec_str(&p, ep);
+		msg->new_sec.ins->sym = dec_sym(&p, ep);
+		if ((d = dec_blob(&n, &p, ep)) != NULL) {
+			msg->new_sec.satellite->data = strndup(d, n);
+			msg->new_sec.satellite->size = n;
+		}
+		break;
+	}
+
+	default:
+		goto bugger;
+	}
+	return msg;
+
+bugger:
+	umpf_free_msg(msg);
+	return NULL;
+}
+
+
+/* public api */
+jnl_t
+make_jnl(const char *fn)
+{
+	jnl_t res;
+	int fd;
+
+	if ((fd = open(fn, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+		return NULL;
+	} else if ((res = calloc(1, sizeof(*res))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	res->fd = fd;
+	return res;
+}
+
+void
+free_jnl(jnl_t j)
+{
+	(void)jnl_sync(j);
+	close(j->fd);
+	if (j->buf != NULL) {
+		free(j->buf);
+	}
+	free(j);
+	return;
+}
+
+int
+jnl_add(jnl_t j, umpf_msg_t msg)
+{
+	struct jnl_hdr_s hdr;
+	struct iovec iov[2];
+	ssize_t nwr;
+
+	j->blen = 0U;
+	if (UNLIKELY(enc_msg(j, msg) < 0)) {
+		return -1;
+	}
+	hdr.len = (uint32_t)j->blen;
+	hdr.seq = j->seq + 1U;
+	hdr.sum = jnl_sum(j->buf, j->blen);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = j->buf;
+	iov[1].iov_len = j->blen;
+	if ((nwr = writev(j->fd, iov, countof(iov))) < 0) {
+		return -1;
+	} else if ((size_t)nwr < sizeof(hdr) + j->blen) {
+		/* leaves a torn record, replays will stop there */
+		return -1;
+	}
+	j->seq++;
+	j->dirty = 1;
+	return 0;
+}
+
+int
+jnl_sync(jnl_t j)
+{
+	if (!j->dirty) {
+		return 0;
+	} else if (fdatasync(j->fd) < 0) {
+		return -1;
+	}
+	j->dirty = 0;
+	return 0;
+}
+
+uint32_t
+jnl_seq(jnl_t j)
+{
+	return j->seq;
+}
+
+int
+jnl_reset(jnl_t j)
+{
+	if (ftruncate(j->fd, 0) < 0) {
+		return -1;
+	}
+	j->dirty = 1;
+	return jnl_sync(j);
+}
+
+ssize_t
+jnl_replay(jnl_t j, uint32_t after, int(*cb)(umpf_msg_t, void*), void *clo)
+{
+	struct jnl_hdr_s hdr;
+	off_t off = 0;
+	ssize_t res = 0;
+	char *rec = NULL;
+	size_t rsz = 0U;
+
+	j->seq = after;
+	while (pread(j->fd, &hdr, sizeof(hdr), off) == sizeof(hdr)) {
+		umpf_msg_t msg;
+
+		if (hdr.len > rsz) {
+			char *tmp;
+
+			if ((tmp = realloc(rec, hdr.len)) == NULL) {
+				res = -1;
+				break;
+			}
+			rec = tmp;
+			rsz = hdr.len;
+		}
+		if (pread(j->fd, rec, hdr.len, off + sizeof(hdr)) !=
+		    (ssize_t)hdr.len ||
+		    jnl_sum(rec, hdr.len) != hdr.sum) {
+			/* torn */
+			break;
+		}
+		off += sizeof(hdr) + hdr.len;
+		j->seq = hdr.seq;
+		if ((int32_t)(hdr.seq - after) <= 0) {
+			/* that one's in the snapshot already */
+			continue;
+		} else if ((msg = dec_msg(rec, hdr.len)) == NULL) {
+			continue;
+		}
+		cb(msg, clo);
+		res++;
+	}
+	if (rec != NULL) {
+		free(rec);
+	}
+	/* cut off whatever didn't make it */
+	if (res >= 0 && ftruncate(j->fd, off) < 0) {
+		res = -1;
+	}
+	return res;
+}
+
+/* jnl.c ends here */
@@ -0,0 +1,96 @@
+/*** jnl.h -- journals of write requests
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if !defined INCLUDED_jnl_h_
+#define INCLUDED_jnl_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "umpf.h"
+
+#if defined __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* append-only logs of write requests in a compact binary format,
+ * every record carries a sequence number, records are only good for
+ * the host that wrote them; a journal is meant for one thread only */
+typedef struct jnl_s *jnl_t;
+
+
+/**
+ * Open (or create) the journal in file FN. */
+extern jnl_t make_jnl(const char *fn);
+
+/**
+ * Close journal J. */
+extern void free_jnl(jnl_t j);
+
+/**
+ * Append the write request MSG to J, return 0 on success, -1 if MSG
+ * couldn't be written or isn't a write request.
+ * The record is durable only after the next `jnl_sync()'. */
+extern int jnl_add(jnl_t j, umpf_msg_t msg);
+
+/**
+ * Make all records appended to J so far durable.
+ * Return 0 on success, -1 otherwise. */
+extern int jnl_sync(jnl_t j);
+
+/**
+ * Return the sequence number of the last record in J. */
+extern uint32_t jnl_seq(jnl_t j);
+
+/**
+ * Discard all records in J, sequence numbers carry on. */
+extern int jnl_reset(jnl_t j);
+
+/**
+ * Call CB with the request of every record in J whose sequence number
+ * comes after AFTER, in the order they were written, the messages
+ * are CB's to free.  A torn record at the end (from a crash during
+ * `jnl_add()') and anything after it is cut off.
+ * Afterwards sequence numbers carry on from the last record.
+ * Return the number of records passed to CB or -1 on error. */
+extern ssize_t
+jnl_replay(jnl_t j, uint32_t after, int(*cb)(umpf_msg_t, void*), void *clo);
+
+#if defined __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* INCLUDED_jnl_h_ */
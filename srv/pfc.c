@@ -0,0 +1,388 @@
+/*** pfc.c -- portfolio caches
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if defined HAVE_CONFIG_H
+# include "config.h"
+#endif	/* HAVE_CONFIG_H */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "pfc.h"
+#include "nifty.h"
+
+#if defined DEBUG_FLAG
+# include <assert.h>
+#else  /* !DEBUG_FLAG */
+# define assert(x)
+#endif	/* DEBUG_FLAG */
+
+struct pfc_s {
+	size_t budget;
+	size_t mem;
+
+	/* hash table of entries, chained */
+	size_t nent;
+	size_t mask;
+	pfc_ent_t *tbl;
+
+	/* lru list, most recently used first */
+	pfc_ent_t mru;
+	pfc_ent_t lru;
+};
+
+static unsigned int
+pfc_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	/* fnv-1a */
+	for (const unsigned char *p = (const void*)name; *p; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	/* and mix the bits, keys get sharded by fnv-1a modulo the number
+	 * of workers already so the low bits are likely all the same */
+	h ^= h >> 16U;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13U;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16U;
+	return h;
+}
+
+static void
+pfc_lru_pop(pfc_t c, pfc_ent_t e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		c->mru = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		c->lru = e->prev;
+	}
+	e->prev = e->next = NULL;
+	return;
+}
+
+static void
+pfc_lru_push(pfc_t c, pfc_ent_t e)
+{
+	if ((e->next = c->mru) != NULL) {
+		c->mru->prev = e;
+	} else {
+		c->lru = e;
+	}
+	e->prev = NULL;
+	c->mru = e;
+	return;
+}
+
+static size_t
+pfc_ent_mem(pfc_ent_t e)
+{
+	size_t res = sizeof(*e) + strlen(e->name) + 1U;
+
+	res += e->nall * sizeof(*e->pos);
+	res += e->tall * sizeof(*e->tag);
+	for (size_t i = 0; i < e->npos; i++) {
+		res += strlen(e->pos[i].sym) + 1U;
+	}
+	return res;
+}
+
+static void
+pfc_rehash(pfc_t c)
+{
+	size_t nu_mask = (c->mask + 1U) * 2U - 1U;
+	pfc_ent_t *nu_tbl = calloc(nu_mask + 1U, sizeof(*nu_tbl));
+
+	if (UNLIKELY(nu_tbl == NULL)) {
+		/* just keep the longer chains */
+		return;
+	}
+	for (size_t i = 0; i <= c->mask; i++) {
+		for (pfc_ent_t e = c->tbl[i], nx; e != NULL; e = nx) {
+			nx = e->chain;
+			e->chain = nu_tbl[e->hash & nu_mask];
+			nu_tbl[e->hash & nu_mask] = e;
+		}
+	}
+	free(c->tbl);
+	c->tbl = nu_tbl;
+	c->mask = nu_mask;
+	return;
+}
+
+
+pfc_t
+make_pfc(size_t budget)
+{
+	pfc_t res;
+
+	if ((res = calloc(1, sizeof(*res))) == NULL) {
+		return NULL;
+	}
+	res->budget = budget;
+	res->mask = 63U;
+	if ((res->tbl = calloc(res->mask + 1U, sizeof(*res->tbl))) == NULL) {
+		free(res);
+		return NULL;
+	}
+	return res;
+}
+
+void
+free_pfc(pfc_t c)
+{
+	while (c->mru != NULL) {
+		pfc_del(c, c->mru);
+	}
+	free(c->tbl);
+	free(c);
+	return;
+}
+
+pfc_ent_t
+pfc_get(pfc_t c, const char *name)
+{
+	unsigned int h = pfc_hash(name);
+
+	for (pfc_ent_t e = c->tbl[h & c->mask]; e != NULL; e = e->chain) {
+		if (e->hash == h && !strcmp(e->name, name)) {
+			/* bump */
+			pfc_lru_pop(c, e);
+			pfc_lru_push(c, e);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+pfc_ent_t
+pfc_put(pfc_t c, const char *name)
+{
+	pfc_ent_t res;
+
+	if ((res = pfc_get(c, name)) != NULL) {
+		pfc_clear(res);
+		pfc_untag(res);
+		res->pf = NULL;
+		res->tag_id = 0UL;
+		res->stamp = 0;
+		res->digest = 0ULL;
+		res->nfill = 0U;
+		return res;
+	} else if ((res = calloc(1, sizeof(*res))) == NULL) {
+		return NULL;
+	} else if ((res->name = strdup(name)) == NULL) {
+		free(res);
+		return NULL;
+	}
+	res->hash = pfc_hash(name);
+	res->chain = c->tbl[res->hash & c->mask];
+	c->tbl[res->hash & c->mask] = res;
+	pfc_lru_push(c, res);
+	res->mem = pfc_ent_mem(res);
+	c->mem += res->mem;
+	if (++c->nent > c->mask) {
+		pfc_rehash(c);
+	}
+	return res;
+}
+
+void
+pfc_del(pfc_t c, pfc_ent_t e)
+{
+	pfc_ent_t *ep;
+
+	for (ep = c->tbl + (e->hash & c->mask); *ep != e; ep = &(*ep)->chain) {
+		assert(*ep != NULL);
+	}
+	*ep = e->chain;
+	pfc_lru_pop(c, e);
+	c->nent--;
+	c->mem -= e->mem;
+
+	pfc_clear(e);
+	pfc_untag(e);
+	if (e->pos != NULL) {
+		free(e->pos);
+	}
+	free(e->name);
+	free(e);
+	return;
+}
+
+struct pfc_pos_s*
+pfc_pos(pfc_ent_t e, const char *sym)
+{
+	struct pfc_pos_s *res;
+
+	for (size_t i = 0; i < e->npos; i++) {
+		if (!strcmp(e->pos[i].sym, sym)) {
+			return e->pos + i;
+		}
+	}
+	/* new one then */
+	if (e->npos >= e->nall) {
+		size_t nu_nall = e->nall ? e->nall * 2U : 16U;
+		struct pfc_pos_s *nu_pos;
+
+		nu_pos = realloc(e->pos, nu_nall * sizeof(*nu_pos));
+		if (UNLIKELY(nu_pos == NULL)) {
+			return NULL;
+		}
+		e->pos = nu_pos;
+		e->nall = nu_nall;
+	}
+	res = e->pos + e->npos;
+	if ((res->sym = strdup(sym)) == NULL) {
+		return NULL;
+	}
+	res->_long = 0.0;
+	res->_shrt = 0.0;
+	e->npos++;
+	return res;
+}
+
+void
+pfc_prune(pfc_ent_t e)
+{
+	size_t j = 0U;
+
+	for (size_t i = 0; i < e->npos; i++) {
+		if (e->pos[i]._long == 0.0 && e->pos[i]._shrt == 0.0) {
+			free(e->pos[i].sym);
+			continue;
+		}
+		e->pos[j++] = e->pos[i];
+	}
+	e->npos = j;
+	return;
+}
+
+void
+pfc_clear(pfc_ent_t e)
+{
+	for (size_t i = 0; i < e->npos; i++) {
+		free(e->pos[i].sym);
+	}
+	e->npos = 0U;
+	return;
+}
+
+int
+pfc_tag(pfc_ent_t e, time_t stamp, long unsigned int tag_id)
+{
+	size_t i;
+
+	if (e->ntag >= e->tall) {
+		size_t nu_tall = e->tall ? e->tall * 2U : 16U;
+		struct pfc_tag_s *nu_tag;
+
+		nu_tag = realloc(e->tag, nu_tall * sizeof(*nu_tag));
+		if (UNLIKELY(nu_tag == NULL)) {
+			pfc_untag(e);
+			return -1;
+		}
+		e->tag = nu_tag;
+		e->tall = nu_tall;
+	}
+	/* new tags mostly go to the end, back-dated ones don't */
+	for (i = e->ntag; i > 0U; i--) {
+		const struct pfc_tag_s *t = e->tag + i - 1U;
+
+		if (t->stamp < stamp ||
+		    (t->stamp == stamp && t->tag_id < tag_id)) {
+			break;
+		}
+	}
+	memmove(e->tag + i + 1U, e->tag + i, (e->ntag - i) * sizeof(*e->tag));
+	e->tag[i].stamp = stamp;
+	e->tag[i].tag_id = tag_id;
+	e->ntag++;
+	return 0;
+}
+
+const struct pfc_tag_s*
+pfc_asof(pfc_ent_t e, time_t stamp)
+{
+	size_t lo = 0U;
+	size_t hi = e->ntag;
+
+	/* find the first tag younger than STAMP */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2U;
+
+		if (e->tag[mid].stamp <= stamp) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0U ? e->tag + lo - 1U : NULL;
+}
+
+void
+pfc_untag(pfc_ent_t e)
+{
+	if (e->tag != NULL) {
+		free(e->tag);
+	}
+	e->tag = NULL;
+	e->ntag = 0U;
+	e->tall = 0U;
+	return;
+}
+
+void
+pfc_commit(pfc_t c, pfc_ent_t e)
+{
+	size_t mem = pfc_ent_mem(e);
+
+	c->mem -= e->mem;
+	c->mem += e->mem = mem;
+	/* evict from the cold end */
+	while (c->mem > c->budget && c->lru != NULL && c->lru != e) {
+		pfc_del(c, c->lru);
+	}
+	return;
+}
+
+/* pfc.c ends here */
@@ -0,0 +1,151 @@
+/*** pfc.h -- portfolio caches
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if !defined INCLUDED_pfc_h_
+#define INCLUDED_pfc_h_
+
+#include <stddef.h>
+#include <time.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* caches of the latest tag of a portfolio and its positions, and
+ * optionally its timeline of tags,
+ * a cache is meant to be used by one thread only */
+typedef struct pfc_s *pfc_t;
+typedef struct pfc_ent_s *pfc_ent_t;
+
+struct pfc_pos_s {
+	char *sym;
+	double _long;
+	double _shrt;
+};
+
+struct pfc_tag_s {
+	time_t stamp;
+	long unsigned int tag_id;
+};
+
+struct pfc_ent_s {
+	/* backend's idea of the portfolio, and the latest tag */
+	void *pf;
+	long unsigned int tag_id;
+	time_t stamp;
+	/* hash over the latest tag's positions, 0 if unknown */
+	long long unsigned int digest;
+	/* number of fills in the positions that are still in the ledger */
+	size_t nfill;
+
+	size_t npos;
+	struct pfc_pos_s *pos;
+
+	/* all tags, by stamp then id, none if the timeline isn't loaded */
+	size_t ntag;
+	struct pfc_tag_s *tag;
+
+	/* book-keeping, hands off */
+	char *name;
+	unsigned int hash;
+	size_t nall;
+	size_t tall;
+	size_t mem;
+	pfc_ent_t chain;
+	pfc_ent_t prev;
+	pfc_ent_t next;
+};
+
+
+/**
+ * Return a cache that will use about BUDGET bytes at most. */
+extern pfc_t make_pfc(size_t budget);
+
+/**
+ * Free resources associated with cache C. */
+extern void free_pfc(pfc_t c);
+
+/**
+ * Return the entry for portfolio NAME or NULL if there's none. */
+extern pfc_ent_t pfc_get(pfc_t c, const char *name);
+
+/**
+ * Return a fresh (empty) entry for portfolio NAME, replacing any
+ * existing one, or NULL if the entry couldn't be allocated. */
+extern pfc_ent_t pfc_put(pfc_t c, const char *name);
+
+/**
+ * Remove entry E from cache C. */
+extern void pfc_del(pfc_t c, pfc_ent_t e);
+
+/**
+ * Return the position of E in SYM, add a flat one if there's none.
+ * Return NULL if the position couldn't be allocated. */
+extern struct pfc_pos_s *pfc_pos(pfc_ent_t e, const char *sym);
+
+/**
+ * Remove flat positions from E. */
+extern void pfc_prune(pfc_ent_t e);
+
+/**
+ * Remove all positions from E. */
+extern void pfc_clear(pfc_ent_t e);
+
+/**
+ * Add the tag TAG_ID at STAMP to E's timeline, in order.
+ * Return 0 on success, -1 if the timeline couldn't be resized in
+ * which case it's unloaded. */
+extern int pfc_tag(pfc_ent_t e, time_t stamp, long unsigned int tag_id);
+
+/**
+ * Return the most recent tag in E's timeline that isn't younger than
+ * STAMP, or NULL if there's none. */
+extern const struct pfc_tag_s *pfc_asof(pfc_ent_t e, time_t stamp);
+
+/**
+ * Unload E's timeline. */
+extern void pfc_untag(pfc_ent_t e);
+
+/**
+ * Account for changes to E and evict least recently used entries
+ * other than E until C is within its budget again. */
+extern void pfc_commit(pfc_t c, pfc_ent_t e);
+
+#if defined __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* INCLUDED_pfc_h_ */
@@ -0,0 +1,364 @@
+/*** rcache.c -- caches of serialised replies
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if defined HAVE_CONFIG_H
+# include "config.h"
+#endif	/* HAVE_CONFIG_H */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "rcache.h"
+#include "nifty.h"
+
+#if defined DEBUG_FLAG
+# include <assert.h>
+#else  /* !DEBUG_FLAG */
+# define assert(x)
+#endif	/* DEBUG_FLAG */
+
+typedef struct rc_ent_s *rc_ent_t;
+typedef struct rc_ver_s *rc_ver_t;
+
+/* portfolio versions, these are never evicted */
+struct rc_ver_s {
+	rc_ver_t chain;
+	unsigned int hash;
+	unsigned long int gen;
+	char pf[];
+};
+
+struct rc_ent_s {
+	rc_ent_t chain;
+	rc_ent_t prev;
+	rc_ent_t next;
+	unsigned int hash;
+
+	/* the portfolio version this reply is good for */
+	rc_ver_t ver;
+	unsigned long int gen;
+
+	rbuf_t buf;
+	size_t ksz;
+	char key[];
+};
+
+struct rcache_s {
+	size_t budget;
+	size_t mem;
+
+	/* replies, chained */
+	size_t nent;
+	size_t mask;
+	rc_ent_t *tbl;
+
+	/* versions, chained */
+	size_t nver;
+	size_t vmask;
+	rc_ver_t *vtbl;
+
+	/* lru list, most recently used first */
+	rc_ent_t mru;
+	rc_ent_t lru;
+};
+
+static unsigned int
+rc_hash(const char *key, size_t ksz)
+{
+	uint32_t h = 2166136261U;
+
+	/* fnv-1a, mixed, see pfc_hash() */
+	for (const unsigned char *p = (const void*)key, *ep = p + ksz;
+	     p < ep; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	h ^= h >> 16U;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13U;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16U;
+	return h;
+}
+
+static void*
+rc_rehash(void *tbl, size_t *mask, size_t chain_off, size_t hash_off)
+{
+/* double the chained hash table TBL of size *MASK + 1 */
+	size_t nu_mask = (*mask + 1U) * 2U - 1U;
+	void **nu_tbl = calloc(nu_mask + 1U, sizeof(*nu_tbl));
+	void **ol_tbl = tbl;
+
+	if (UNLIKELY(nu_tbl == NULL)) {
+		/* just keep the longer chains */
+		return tbl;
+	}
+	for (size_t i = 0; i <= *mask; i++) {
+		for (char *e = ol_tbl[i], *nx; e != NULL; e = nx) {
+			void **chain = (void**)(e + chain_off);
+			unsigned int h = *(unsigned int*)(e + hash_off);
+
+			nx = *chain;
+			*chain = nu_tbl[h & nu_mask];
+			nu_tbl[h & nu_mask] = e;
+		}
+	}
+	free(ol_tbl);
+	*mask = nu_mask;
+	return nu_tbl;
+}
+
+static rc_ver_t
+rc_ver(rcache_t c, const char *pf, int creatp)
+{
+	size_t pfsz = strlen(pf);
+	unsigned int h = rc_hash(pf, pfsz);
+	rc_ver_t v;
+
+	for (v = c->vtbl[h & c->vmask]; v != NULL; v = v->chain) {
+		if (v->hash == h && !strcmp(v->pf, pf)) {
+			return v;
+		}
+	}
+	if (!creatp || (v = malloc(sizeof(*v) + pfsz + 1U)) == NULL) {
+		return NULL;
+	}
+	v->hash = h;
+	v->gen = 0UL;
+	memcpy(v->pf, pf, pfsz + 1U);
+	v->chain = c->vtbl[h & c->vmask];
+	c->vtbl[h & c->vmask] = v;
+	if (++c->nver > c->vmask) {
+		c->vtbl = rc_rehash(
+			c->vtbl, &c->vmask,
+			offsetof(struct rc_ver_s, chain),
+			offsetof(struct rc_ver_s, hash));
+	}
+	return v;
+}
+
+static size_t
+rc_ent_mem(rc_ent_t e)
+{
+	return sizeof(*e) + e->ksz + sizeof(*e->buf) + e->buf->len;
+}
+
+static void
+rc_lru_pop(rcache_t c, rc_ent_t e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		c->mru = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		c->lru = e->prev;
+	}
+	e->prev = e->next = NULL;
+	return;
+}
+
+static void
+rc_lru_push(rcache_t c, rc_ent_t e)
+{
+	if ((e->next = c->mru) != NULL) {
+		c->mru->prev = e;
+	} else {
+		c->lru = e;
+	}
+	e->prev = NULL;
+	c->mru = e;
+	return;
+}
+
+static rc_ent_t
+rc_find(rcache_t c, const char *key, size_t ksz, unsigned int h)
+{
+	for (rc_ent_t e = c->tbl[h & c->mask]; e != NULL; e = e->chain) {
+		if (e->hash == h && e->ksz == ksz && !memcmp(e->key, key, ksz)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void
+rc_del(rcache_t c, rc_ent_t e)
+{
+	rc_ent_t *ep;
+
+	for (ep = c->tbl + (e->hash & c->mask); *ep != e; ep = &(*ep)->chain) {
+		assert(*ep != NULL);
+	}
+	*ep = e->chain;
+	rc_lru_pop(c, e);
+	c->nent--;
+	c->mem -= rc_ent_mem(e);
+	rbuf_unref(e->buf);
+	free(e);
+	return;
+}
+
+
+rcache_t
+make_rcache(size_t budget)
+{
+	rcache_t res;
+
+	if ((res = calloc(1, sizeof(*res))) == NULL) {
+		return NULL;
+	}
+	res->budget = budget;
+	res->mask = 63U;
+	res->vmask = 63U;
+	res->tbl = calloc(res->mask + 1U, sizeof(*res->tbl));
+	res->vtbl = calloc(res->vmask + 1U, sizeof(*res->vtbl));
+	if (res->tbl == NULL || res->vtbl == NULL) {
+		free(res->tbl);
+		free(res->vtbl);
+		free(res);
+		return NULL;
+	}
+	return res;
+}
+
+void
+free_rcache(rcache_t c)
+{
+	while (c->mru != NULL) {
+		rc_del(c, c->mru);
+	}
+	for (size_t i = 0; i <= c->vmask; i++) {
+		for (rc_ver_t v = c->vtbl[i], nx; v != NULL; v = nx) {
+			nx = v->chain;
+			free(v);
+		}
+	}
+	free(c->tbl);
+	free(c->vtbl);
+	free(c);
+	return;
+}
+
+rbuf_t
+rcache_get(rcache_t c, const char *key, size_t ksz, const char *pf)
+{
+	unsigned int h = rc_hash(key, ksz);
+	rc_ent_t e;
+
+	if ((e = rc_find(c, key, ksz, h)) == NULL) {
+		return NULL;
+	} else if (pf != NULL && (e->ver == NULL || e->gen != e->ver->gen)) {
+		/* portfolio's moved on */
+		rc_del(c, e);
+		return NULL;
+	}
+	/* bump */
+	rc_lru_pop(c, e);
+	rc_lru_push(c, e);
+	return rbuf_ref(e->buf);
+}
+
+void
+rcache_put(
+	rcache_t c, const char *key, size_t ksz, const char *pf,
+	const char *data, size_t len)
+{
+	unsigned int h = rc_hash(key, ksz);
+	rc_ver_t v = NULL;
+	rbuf_t b;
+	rc_ent_t e;
+
+	if (len > c->budget / 8U) {
+		/* not worth sacrificing that many other replies */
+		return;
+	} else if (pf != NULL && (v = rc_ver(c, pf, 1)) == NULL) {
+		return;
+	} else if ((b = malloc(sizeof(*b) + len)) == NULL) {
+		return;
+	}
+	b->refs = 1U;
+	b->len = len;
+	memcpy(b->data, data, len);
+
+	if ((e = rc_find(c, key, ksz, h)) != NULL) {
+		/* replace the reply */
+		c->mem -= rc_ent_mem(e);
+		rbuf_unref(e->buf);
+		rc_lru_pop(c, e);
+	} else if ((e = malloc(sizeof(*e) + ksz)) == NULL) {
+		rbuf_unref(b);
+		return;
+	} else {
+		e->hash = h;
+		e->ksz = ksz;
+		memcpy(e->key, key, ksz);
+		e->chain = c->tbl[h & c->mask];
+		c->tbl[h & c->mask] = e;
+		if (++c->nent > c->mask) {
+			c->tbl = rc_rehash(
+				c->tbl, &c->mask,
+				offsetof(struct rc_ent_s, chain),
+				offsetof(struct rc_ent_s, hash));
+		}
+	}
+	e->buf = b;
+	e->ver = v;
+	e->gen = v != NULL ? v->gen : 0UL;
+	rc_lru_push(c, e);
+	c->mem += rc_ent_mem(e);
+
+	/* evict from the cold end */
+	while (c->mem > c->budget && c->lru != NULL && c->lru != e) {
+		rc_del(c, c->lru);
+	}
+	return;
+}
+
+void
+rcache_bump(rcache_t c, const char *pf)
+{
+	rc_ver_t v;
+
+	if ((v = rc_ver(c, pf, 0)) != NULL) {
+		/* stale replies are dropped lazily */
+		v->gen++;
+	}
+	return;
+}
+
+/* rcache.c ends here */
@@ -0,0 +1,110 @@
+/*** rcache.h -- caches of serialised replies
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if !defined INCLUDED_rcache_h_
+#define INCLUDED_rcache_h_
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* caches of serialised replies to read-only requests, keyed by the
+ * request and invalidated by bumping the version of the portfolio
+ * they depend on, a cache is meant to be used by one thread only but
+ * the buffers it hands out may travel to other threads */
+typedef struct rcache_s *rcache_t;
+typedef struct rbuf_s *rbuf_t;
+
+struct rbuf_s {
+	size_t refs;
+	size_t len;
+	char data[];
+};
+
+
+/**
+ * Return a cache that will use about BUDGET bytes at most. */
+extern rcache_t make_rcache(size_t budget);
+
+/**
+ * Free resources associated with cache C.
+ * Buffers still referenced elsewhere stay alive. */
+extern void free_rcache(rcache_t c);
+
+/**
+ * Return a reference to the reply stored under KEY of size KSZ,
+ * or NULL if there's none or if portfolio PF has changed since.
+ * PF may be NULL for replies that don't depend on any portfolio. */
+extern rbuf_t
+rcache_get(rcache_t c, const char *key, size_t ksz, const char *pf);
+
+/**
+ * Store a copy of reply DATA of size LEN under KEY of size KSZ,
+ * valid until portfolio PF changes. */
+extern void
+rcache_put(
+	rcache_t c, const char *key, size_t ksz, const char *pf,
+	const char *data, size_t len);
+
+/**
+ * Invalidate all replies depending on portfolio PF. */
+extern void rcache_bump(rcache_t c, const char *pf);
+
+
+static inline rbuf_t
+rbuf_ref(rbuf_t b)
+{
+	__atomic_add_fetch(&b->refs, 1U, __ATOMIC_RELAXED);
+	return b;
+}
+
+static inline void
+rbuf_unref(rbuf_t b)
+{
+	if (__atomic_sub_fetch(&b->refs, 1U, __ATOMIC_ACQ_REL) == 0U) {
+		free(b);
+	}
+	return;
+}
+
+#if defined __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* INCLUDED_rcache_h_ */
@@ -0,0 +1,101 @@
+/*** spsc.c -- single-producer single-consumer rings
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if defined HAVE_CONFIG_H
+# include "config.h"
+#endif	/* HAVE_CONFIG_H */
+#include <stdlib.h>
+#include "spsc.h"
+#include "nifty.h"
+
+spsc_t
+make_spsc(size_t nslots)
+{
+	spsc_t res;
+	size_t n;
+
+	/* round up to the next power of 2 */
+	for (n = 16U; n < nslots; n <<= 1U);
+	if (posix_memalign((void**)&res, 64U, sizeof(*res) + n * sizeof(void*))) {
+		return NULL;
+	}
+	res->mask = n - 1U;
+	res->head = 0U;
+	res->tail = 0U;
+	return res;
+}
+
+void
+free_spsc(spsc_t r)
+{
+	free(r);
+	return;
+}
+
+int
+spsc_push(spsc_t r, void *p)
+{
+	size_t t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	size_t h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (UNLIKELY(t - h > r->mask)) {
+		/* full */
+		return -1;
+	}
+	r->slot[t & r->mask] = p;
+	/* publish the slot */
+	__atomic_store_n(&r->tail, t + 1U, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void*
+spsc_pop(spsc_t r)
+{
+	size_t h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	size_t t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	void *res;
+
+	if (h == t) {
+		/* empty */
+		return NULL;
+	}
+	res = r->slot[h & r->mask];
+	/* hand the slot back to the producer */
+	__atomic_store_n(&r->head, h + 1U, __ATOMIC_RELEASE);
+	return res;
+}
+
+/* spsc.c ends here */
@@ -0,0 +1,79 @@
+/*** spsc.h -- single-producer single-consumer rings
+ *
+ * Copyright (C) 2013 Sebastian Freundt
+ *
+ * Author:  Sebastian Freundt <freundt@ga-group.nl>
+ *
+ * This file is part of the army of unserding daemons.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+#if !defined INCLUDED_spsc_h_
+#define INCLUDED_spsc_h_
+
+#include <stddef.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* bounded lock-free rings of pointers, exactly one thread may push
+ * and exactly one (other) thread may pop */
+typedef struct spsc_s *spsc_t;
+
+struct spsc_s {
+	size_t mask;
+	/* consumer and producer indices, on separate cache lines */
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+	void *slot[] __attribute__((aligned(64)));
+};
+
+
+/**
+ * Return a ring with room for at least NSLOTS pointers. */
+extern spsc_t make_spsc(size_t nslots);
+
+/**
+ * Free resources associated with ring R. */
+extern void free_spsc(spsc_t r);
+
+/**
+ * Producer side, put P into R.  Return 0 on success or -1 if R is full. */
+extern int spsc_push(spsc_t r, void *p);
+
+/**
+ * Consumer side, return the oldest pointer in R or NULL if R is empty. */
+extern void *spsc_pop(spsc_t r);
+
+#if defined __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* INCLUDED_spsc_h_ */
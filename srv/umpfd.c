@@ -40,10 +40,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #if defined HAVE_EV_H
 # include <ev.h>
 # undef EV_P
@@ -56,6 +62,10 @@
 #include "ud-sock.h"
 #include "ud-sockaddr.h"
 #include "gq.h"
+#include "spsc.h"
+#include "pfc.h"
+#include "rcache.h"
+#include "jnl.h"
 #include "nifty.h"
 
 #if !defined IPPROTO_IPV6
@@ -101,11 +111,61 @@
  * in copy operations, CAREFUL, this undermines the idea of genericity
  * for instance when interest rates or price data is captured */
 #define UMPF_AUTO_PRUNE		1
+/* default for the largest request we're prepared to buffer, frames
+ * announcing more are rejected before a single payload byte is read */
+#define UMPF_MAX_REQUEST	(16U * 1024U * 1024U)
+/* initial size of connexion input buffers, doubled as needed */
+#define UMPF_INI_RBUF		(4096U)
+/* number of requests that can be in flight between the I/O loop and
+ * a worker before they go into the backlog */
+#define UMPF_WRK_RING		(1024U)
+/* default number of worker threads, keeps the database off the
+ * I/O thread */
+#define UMPF_WORKERS		(1U)
+/* number of connexions accepted in one go */
+#define UMPF_ACCEPT_BATCH	(16U)
+/* number of jobs, and thereby reply buffers, kept for reuse,
+ * and the largest buffer worth keeping */
+#define UMPF_JOB_POOL		(256U)
+#define UMPF_RBUF_KEEP		(65536U)
+/* number of replies handed to writev() in one go */
+#define UMPF_OQ_IOV		(16U)
+/* default memory budget of the portfolio cache, shared by all workers */
+#define UMPF_PF_CACHE		(16U * 1024U * 1024U)
+/* default memory budget of the reply cache, likewise */
+#define UMPF_REPLY_CACHE	(16U * 1024U * 1024U)
+/* default number of writes a worker commits in one transaction, and
+ * how long (in us) it waits for more before committing */
+#define UMPF_GROUP_MAX		(64U)
+#define UMPF_GROUP_WINDOW	(0U)
+/* default seconds between snapshots of an in-memory database */
+#define UMPF_SNAPSHOT		(60U)
+/* default seconds between write-behind flushes, and the most writes
+ * a flush is put off for */
+#define UMPF_FLUSH		(1U)
+#define UMPF_FLUSH_MAX		(4096U)
+/* number of write-behind writes applied to the database in one go
+ * while a worker's idle */
+#define UMPF_WB_BATCH		(64U)
+/* default number of fills a portfolio's ledger takes before it's
+ * folded into tags, 0 patches tags right away */
+#define UMPF_LEDGER		(0U)
 
 
 /* the connection queue */
 typedef struct ev_io_q_s *ev_io_q_t;
 typedef struct ev_qio_s *ev_qio_t;
+typedef struct umpf_job_s *umpf_job_t;
+typedef struct umpf_wrk_s *umpf_wrk_t;
+
+typedef enum {
+	/* undecided, nothing's been read yet */
+	QIO_MODE_UNK,
+	/* xml blobs, one request per connexion */
+	QIO_MODE_BLOB,
+	/* length-prefixed frames, persistent connexion */
+	QIO_MODE_FRAME,
+} qio_mode_t;
 
 struct ev_io_q_s {
 	struct gq_s q[1];
@@ -115,21 +175,179 @@ struct ev_qio_s {
 	struct gq_item_s i;
 	ev_io w[1];
 	/* ctx used for blob parser */
-	union {
-		umpf_ctx_t ctx;
-		size_t nwr;
-	};
-	/* reply buffer, pointer and size */
+	umpf_ctx_t ctx;
+	/* output queue of finished jobs, and bytes of its head written */
+	umpf_job_t oq;
+	umpf_job_t *oq_tail;
+	size_t nwr;
+
+	/* blob or frame mode */
+	qio_mode_t mode;
+	/* input buffer, its allocated size, its fill level and the
+	 * number of bytes of the current blob request seen so far */
+	char *ibuf;
+	size_t ibsz;
+	size_t ilen;
+	size_t itot;
+
+	/* requests in flight, sequence numbers of the next request
+	 * and of the next reply to go out, and replies that overtook
+	 * their predecessors */
+	size_t npend;
+	size_t rseq;
+	size_t wseq;
+	umpf_job_t parked;
+	/* requests in flight with the writers */
+	size_t nwpend;
+};
+
+/* a request on its way through the workers and its reply,
+ * finished jobs make up a connexion's output queue */
+struct umpf_job_s {
+	umpf_job_t next;
+	ev_qio_t qio;
+	size_t seq;
+	umpf_msg_t msg;
+	/* reply buffer, its allocated size and the reply's size,
+	 * the buffer stays with the job when it goes back to the pool */
 	char *rsp;
+	size_t rbsz;
 	size_t rsz;
+	/* frame header, if any */
+	size_t hsz;
+	char hdr[UMPF_FRAME_HDR_SIZE];
+	/* reply out of the reply cache, goes out instead of RSP */
+	rbuf_t shr;
+	/* rolled back along with its commit group, there's no reply */
+	bool lost;
+	/* went to a writer rather than a reader */
+	bool wr;
+};
+
+struct umpf_wrk_s {
+	pthread_t thr;
+	struct ev_loop *loop;
+	ev_async wake[1];
+	/* each worker has its own database connexion, and caches for
+	 * the portfolios sharded to it and the replies about them */
+	dbconn_t dbconn;
+	pfc_t pfc;
+	rcache_t rc;
+	/* requests from and replies to the I/O loop */
+	spsc_t req;
+	spsc_t rpl;
+	/* requests that didn't fit into REQ, I/O loop only */
+	umpf_job_t bklg;
+	umpf_job_t *bklg_tail;
+	/* jobs handed to this worker and not back yet, I/O loop only */
+	size_t nbusy;
+	/* writes done but not committed yet, their replies are held
+	 * back until they are */
+	umpf_job_t grp;
+	umpf_job_t *grp_tail;
+	size_t ngrp;
+	ev_timer grp_timer[1];
+	/* snapshots, for the worker with the in-memory database */
+	ev_timer snap_timer[1];
+	/* journal of the writes, the in-memory database's or, with
+	 * write-behind, this worker's own */
+	jnl_t jnl;
+	/* write-behind, writes in the open transaction, when that's
+	 * committed and whether the database has stopped taking them */
+	size_t nflush;
+	ev_timer flush_timer[1];
+	/* write-behind, writes replied to but not applied yet, in the
+	 * order they're journalled, they're applied when there's
+	 * nothing else to do */
+	umpf_msg_t *wbq;
+	size_t nwbq;
+	size_t wbqall;
+	ev_idle wb_idle[1];
+	bool wb;
+	bool stuck;
+	/* whether the connexion's in bulk load mode */
+	bool bulk;
+	int quit;
 };
 
-/* global database connexion object */
+/* global database connexion object, portfolio and reply cache,
+ * used without workers */
 static dbconn_t umpf_dbconn;
+static pfc_t umpf_pfc;
+static rcache_t umpf_rc;
+
+/* memory budgets for portfolio and reply caches, 0 to go without */
+static size_t umpf_pf_cache = UMPF_PF_CACHE;
+static size_t umpf_reply_cache = UMPF_REPLY_CACHE;
+
+/* largest request we accept */
+static size_t umpf_max_request = UMPF_MAX_REQUEST;
+
+/* group commit, largest group (1 for no grouping) and time to wait */
+static size_t umpf_group_max = UMPF_GROUP_MAX;
+static double umpf_group_window = UMPF_GROUP_WINDOW / 1000000.0;
+
+/* fills per portfolio the ledger takes before folding, 0 for no ledger */
+static size_t umpf_ledger = UMPF_LEDGER;
+
+/* sqlite tuning knobs of the db table, their value when not set,
+ * whether the bulk profile may switch them and whether they apply
+ * to read-only connexions */
+static const struct {
+	const char *key;
+	const char *dflt;
+	bool bulk;
+	bool ro;
+} umpf_knobs[] = {
+	{"journal_mode", NULL, false, false},
+	{"page_size", NULL, false, false},
+	{"synchronous", "OFF", true, false},
+	{"cache_size", "-2000", true, true},
+	{"mmap_size", "0", true, true},
+	{"temp_store", "DEFAULT", true, true},
+	{"busy_timeout", "5000", false, true},
+};
+#define UMPF_NKNOBS	countof(umpf_knobs)
+
+/* knobs as configured, and for writes of at least BULK_MIN positions */
+static char *umpf_tune_norm[UMPF_NKNOBS];
+static char *umpf_tune_bulk[UMPF_NKNOBS];
+static size_t umpf_bulk_min;
+
+/* in-memory mode, the database, the file it's snapshot to, how often
+ * that happens and the journal of writes since the last snapshot */
+static dbconn_t umpf_memconn;
+static const char *umpf_snap_file;
+static double umpf_snap_ival = UMPF_SNAPSHOT;
+static jnl_t umpf_jnl;
+
+/* write-behind, the journals' file name prefix and the seconds
+ * between flushes to the database */
+static const char *umpf_wb_file;
+static double umpf_wb_ival = UMPF_FLUSH;
+
+/* the directory of the memory-mapped store, if that's what we use */
+static const char *umpf_mmap_dir;
+
+/* workers and the I/O loop they report back to */
+static umpf_wrk_t wrk;
+static size_t nwrk;
+/* read-only workers, they follow the writers in WRK */
+static size_t nrdr;
+static struct ev_loop *umpf_ioloop;
+static ev_async cmpl_watcher[1];
+
+/* recycled jobs, I/O loop only */
+static umpf_job_t jpool;
+static size_t njpool;
 
 
 /* aux */
 #include "gq.c"
+#include "spsc.c"
+#include "pfc.c"
+#include "rcache.c"
+#include "jnl.c"
 
 static struct ev_io_q_s ioq = {0};
 
@@ -138,24 +356,84 @@ make_qio(void)
 {
 	ev_qio_t res;
 
-	if (ioq.q->free->i1st == NULL) {
-		size_t nitems = ioq.q->nitems / sizeof(*res);
-
-		assert(ioq.q->free->ilst == NULL);
-		UMPF_DEBUG("IOQ RESIZE -> %zu\n", nitems + 16);
-		init_gq(ioq.q, sizeof(*res), nitems + 16);
-		/* we don't need to rebuild our items */
+	if (ioq.q->nfree == 0U) {
+		/* grow by a chunk, existing clients stay where they are */
+		UMPF_DEBUG("IOQ GROW -> %zu\n", ioq.q->nitems + 1U);
+		if (init_gq(ioq.q, sizeof(*res), ioq.q->nitems + 1U) < 0) {
+			return NULL;
+		}
 	}
 	/* get us a new client and populate the object */
-	res = (void*)gq_pop_head(ioq.q->free);
-	memset(res, 0, sizeof(*res));
+	res = (void*)gq_pop_free(ioq.q);
+	memset((char*)res + sizeof(res->i), 0, sizeof(*res) - sizeof(res->i));
+	res->oq_tail = &res->oq;
 	return res;
 }
 
 static void
 free_io(ev_qio_t io)
 {
-	gq_push_tail(ioq.q->free, (gq_item_t)io);
+	gq_push_free(ioq.q, (gq_item_t)io);
+	return;
+}
+
+static umpf_job_t
+make_job(void)
+{
+	umpf_job_t res;
+
+	if ((res = jpool) != NULL) {
+		/* keep the reply buffer */
+		char *rsp = res->rsp;
+		size_t rbsz = res->rbsz;
+
+		jpool = res->next;
+		njpool--;
+		memset(res, 0, sizeof(*res));
+		res->rsp = rsp;
+		res->rbsz = rbsz;
+		return res;
+	}
+	res = xnew(*res);
+	memset(res, 0, sizeof(*res));
+	return res;
+}
+
+static void
+free_job(umpf_job_t j)
+{
+	if (j->msg != NULL) {
+		umpf_free_msg(j->msg);
+		j->msg = NULL;
+	}
+	if (j->shr != NULL) {
+		rbuf_unref(j->shr);
+		j->shr = NULL;
+	}
+	if (njpool < UMPF_JOB_POOL && j->rbsz <= UMPF_RBUF_KEEP) {
+		j->next = jpool;
+		jpool = j;
+		njpool++;
+		return;
+	}
+	if (j->rsp != NULL) {
+		free(j->rsp);
+	}
+	xfree(j);
+	return;
+}
+
+static void
+fini_jobs(void)
+{
+	for (umpf_job_t j; (j = jpool) != NULL;) {
+		jpool = j->next;
+		if (j->rsp != NULL) {
+			free(j->rsp);
+		}
+		xfree(j);
+	}
+	njpool = 0U;
 	return;
 }
 
@@ -232,6 +510,8 @@ make_unix_conn(const char *path)
 	}
 	/* allow the whole world to connect to us */
 	chmod(path, 0777);
+	/* we accept in batches until there's nothing left */
+	setsock_nonblock(s);
 	return s;
 
 fuck:
@@ -278,6 +558,12 @@ make_tcp_conn(uint16_t port)
 		close(s);
 		return -1;
 	}
+#if defined TCP_DEFER_ACCEPT
+	/* only wake us up when there's a request to read */
+	setsockopt_int(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1);
+#endif	/* TCP_DEFER_ACCEPT */
+	/* we accept in batches until there's nothing left */
+	setsock_nonblock(s);
 	return s;
 }
 
@@ -302,13 +588,25 @@ write_pidfile(const char *pidfile)
 
 
 /* connexion<->proto glue */
+struct get_clo_s {
+	umpf_msg_t msg;
+	/* positions MSG has room for */
+	size_t npos;
+};
+
 static int
 get_cb(char *mnemo, double l, double s, void *clo)
 {
-	umpf_msg_t msg = clo;
+	struct get_clo_s *c = clo;
+	umpf_msg_t msg = c->msg;
 	size_t idx = msg->pf.nposs;
 
 	UMPF_DEBUG("%s %2.4f %2.4f\n", mnemo, l, s);
+	if (UNLIKELY(idx >= c->npos)) {
+		/* more than counted, someone's been writing meanwhile */
+		free(mnemo);
+		return -1;
+	}
 	msg->pf.poss[idx].ins->sym = mnemo;
 	msg->pf.poss[idx].qty->_long = l;
 	msg->pf.poss[idx].qty->_shrt = s;
@@ -317,6 +615,88 @@ get_cb(char *mnemo, double l, double s, void *clo)
 	return 0;
 }
 
+#if defined UMPF_AUTO_SPARSE
+static bool
+msg_has_pos(umpf_msg_t msg, const char *sym)
+{
+	for (size_t i = 0; i < msg->pf.nposs; i++) {
+		if (!strcmp(msg->pf.poss[i].ins->sym, sym)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t
+sparse_pos_hash(const char *sym, double l, double s)
+{
+/* what a position contributes to the hash of a tag */
+# if defined UMPF_AUTO_PRUNE
+	if (l == 0.0 && s == 0.0) {
+		/* pruned, nobody will ever see it */
+		return 0U;
+	}
+# endif	/* UMPF_AUTO_PRUNE */
+	return umpf_pos_hash(sym, l, s);
+}
+
+struct sparse_hash_s {
+	umpf_msg_t msg;
+	uint64_t hash;
+};
+
+static int
+sparse_hash_cb(char *mnemo, double l, double s, void *clo)
+{
+	struct sparse_hash_s *c = clo;
+
+	if (mnemo != NULL && !msg_has_pos(c->msg, mnemo)) {
+		/* not overridden by the message */
+		c->hash += sparse_pos_hash(mnemo, l, s);
+	}
+	free(mnemo);
+	return 0;
+}
+
+static uint64_t
+sparse_hash(dbconn_t conn, pfc_ent_t e, umpf_msg_t msg)
+{
+/* like umpf_pf_hash() but over what a sparse tag of MSG will hold,
+ * i.e. MSG's positions on top of the tag before MSG's stamp,
+ * E is used for that tag if it's the one, return 0 on failure */
+	struct sparse_hash_s c = {msg, 0U};
+	dbobj_t tag;
+
+	for (size_t i = 0; i < msg->pf.nposs; i++) {
+		const struct __ins_qty_s *iq = msg->pf.poss + i;
+
+		c.hash += sparse_pos_hash(
+			iq->ins->sym, iq->qty->_long, iq->qty->_shrt);
+	}
+	if (e != NULL && e->stamp <= msg->pf.stamp) {
+		/* the cached tag is the latest, so it's the one */
+		for (size_t i = 0; i < e->npos; i++) {
+			const struct pfc_pos_s *p = e->pos + i;
+
+			if (!msg_has_pos(msg, p->sym)) {
+				c.hash += sparse_pos_hash(
+					p->sym, p->_long, p->_shrt);
+			}
+		}
+	} else if ((tag = be_sql_get_tag(
+			    conn, msg->pf.name, msg->pf.stamp)) != NULL) {
+		int res = be_sql_get_pos(conn, tag, sparse_hash_cb, &c);
+
+		be_sql_free_tag(conn, tag);
+		if (UNLIKELY(res < 0)) {
+			/* no hash is better than a wrong one */
+			return 0U;
+		}
+	}
+	return c.hash ? c.hash : 1U;
+}
+#endif	/* UMPF_AUTO_SPARSE */
+
 static int
 lst_pf_cb(char *mnemo, void *clo)
 {
@@ -357,8 +737,237 @@ lst_tag_cb(uint64_t tid, time_t tm, void *clo)
 	return 0;
 }
 
+/* portfolio cache glue,
+ * entries always reflect the most recent tag of a portfolio, which
+ * is correct as long as we're the only ones writing to the database
+ * and all writes to a portfolio go through the same cache */
+static int
+pfc_fill_cb(char *mnemo, double l, double s, void *clo)
+{
+	pfc_ent_t e = clo;
+	struct pfc_pos_s *p;
+
+	if (UNLIKELY(mnemo == NULL || (p = pfc_pos(e, mnemo)) == NULL)) {
+		e->pf = NULL;
+		free(mnemo);
+		return -1;
+	}
+	p->_long = l;
+	p->_shrt = s;
+	free(mnemo);
+	return 0;
+}
+
+static int
+ledger_fold(dbconn_t conn, pfc_t pfc, const char *mnemo)
+{
+/* fold MNEMO's ledger into tags unless its cache entry says there's
+ * nothing pending, return -1 if that didn't work out */
+	pfc_ent_t e = NULL;
+	tag_t last = 0UL;
+	int txn;
+	int res;
+
+	if (!umpf_ledger || mnemo == NULL) {
+		return 0;
+	} else if (pfc != NULL &&
+		   (e = pfc_get(pfc, mnemo)) != NULL && e->nfill == 0U) {
+		return 0;
+	}
+	txn = be_sql_begin(conn);
+	res = be_sql_fold(conn, mnemo, &last);
+	if (txn < 0) {
+		/* no transaction, whatever made it is there to stay */
+	} else if (res >= 0) {
+		res = be_sql_commit(conn) < 0 ? -1 : res;
+	} else {
+		be_sql_rollback(conn);
+	}
+	if (res < 0) {
+		UMPF_ERR_LOG("cannot fold ledger of %s\n", mnemo);
+		if (e != NULL) {
+			/* a refill will try again */
+			pfc_del(pfc, e);
+		}
+		return -1;
+	} else if (e != NULL) {
+		/* the cached positions have had the fills all along */
+		if (res > 0) {
+			e->tag_id = last;
+			pfc_untag(e);
+		}
+		e->nfill = 0U;
+		pfc_commit(pfc, e);
+	}
+	UMPF_DEBUG("folded %d fills of %s\n", res, mnemo);
+	return 0;
+}
+
+static int
+ledger_fold_cb(char *mnemo, void *clo)
+{
+	struct {
+		dbconn_t conn;
+		pfc_t pfc;
+	} *c = clo;
+
+	(void)ledger_fold(c->conn, c->pfc, mnemo);
+	free(mnemo);
+	return 0;
+}
+
+static void
+ledger_fold_all(dbconn_t conn, pfc_t pfc)
+{
+/* fold every ledger there is */
+	struct {
+		dbconn_t conn;
+		pfc_t pfc;
+	} clo = {conn, pfc};
+
+	if (!umpf_ledger) {
+		return;
+	}
+	be_sql_lst_fold(conn, ledger_fold_cb, &clo);
+	return;
+}
+
+static pfc_ent_t
+pfc_fill(dbconn_t conn, pfc_t pfc, const char *mnemo)
+{
+/* read the most recent tag of MNEMO into PFC */
+	dbobj_t tag;
+	pfc_ent_t e;
+
+	if (pfc == NULL) {
+		return NULL;
+	} else if ((e = pfc_get(pfc, mnemo)) != NULL) {
+		return e;
+	} else if (UNLIKELY(ledger_fold(conn, NULL, mnemo) < 0)) {
+		/* the latest tag would be missing fills */
+		return NULL;
+	} else if ((tag = be_sql_get_last_tag(conn, mnemo)) == NULL) {
+		/* no tags yet, nothing to cache */
+		return NULL;
+	} else if ((e = pfc_put(pfc, mnemo)) == NULL) {
+		be_sql_free_tag(conn, tag);
+		return NULL;
+	}
+	e->pf = be_sql_tag_get_pf(conn, tag);
+	e->tag_id = be_sql_tag_get_id(conn, tag);
+	e->stamp = be_sql_get_stamp(conn, tag);
+	e->digest = be_sql_tag_get_hash(conn, tag);
+	if (UNLIKELY(be_sql_get_pos(conn, tag, pfc_fill_cb, e) < 0)) {
+		e->pf = NULL;
+	}
+	be_sql_free_tag(conn, tag);
+
+	if (UNLIKELY(e->pf == NULL)) {
+		/* didn't work out */
+		pfc_del(pfc, e);
+		return NULL;
+	}
+	UMPF_DEBUG("cached %zu positions of %s\n", e->npos, mnemo);
+	pfc_commit(pfc, e);
+	return e;
+}
+
+static int
+pfc_tl_cb(uint64_t tid, time_t tm, void *clo)
+{
+	return pfc_tag(clo, tm, tid);
+}
+
+static pfc_ent_t
+pfc_tl_fill(dbconn_t conn, pfc_t pfc, const char *mnemo)
+{
+/* like pfc_fill() but with the timeline of MNEMO loaded as well */
+	pfc_ent_t e;
+
+	if ((e = pfc_fill(conn, pfc, mnemo)) == NULL) {
+		return NULL;
+	} else if (e->ntag > 0U) {
+		return e;
+	}
+	be_sql_lst_tag(conn, mnemo, pfc_tl_cb, e);
+	if (UNLIKELY(e->ntag == 0U)) {
+		/* not even the latest tag, something's wrong */
+		return NULL;
+	}
+	UMPF_DEBUG("cached %zu tags of %s\n", e->ntag, mnemo);
+	pfc_commit(pfc, e);
+	return e;
+}
+
+static void
+pfc_tl_add(pfc_t pfc, const char *mnemo, time_t stamp, tag_t tid)
+{
+/* put the new tag TID into MNEMO's timeline, if that's loaded */
+	pfc_ent_t e;
+
+	if (pfc == NULL || (e = pfc_get(pfc, mnemo)) == NULL || !e->ntag) {
+		return;
+	}
+	(void)pfc_tag(e, stamp, tid);
+	pfc_commit(pfc, e);
+	return;
+}
+
+static struct __qty_s
+pfc_add_fill(
+	dbconn_t conn, pfc_t pfc, pfc_ent_t *e, const char *mnemo,
+	time_t stamp, const char *sec, double l, double s)
+{
+/* like pfc_add_pos() but append the fill to MNEMO's ledger, without
+ * cache entry *E there's no telling the resulting position */
+	struct __qty_s res = {._long = NAN, ._shrt = NAN};
+	struct pfc_pos_s *p;
+
+	if (UNLIKELY(*e == NULL)) {
+		return res;
+	} else if (UNLIKELY((p = pfc_pos(*e, sec)) == NULL ||
+			    be_sql_add_fill(conn, mnemo, stamp, sec, l, s))) {
+		pfc_del(pfc, *e);
+		*e = NULL;
+		return res;
+	}
+	(*e)->nfill++;
+	res._long = p->_long += l;
+	res._shrt = p->_shrt += s;
+	return res;
+}
+
+static struct __qty_s
+pfc_add_pos(
+	dbconn_t conn, pfc_t pfc, pfc_ent_t *e, dbobj_t tag,
+	const char *sec, double l, double s)
+{
+/* like be_sql_add_pos() but take the current position from cache
+ * entry *E, if things go wrong *E is dropped */
+	struct __qty_s res = {._long = NAN, ._shrt = NAN};
+	struct pfc_pos_s *p;
+
+	if (UNLIKELY((p = pfc_pos(*e, sec)) == NULL)) {
+		/* fall back to the database */
+		pfc_del(pfc, *e);
+		*e = NULL;
+		return be_sql_add_pos(conn, tag, sec, l, s);
+	}
+	l += p->_long;
+	s += p->_shrt;
+	if (UNLIKELY(be_sql_set_pos(conn, tag, sec, l, s) < 0)) {
+		pfc_del(pfc, *e);
+		*e = NULL;
+		return res;
+	}
+	res._long = p->_long = l;
+	res._shrt = p->_shrt = s;
+	return res;
+}
+
 static size_t
-interpret_msg(char **buf, umpf_msg_t msg)
+interpret_msg(
+	dbconn_t conn, pfc_t pfc, char **buf, size_t bsz, umpf_msg_t msg)
 {
 	size_t len;
 
@@ -374,14 +983,14 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		dbobj_t pf;
 
 		UMPF_INFO_LOG("new_pf()/set_descr();\n");
-		pf = be_sql_new_pf(umpf_dbconn, mnemo, descr[0]);
+		pf = be_sql_new_pf(conn, mnemo, descr[0]);
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_pf(umpf_dbconn, pf);
+		be_sql_free_pf(conn, pf);
 		break;
 	}
 	case UMPF_MSG_GET_DESCR: {
@@ -392,20 +1001,20 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		if (msg->new_pf.satellite->data != NULL) {
 			free(msg->new_pf.satellite->data);
 		}
-		msg->new_pf.satellite[0] = be_sql_get_descr(umpf_dbconn, mnemo);
+		msg->new_pf.satellite[0] = be_sql_get_descr(conn, mnemo);
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 		break;
 	}
 	case UMPF_MSG_LST_PF:
 		UMPF_INFO_LOG("lst_pf();\n");
-		be_sql_lst_pf(umpf_dbconn, lst_pf_cb, &msg);
+		be_sql_lst_pf(conn, lst_pf_cb, &msg);
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 		break;
 
 	case UMPF_MSG_GET_PF: {
@@ -413,63 +1022,201 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		time_t stamp;
 		dbobj_t tag;
 		size_t npos;
+		pfc_ent_t e;
+		struct get_clo_s gc = {NULL};
 
 		UMPF_INFO_LOG("get_pf();\n");
 		mnemo = msg->pf.name;
 		stamp = msg->pf.stamp;
+		msg->pf.hash = 0U;
+		/* tags are made lazily, now's the time */
+		(void)ledger_fold(conn, pfc, mnemo);
+
+		if ((e = pfc_fill(conn, pfc, mnemo)) != NULL &&
+		    stamp >= e->stamp) {
+			/* the latest tag is what they want, the message
+			 * borrows the symbols, they're not freed with it */
+			msg->pf.stamp = e->stamp;
+			msg->pf.tag_id = e->tag_id;
+			msg->pf.hash = e->digest;
+			msg = umpf_msg_add_pos(msg, e->npos);
+			for (size_t i = 0; i < e->npos; i++) {
+				msg->pf.poss[i].ins->sym = e->pos[i].sym;
+				msg->pf.poss[i].qty->_long = e->pos[i]._long;
+				msg->pf.poss[i].qty->_shrt = e->pos[i]._shrt;
+			}
+			msg->pf.nposs = e->npos;
+
+			msg->hdr.mt++;
+			len = umpf_seria_msg(buf, bsz, msg);
+			break;
+		}
+
+		if (e != NULL && (e = pfc_tl_fill(conn, pfc, mnemo)) != NULL) {
+			/* as-of, the timeline knows which tag that is */
+			const struct pfc_tag_s *t = pfc_asof(e, stamp);
 
-		tag = be_sql_get_tag(umpf_dbconn, mnemo, stamp);
+			tag = NULL;
+			if (t != NULL) {
+				tag = be_sql_get_tag_pf(
+					conn, e->pf, t->tag_id, t->stamp);
+			}
+		} else {
+			tag = be_sql_get_tag(conn, mnemo, stamp);
+		}
 		if (LIKELY(tag != NULL)) {
-			tag_t tid = be_sql_tag_get_id(umpf_dbconn, tag);
+			tag_t tid = be_sql_tag_get_id(conn, tag);
 
 			/* set correct tag stamp */
-			msg->pf.stamp = be_sql_get_stamp(umpf_dbconn, tag);
+			msg->pf.stamp = be_sql_get_stamp(conn, tag);
 			msg->pf.tag_id = tid;
+			msg->pf.hash = be_sql_tag_get_hash(conn, tag);
 			/* get the number of positions */
-			npos = be_sql_get_npos(umpf_dbconn, tag);
+			npos = be_sql_get_npos(conn, tag);
 			UMPF_DEBUG("found %zu positions for %lu\n", npos, tid);
 
 			msg = umpf_msg_add_pos(msg, npos);
 			msg->pf.nposs = 0;
-			be_sql_get_pos(umpf_dbconn, tag, get_cb, msg);
+			gc.msg = msg;
+			gc.npos = npos;
+			if (UNLIKELY(be_sql_get_pos(
+					     conn, tag, get_cb, &gc) < 0)) {
+				/* rather nothing than half the positions */
+				UMPF_ERR_LOG("\
+get_pf(): cannot read %s\n", mnemo);
+				for (size_t i = 0; i < msg->pf.nposs; i++) {
+					free(msg->pf.poss[i].ins->sym);
+				}
+				msg->pf.nposs = 0U;
+				msg->pf.tag_id = 0UL;
+				msg->pf.hash = 0U;
+			}
 		}
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_tag(umpf_dbconn, tag);
+		be_sql_free_tag(conn, tag);
 		break;
 	}
 	case UMPF_MSG_SET_PF: {
 		const char *mnemo;
 		time_t stamp;
 		dbobj_t tag;
+		pfc_ent_t e = NULL;
+		tag_t alias = 0UL;
+		int txn;
+		int res;
 
 		UMPF_DEBUG("set_pf();\n");
 		mnemo = msg->pf.name;
 		stamp = msg->pf.stamp;	
+		/* pending fills come before this tag */
+		(void)ledger_fold(conn, pfc, mnemo);
+		if (pfc != NULL) {
+			e = pfc_get(pfc, mnemo);
+		}
+		/* the tag and all of its positions, or nothing */
+		txn = be_sql_begin(conn);
+#if defined UMPF_AUTO_SPARSE
+		/* positions are on top of the previous tag's, so that's
+		 * what the hash goes over */
+		msg->pf.hash = sparse_hash(conn, e, msg);
+#else  /* !UMPF_AUTO_SPARSE */
+		msg->pf.hash = umpf_pf_hash(msg);
+#endif	/* UMPF_AUTO_SPARSE */
+		if (msg->pf.hash &&
+		    (alias = be_sql_find_hash(conn, mnemo, msg->pf.hash))) {
+			/* seen these positions before, share them */
+			UMPF_DEBUG("set_pf(): aliasing tag %lu\n", alias);
+			tag = be_sql_alias_tag(conn, mnemo, stamp, alias);
+		} else {
+#if defined UMPF_AUTO_SPARSE
+			tag = be_sql_copy_tag(conn, mnemo, stamp);
+#else  /* !UMPF_AUTO_SPARSE */
+			tag = be_sql_new_tag(conn, mnemo, stamp);
+#endif	/* UMPF_AUTO_SPARSE */
+		}
+		msg->pf.tag_id = be_sql_tag_get_id(conn, tag);
+
+		if (e != NULL) {
+			if (stamp < e->stamp) {
+				/* back-dated, the cached tag stays on top */
+				e = NULL;
+			} else if (tag == NULL || msg->pf.tag_id == 0UL) {
+				pfc_del(pfc, e);
+				e = NULL;
+			} else {
 #if defined UMPF_AUTO_SPARSE
-		tag = be_sql_copy_tag(umpf_dbconn, mnemo, stamp);
+				/* positions have been copied over */
+# if defined UMPF_AUTO_PRUNE
+				pfc_prune(e);
+# endif	/* UMPF_AUTO_PRUNE */
 #else  /* !UMPF_AUTO_SPARSE */
-		tag = be_sql_new_tag(umpf_dbconn, mnemo, stamp);
+				pfc_clear(e);
 #endif	/* UMPF_AUTO_SPARSE */
-		msg->pf.tag_id = be_sql_tag_get_id(umpf_dbconn, tag);
+				e->tag_id = msg->pf.tag_id;
+				e->stamp = stamp;
+				e->digest = msg->pf.hash;
+			}
+		}
+
+		if (tag == NULL || msg->pf.tag_id == 0UL) {
+			res = -1;
+		} else if (alias) {
+			/* the positions are there already */
+			res = 0;
+		} else {
+			res = be_sql_set_poss(
+				conn, tag, msg->pf.poss, msg->pf.nposs);
+		}
+		if (res == 0 && msg->pf.hash) {
+			res = be_sql_tag_set_hash(conn, tag, msg->pf.hash);
+		}
+		if (txn < 0) {
+			/* no transaction, whatever made it is there to stay */
+		} else if (res == 0) {
+			res = be_sql_commit(conn);
+		} else {
+			be_sql_rollback(conn);
+		}
+		if (res < 0) {
+			UMPF_ERR_LOG("set_pf(): cannot record %s\n", mnemo);
+			msg->pf.tag_id = 0UL;
+			msg->pf.hash = 0U;
+			if (e != NULL) {
+				pfc_del(pfc, e);
+				e = NULL;
+			}
+		} else {
+			pfc_tl_add(pfc, mnemo, stamp, msg->pf.tag_id);
+		}
 
-		for (size_t i = 0; i < msg->pf.nposs; i++) {
+		for (size_t i = 0; e != NULL && i < msg->pf.nposs; i++) {
 			const char *sec = msg->pf.poss[i].ins->sym;
-			double l = msg->pf.poss[i].qty->_long;
-			double s = msg->pf.poss[i].qty->_shrt;
-			be_sql_set_pos(umpf_dbconn, tag, sec, l, s);
+			struct pfc_pos_s *p;
+
+			if ((p = pfc_pos(e, sec)) != NULL) {
+				p->_long = msg->pf.poss[i].qty->_long;
+				p->_shrt = msg->pf.poss[i].qty->_shrt;
+			} else {
+				/* cache and database disagree now */
+				pfc_del(pfc, e);
+				e = NULL;
+			}
+		}
+		if (e != NULL) {
+			pfc_commit(pfc, e);
 		}
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_tag(umpf_dbconn, tag);
+		be_sql_free_tag(conn, tag);
 		break;
 	}
 	case UMPF_MSG_NEW_SEC: {
@@ -479,14 +1226,14 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		dbobj_t sec;
 
 		UMPF_DEBUG("new_sec();\n");
-		sec = be_sql_new_sec(umpf_dbconn, pf_mnemo, sec_mnemo, *descr);
+		sec = be_sql_new_sec(conn, pf_mnemo, sec_mnemo, *descr);
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_sec(umpf_dbconn, sec);
+		be_sql_free_sec(conn, sec);
 		break;
 	}
 	case UMPF_MSG_SET_SEC: {
@@ -496,16 +1243,16 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		dbobj_t sec;
 
 		UMPF_DEBUG("set_sec();\n");
-		sec = be_sql_set_sec(umpf_dbconn, pf_mnemo, sec_mnemo, *descr);
+		sec = be_sql_set_sec(conn, pf_mnemo, sec_mnemo, *descr);
 
 		/* reuse the message to send the answer,
 		 * we should check if SEC is a valid sec-id actually and
 		 * send an error otherwise */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_sec(umpf_dbconn, sec);
+		be_sql_free_sec(conn, sec);
 		break;
 	}
 	case UMPF_MSG_GET_SEC: {
@@ -519,11 +1266,11 @@ interpret_msg(char **buf, umpf_msg_t msg)
 			free(msg->new_sec.satellite->data);
 		}
 		msg->new_sec.satellite[0] =
-			be_sql_get_sec(umpf_dbconn, pf_mnemo, sec_mnemo);
+			be_sql_get_sec(conn, pf_mnemo, sec_mnemo);
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 		break;
 	}
 	case UMPF_MSG_PATCH: {
@@ -532,13 +1279,68 @@ interpret_msg(char **buf, umpf_msg_t msg)
 		time_t stamp;
 		dbobj_t tag;
 		size_t res_nposs = 0;
+		pfc_ent_t e;
+		bool lgp = false;
+		int txn;
+		int res = 0;
 
 		UMPF_DEBUG("patch();\n");
 		mnemo = msg->pf.name;
 		stamp = msg->pf.stamp;
-		tag = be_sql_copy_tag(umpf_dbconn, mnemo, stamp);
+		if (umpf_ledger &&
+		    (e = pfc_fill(conn, pfc, mnemo)) != NULL &&
+		    stamp >= e->stamp) {
+			/* in order, the fills go to the ledger and the
+			 * cache keeps the sums */
+			lgp = true;
+		} else if (UNLIKELY(ledger_fold(conn, pfc, mnemo) < 0)) {
+			/* a tag now would be missing fills */
+			res = -1;
+		}
+		/* the copied tag plus all fills, or nothing */
+		txn = be_sql_begin(conn);
+		if (lgp) {
+			tag = NULL;
+			e->stamp = stamp;
+			e->digest = 0ULL;
+		} else if (res < 0) {
+			tag = NULL;
+			e = NULL;
+		} else if ((e = pfc_fill(conn, pfc, mnemo)) == NULL) {
+			tag = be_sql_copy_tag(conn, mnemo, stamp);
+		} else if (stamp < e->stamp) {
+			/* back-dated, the cached tag stays on top but the
+			 * timeline knows which tag to copy */
+			const struct pfc_tag_s *t;
+
+			if ((e = pfc_tl_fill(conn, pfc, mnemo)) == NULL) {
+				tag = be_sql_copy_tag(conn, mnemo, stamp);
+			} else {
+				t = pfc_asof(e, stamp);
+				tag = be_sql_copy_tag_pf(
+					conn, e->pf, stamp,
+					t != NULL ? t->tag_id : 0UL);
+			}
+			e = NULL;
+		} else if ((tag = be_sql_copy_tag_pf(
+				    conn, e->pf, stamp, e->tag_id)) == NULL) {
+			pfc_del(pfc, e);
+			e = NULL;
+		} else {
+			/* positions have been copied over */
+#if defined UMPF_AUTO_PRUNE
+			pfc_prune(e);
+#endif	/* UMPF_AUTO_PRUNE */
+			e->tag_id = be_sql_tag_get_id(conn, tag);
+			e->stamp = stamp;
+			/* patched tags go without hash */
+			e->digest = 0ULL;
+		}
 
-		for (size_t i = 0, j; i < msg->pf.nposs; i++) {
+		if (tag == NULL && !lgp) {
+			res = -1;
+		}
+		for (size_t i = 0, j; res == 0 && i < msg->pf.nposs; i++) {
 			const char *sec = msg->pf.poss[i].ins->sym;
 			double v = msg->pf.poss[i].qsd->pos;
 			double l;
@@ -574,7 +1376,17 @@ interpret_msg(char **buf, umpf_msg_t msg)
 			}
 			/* re-assign to j-th slot */
 			P[j].ins->sym = P[i].ins->sym;
-			*P[j].qty = be_sql_add_pos(umpf_dbconn, tag, sec, l, s);
+			if (lgp) {
+				*P[j].qty = pfc_add_fill(
+					conn, pfc, &e, mnemo, stamp, sec, l, s);
+			} else if (e == NULL) {
+				*P[j].qty = be_sql_add_pos(conn, tag, sec, l, s);
+			} else {
+				*P[j].qty = pfc_add_pos(conn, pfc, &e, tag, sec, l, s);
+			}
+			if (UNLIKELY(isnan(P[j].qty->_long))) {
+				res = -1;
+			}
 			/* set new nposs value */
 			if (j >= res_nposs) {
 				res_nposs = j + 1;
@@ -582,28 +1394,69 @@ interpret_msg(char **buf, umpf_msg_t msg)
 #undef P
 		}
 
+		if (txn < 0) {
+			/* no transaction, whatever made it is there to stay */
+		} else if (res == 0) {
+			res = be_sql_commit(conn);
+		} else {
+			be_sql_rollback(conn);
+		}
+		if (res < 0) {
+			UMPF_ERR_LOG("patch(): cannot record %s\n", mnemo);
+			if (pfc != NULL && (e = pfc_get(pfc, mnemo)) != NULL) {
+				/* even back-dated, the entry might have
+				 * seen a fold that's been rolled back */
+				pfc_del(pfc, e);
+				e = NULL;
+			}
+		}
+		if (e != NULL) {
+			pfc_commit(pfc, e);
+		}
+		if (res == 0 && tag != NULL) {
+			pfc_tl_add(
+				pfc, mnemo, stamp, be_sql_tag_get_id(conn, tag));
+		} else if (res == 0 && e != NULL && e->nfill >= umpf_ledger) {
+			/* the ledger's long enough */
+			(void)ledger_fold(conn, pfc, mnemo);
+		}
+
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
 		msg->pf.nposs = res_nposs;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 
 		/* free resources */
-		be_sql_free_tag(umpf_dbconn, tag);
+		be_sql_free_tag(conn, tag);
 		break;
 	}
-	case UMPF_MSG_LST_TAG:
+	case UMPF_MSG_LST_TAG: {
+		const char *mnemo = msg->lst_tag.name;
+		pfc_ent_t e = NULL;
+
 		UMPF_INFO_LOG("lst_tag();\n");
-		be_sql_lst_tag(
-			umpf_dbconn, msg->lst_tag.name, lst_tag_cb, &msg);
+		(void)ledger_fold(conn, pfc, mnemo);
+		if (mnemo != NULL) {
+			e = pfc_tl_fill(conn, pfc, mnemo);
+		}
+		for (size_t i = 0; e != NULL && i < e->ntag; i++) {
+			const struct pfc_tag_s *t = e->tag + i;
+
+			(void)lst_tag_cb(t->tag_id, t->stamp, &msg);
+		}
+		if (e == NULL) {
+			be_sql_lst_tag(conn, mnemo, lst_tag_cb, &msg);
+		}
 
 		/* reuse the message to send the answer */
 		msg->hdr.mt++;
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 		break;
+	}
 	default:
 		UMPF_DEBUG("unknown message %u\n", msg->hdr.mt);
 		umpf_set_msg_type(msg, UMPF_MSG_UNK);
-		len = umpf_seria_msg(buf, 0, msg);
+		len = umpf_seria_msg(buf, bsz, msg);
 		break;
 	}
 	/* free 'im 'ere */
@@ -611,55 +1464,13 @@ interpret_msg(char **buf, umpf_msg_t msg)
 	return len;
 }
 
-/**
- * Take the stuff in MSG of size MSGLEN coming from FD and process it.
- * Return values <0 cause the handler caller to close down the socket. */
-static int
-handle_data(ev_qio_t qio, char *msg, size_t msglen)
-{
-	umpf_ctx_t p = qio->ctx;
-	umpf_msg_t umsg;
-
-	UMPF_DEBUG("/ctx: %p %zu\n", p, msglen);
-#if defined DEBUG_FLAG
-	/* safely write msg to logerr now */
-	fwrite(msg, msglen, 1, umpf_logout);
-#endif	/* DEBUG_FLAG */
-
-	if ((umsg = umpf_parse_blob_r(&p, msg, msglen)) != NULL) {
-		/* definite success */
-		char *buf = NULL;
-		size_t len;
-
-		/* serialise, put results in BUF*/
-		if ((len = interpret_msg(&buf, umsg))) {
-			qio->rsp = buf;
-			qio->rsz = len;
-			UMPF_DEBUG("requesting write buffer\n");
-		}
-		qio->ctx = NULL;
-		/* request connection close and writing of data */
-		return 1;
-
-	} else if (/* umsg == NULL && */p == NULL) {
-		/* error occurred */
-		UMPF_DEBUG("ERROR\n");
-		qio->ctx = NULL;
-		/* request connection close */
-		return -1;
-	}
-	UMPF_DEBUG("need more grub\n");
-	qio->ctx = p;
-	return 0;
-}
-
 static int
 handle_close(ev_qio_t qio)
 {
 	umpf_ctx_t p = qio->ctx;
 
 	UMPF_DEBUG("forgetting about %p\n", p);
-	if (p != NULL) {
+	if (qio->mode != QIO_MODE_FRAME && p != NULL) {
 		/* finalise the push parser to avoid mem leaks */
 		umpf_msg_t msg = umpf_parse_blob_r(&p, p, 0);
 
@@ -669,111 +1480,1501 @@ handle_close(ev_qio_t qio)
 		}
 		qio->ctx = p;
 	}
-	if (qio->rsp != NULL) {
-		free(qio->rsp);
+	if (qio->ibuf != NULL) {
+		free(qio->ibuf);
+		qio->ibuf = NULL;
+	}
+	/* replies that were waiting for their predecessors */
+	for (umpf_job_t j = qio->parked, nx; j != NULL; j = nx) {
+		nx = j->next;
+		free_job(j);
+	}
+	qio->parked = NULL;
+	/* replies that haven't made it out */
+	for (umpf_job_t j = qio->oq, nx; j != NULL; j = nx) {
+		nx = j->next;
+		free_job(j);
 	}
+	qio->oq = NULL;
+	qio->oq_tail = &qio->oq;
 	return 0;
 }
 
-
-/* our database connexion */
-#if defined HARD_INCLUDE_be_sql
-# include "be-sql.c"
-#endif	/* HARD_INCLUDE_be_sql */
-
-
-/* callbacks */
-static void
-dccp_dtwr_cb(EV_P_ ev_io *w, int UNUSED(re))
+static const char*
+rc_dirt(umpf_msg_t msg)
 {
-	ev_qio_t qio = w->data;
-	ssize_t nwr;
-	const char *buf = qio->rsp + qio->nwr;
-	size_t bsz = qio->rsz - qio->nwr;
-
-	if (UNLIKELY((nwr = write(w->fd, buf, bsz)) <= 0) ||
-	    LIKELY((qio->nwr += nwr) >= qio->rsz)) {
-		/* something's fucked or everything's written */
-		qio->ctx = NULL;
-		goto clo;
+/* return the portfolio MSG modifies, if any */
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_NEW_PF:
+	case UMPF_MSG_SET_DESCR:
+		return msg->new_pf.name;
+	case UMPF_MSG_SET_PF:
+	case UMPF_MSG_PATCH:
+		return msg->pf.name;
+	case UMPF_MSG_NEW_SEC:
+	case UMPF_MSG_SET_SEC:
+		return msg->new_sec.pf_mnemo;
+	default:
+		break;
 	}
-	/* just keep a note of how much is left */
-	qio->nwr += nwr;
-	return;
-
-clo:
-	handle_close(qio);
-	ev_qio_shut(EV_A_ w);
-	return;
+	return NULL;
 }
 
-static void
-dccp_data_cb(EV_P_ ev_io *w, int UNUSED(re))
+static size_t
+rc_key(char *key, size_t ksz, pfc_t pfc, umpf_msg_t msg)
 {
-	static char buf[4096];
-	ev_qio_t qio = w->data;
-	ssize_t nrd;
-	ssize_t nwr;
-
-	if (UNLIKELY((nrd = read(w->fd, buf, sizeof(buf))) <= 0)) {
-		goto clo;
-	} else if (LIKELY((size_t)nrd < sizeof(buf))) {
-		buf[nrd] = '\0';
+/* build the reply cache key of MSG in KEY of size KSZ, that's the
+ * message type, the portfolio, a \0 and whatever else identifies the
+ * request; return the key's size or 0 if MSG's reply isn't cacheable */
+	umpf_msg_type_t mt = umpf_get_msg_type(msg);
+	const char *pf;
+	const void *x = NULL;
+	size_t xsz = 0U;
+	unsigned long int gen;
+	size_t pfsz;
+
+	switch (mt) {
+	case UMPF_MSG_GET_PF: {
+		pfc_ent_t e;
+
+		/* only the latest tag can be told apart from the rest */
+		pf = msg->pf.name;
+		if (pfc == NULL || pf == NULL ||
+		    (e = pfc_get(pfc, pf)) == NULL ||
+		    msg->pf.stamp < e->stamp) {
+			return 0U;
+		}
+		/* the clearing date comes back verbatim */
+		x = &msg->pf.clr_dt;
+		xsz = sizeof(msg->pf.clr_dt);
+		break;
+	}
+	case UMPF_MSG_GET_DESCR:
+		pf = msg->new_pf.name;
+		break;
+	case UMPF_MSG_GET_SEC:
+		pf = msg->new_sec.pf_mnemo;
+		if ((x = msg->new_sec.ins->sym) != NULL) {
+			xsz = strlen(x);
+		}
+		break;
+	case UMPF_MSG_LST_TAG:
+		pf = msg->lst_tag.name;
+		break;
+	case UMPF_MSG_LST_PF:
+		/* no portfolio, but the list has to be current */
+		pf = "";
+		gen = be_sql_pf_gen();
+		x = &gen;
+		xsz = sizeof(gen);
+		break;
+	default:
+		return 0U;
+	}
+	if (pf == NULL || (*pf == '\0' && mt != UMPF_MSG_LST_PF)) {
+		return 0U;
+	} else if (1U + (pfsz = strlen(pf)) + 1U + xsz > ksz) {
+		return 0U;
+	}
+	key[0] = (char)mt;
+	memcpy(key + 1U, pf, pfsz + 1U);
+	if (xsz) {
+		memcpy(key + 1U + pfsz + 1U, x, xsz);
+	}
+	return 1U + pfsz + 1U + xsz;
+}
+
+static void
+run_job(dbconn_t conn, pfc_t pfc, rcache_t rc, jnl_t jnl, umpf_job_t j)
+{
+/* execute J's request and put the reply into J's buffer,
+ * or hand out a cached reply, writes go to journal JNL first */
+	char key[256U];
+	size_t ksz = 0U;
+	const char *pf;
+
+	if (jnl != NULL && rc_dirt(j->msg) != NULL &&
+	    UNLIKELY(jnl_add(jnl, j->msg) < 0)) {
+		/* what isn't journalled mustn't happen */
+		UMPF_ERR_LOG("cannot journal write\n");
+		umpf_free_msg(j->msg);
+		j->msg = NULL;
+		j->lost = true;
+		return;
+	}
+	if (rc != NULL && (pf = rc_dirt(j->msg)) != NULL) {
+		/* replies about PF are history */
+		rcache_bump(rc, pf);
+	} else if (rc != NULL &&
+		   (ksz = rc_key(key, sizeof(key), pfc, j->msg)) > 0U) {
+		/* the key spells out the portfolio */
+		rbuf_t b;
+
+		pf = key[1U] ? key + 1U : NULL;
+		if ((b = rcache_get(rc, key, ksz, pf)) != NULL) {
+			UMPF_DEBUG("reply cache hit\n");
+			umpf_free_msg(j->msg);
+			j->msg = NULL;
+			j->shr = b;
+			j->rsz = b->len;
+			return;
+		}
+	}
+
+	j->rsz = interpret_msg(conn, pfc, &j->rsp, j->rbsz, j->msg);
+	j->msg = NULL;
+	if (j->rsz >= j->rbsz) {
+		/* buffer's been resized, it's at least this big */
+		j->rbsz = j->rsz + 1U;
+	}
+	if (ksz) {
+		rcache_put(rc, key, ksz, key[1U] ? key + 1U : NULL, j->rsp, j->rsz);
+	}
+	return;
+}
+
+
+/* our database connexion */
+#if defined HARD_INCLUDE_be_sql
+# include "be-mmap.c"
+# include "be-sql.c"
+#endif	/* HARD_INCLUDE_be_sql */
+
+
+/* storage tuning */
+static void
+umpf_tune(dbconn_t conn, bool rop)
+{
+/* apply the configured knobs to CONN, read-only if ROP */
+	for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+		if (umpf_tune_norm[i] == NULL || (rop && !umpf_knobs[i].ro)) {
+			continue;
+		}
+		(void)be_sql_pragma(conn, umpf_knobs[i].key, umpf_tune_norm[i]);
+	}
+	return;
+}
+
+static void
+umpf_tune_bulk_p(dbconn_t conn, bool bulkp)
+{
+/* switch CONN to the bulk profile or back */
+	for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+		const char *v;
+
+		if (umpf_tune_bulk[i] == NULL) {
+			continue;
+		} else if (bulkp) {
+			v = umpf_tune_bulk[i];
+		} else if ((v = umpf_tune_norm[i]) == NULL) {
+			v = umpf_knobs[i].dflt;
+		}
+		(void)be_sql_pragma(conn, umpf_knobs[i].key, v);
+	}
+	return;
+}
+
+static bool
+umpf_bulkp(umpf_msg_t msg)
+{
+/* whether MSG is big enough for the bulk profile */
+	if (!umpf_bulk_min) {
+		return false;
+	}
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_SET_PF:
+	case UMPF_MSG_PATCH:
+		return msg->pf.nposs >= umpf_bulk_min;
+	default:
+		break;
+	}
+	return false;
+}
+
+
+/* in-memory mode */
+static bool
+umpf_jnl_lost(jnl_t j)
+{
+/* make the journal J durable, return true if it couldn't be */
+	if (j == NULL || LIKELY(jnl_sync(j) == 0)) {
+		return false;
+	}
+	UMPF_ERR_LOG("cannot sync journal\n");
+	return true;
+}
+
+static void
+umpf_snapshot(dbconn_t conn, pfc_t pfc)
+{
+/* write CONN's committed state to the snapshot file, the journal
+ * up to this point is obsolete then, ledgers are folded beforehand
+ * and PFC, the cache that goes with CONN, is kept in the loop */
+	ledger_fold_all(conn, pfc);
+	if (umpf_jnl_lost(umpf_jnl)) {
+		return;
+	} else if (be_sql_snapshot(
+			   conn, umpf_snap_file, jnl_seq(umpf_jnl)) < 0) {
+		UMPF_ERR_LOG("cannot snapshot to %s\n", umpf_snap_file);
+		return;
+	} else if (jnl_reset(umpf_jnl) < 0) {
+		/* no harm done, replays skip what's in the snapshot */
+		UMPF_ERR_LOG("cannot reset journal\n");
+	}
+	UMPF_DEBUG("snapshot at %u\n", jnl_seq(umpf_jnl));
+	return;
+}
+
+static int
+umpf_replay_cb(umpf_msg_t msg, void *clo)
+{
+	char *buf = NULL;
+
+	(void)interpret_msg(clo, NULL, &buf, 0U, msg);
+	if (buf != NULL) {
+		free(buf);
+	}
+	return 0;
+}
+
+static int
+umpf_open_mem(const char *file, double ival)
+{
+/* load the snapshot FILE into memory and replay its journal */
+	static const char sfx[] = ".umpfj";
+	size_t fsz = strlen(file);
+	char jfn[fsz + sizeof(sfx)];
+	unsigned int mark;
+	ssize_t nrp;
+
+	if ((umpf_memconn = be_sql_open_mem(file, &mark)) == NULL) {
+		UMPF_CRIT_LOG("cannot load %s into memory\n", file);
+		return -1;
+	}
+	memcpy(jfn, file, fsz);
+	memcpy(jfn + fsz, sfx, sizeof(sfx));
+	if ((umpf_jnl = make_jnl(jfn)) == NULL) {
+		UMPF_CRIT_LOG("cannot open journal %s\n", jfn);
+		goto bugger;
+	}
+	umpf_tune(umpf_memconn, false);
+
+	/* catch up on what happened since the snapshot */
+	if (be_sql_begin(umpf_memconn) < 0) {
+		goto bugger;
+	}
+	nrp = jnl_replay(umpf_jnl, mark, umpf_replay_cb, umpf_memconn);
+	if (be_sql_commit(umpf_memconn) < 0 || nrp < 0) {
+		UMPF_CRIT_LOG("cannot replay journal %s\n", jfn);
+		goto bugger;
+	}
+	UMPF_INFO_LOG("replayed %zd writes from %s\n", nrp, jfn);
+	umpf_snap_file = file;
+	umpf_snap_ival = ival;
+	return 0;
+
+bugger:
+	if (umpf_jnl != NULL) {
+		free_jnl(umpf_jnl);
+		umpf_jnl = NULL;
+	}
+	be_sql_close(umpf_memconn);
+	umpf_memconn = NULL;
+	return -1;
+}
+
+
+/* write-behind */
+static ssize_t
+umpf_wb_catch_up(dbconn_t conn, jnl_t j, unsigned int id)
+{
+/* bring CONN up to date with the records of journal J (number ID)
+ * it hasn't seen, in one transaction, then start J over;
+ * return the number of records applied or -1 */
+	uint32_t mark;
+	ssize_t nrp;
+
+	if (be_sql_get_mark(conn, id, &mark) < 0) {
+		return -1;
+	} else if (be_sql_begin(conn) < 0) {
+		return -1;
+	}
+	nrp = jnl_replay(j, mark, umpf_replay_cb, conn);
+	if (nrp < 0 || be_sql_set_mark(conn, id, jnl_seq(j)) < 0) {
+		be_sql_rollback(conn);
+		return -1;
+	} else if (be_sql_commit(conn) < 0) {
+		return -1;
+	} else if (nrp > 0 && jnl_reset(j) < 0) {
+		/* no harm done, replays skip what's been written */
+		UMPF_ERR_LOG("cannot reset journal %u\n", id);
+	}
+	return nrp;
+}
+
+static jnl_t
+umpf_wb_open(dbconn_t conn, unsigned int id)
+{
+/* open write-behind journal number ID and replay whatever CONN hasn't
+ * seen of it, return NULL if that doesn't work out */
+	char fn[strlen(umpf_wb_file) + 24U];
+	ssize_t nrp;
+	jnl_t j;
+
+	snprintf(fn, sizeof(fn), "%s.%u.umpfj", umpf_wb_file, id);
+	if ((j = make_jnl(fn)) == NULL) {
+		UMPF_CRIT_LOG("cannot open journal %s\n", fn);
+		return NULL;
+	} else if ((nrp = umpf_wb_catch_up(conn, j, id)) < 0) {
+		UMPF_CRIT_LOG("cannot replay journal %s\n", fn);
+		free_jnl(j);
+		return NULL;
+	}
+	UMPF_INFO_LOG("replayed %zd writes from %s\n", nrp, fn);
+	return j;
+}
+
+static void
+umpf_wb_leftovers(dbconn_t conn, unsigned int from)
+{
+/* replay and remove the journals of workers beyond FROM, there were
+ * more of them last time */
+	for (unsigned int i = from;; i++) {
+		char fn[strlen(umpf_wb_file) + 24U];
+		jnl_t j;
+
+		snprintf(fn, sizeof(fn), "%s.%u.umpfj", umpf_wb_file, i);
+		if (access(fn, F_OK) < 0) {
+			break;
+		} else if ((j = umpf_wb_open(conn, i)) == NULL) {
+			break;
+		}
+		free_jnl(j);
+		(void)unlink(fn);
+	}
+	return;
+}
+
+
+/* workers */
+static size_t
+wrk_least_busy(size_t from, size_t n)
+{
+/* return the least busy of the N workers starting at FROM, so a
+ * request doesn't queue up behind a slow query */
+	static size_t rr;
+	size_t best = from + rr++ % n;
+
+	for (size_t i = 1; i < n && wrk[best].nbusy; i++) {
+		size_t k = from + (best - from + i) % n;
+
+		if (wrk[k].nbusy < wrk[best].nbusy) {
+			best = k;
+		}
+	}
+	return best;
+}
+
+static bool
+umpf_readp(umpf_msg_t msg)
+{
+/* whether MSG can go to a read-only worker */
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_GET_PF:
+	case UMPF_MSG_GET_SEC:
+	case UMPF_MSG_GET_DESCR:
+	case UMPF_MSG_LST_PF:
+	case UMPF_MSG_LST_TAG:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static size_t
+umpf_shard(umpf_msg_t msg)
+{
+/* map MSG to a worker, all requests concerning the same portfolio go
+ * to the same worker so they're executed in order */
+	const char *key;
+	uint32_t h = 2166136261U;
+
+	switch (umpf_get_msg_type(msg)) {
+	case UMPF_MSG_NEW_PF:
+	case UMPF_MSG_GET_DESCR:
+	case UMPF_MSG_SET_DESCR:
+		key = msg->new_pf.name;
+		break;
+	case UMPF_MSG_GET_PF:
+	case UMPF_MSG_SET_PF:
+	case UMPF_MSG_PATCH:
+		key = msg->pf.name;
+		break;
+	case UMPF_MSG_NEW_SEC:
+	case UMPF_MSG_GET_SEC:
+	case UMPF_MSG_SET_SEC:
+		key = msg->new_sec.pf_mnemo;
+		break;
+	case UMPF_MSG_LST_TAG:
+		key = msg->lst_tag.name;
+		break;
+	default:
+		key = NULL;
+		break;
+	}
+	if (key == NULL) {
+		/* not bound to a portfolio, any worker will do */
+		return wrk_least_busy(0U, nwrk);
+	}
+	/* fnv-1a */
+	for (const unsigned char *p = (const void*)key; *p; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	return h % nwrk;
+}
+
+static void
+wrk_reply(umpf_wrk_t k, umpf_job_t job)
+{
+/* hand JOB back to the I/O loop */
+	while (UNLIKELY(spsc_push(k->rpl, job) < 0)) {
+		/* the I/O loop is behind, give it a chance */
+		ev_async_send(umpf_ioloop, cmpl_watcher);
+		sched_yield();
+	}
+	ev_async_send(umpf_ioloop, cmpl_watcher);
+	return;
+}
+
+static void
+wrk_commit(EV_P_ umpf_wrk_t k)
+{
+/* commit K's group of writes and let their replies go, with
+ * write-behind it's only the journal that's committed */
+	bool lost = false;
+
+	ev_timer_stop(EV_A_ k->grp_timer);
+	if (k->ngrp == 0U) {
+		return;
+	} else if (k->wb) {
+		/* the database is seen to by wrk_flush() */
+		lost = umpf_jnl_lost(k->jnl);
+	} else if (LIKELY(be_sql_commit(k->dbconn) == 0)) {
+		/* the journal has to be on disk before anyone's told */
+		lost = umpf_jnl_lost(k->jnl);
 	} else {
-		/* uh oh, mega request, wtf? */
-		;
+		UMPF_ERR_LOG("commit of %zu writes failed\n", k->ngrp);
+		lost = true;
+		/* the portfolio cache has seen what the database hasn't */
+		if (k->pfc != NULL) {
+			free_pfc(k->pfc);
+			k->pfc = make_pfc(umpf_pf_cache / nwrk);
+		}
+	}
+	for (umpf_job_t j = k->grp, nx; j != NULL; j = nx) {
+		nx = j->next;
+		j->next = NULL;
+		j->lost = j->lost || lost;
+		wrk_reply(k, j);
+	}
+	k->grp = NULL;
+	k->grp_tail = &k->grp;
+	k->ngrp = 0U;
+	if (k->bulk) {
+		umpf_tune_bulk_p(k->dbconn, false);
+		k->bulk = false;
 	}
+	return;
+}
 
-	/* see what the handler makes of it */
-	if (handle_data(qio, buf, nrd) == 0) {
-		/* connection shall not be closed */
+static void
+wrk_grp_cb(EV_P_ ev_timer *w, int UNUSED(re))
+{
+/* runs in the worker thread, the group's waited long enough */
+	wrk_commit(EV_A_ w->data);
+	return;
+}
+
+static void
+wrk_apply1(umpf_wrk_t k, umpf_msg_t msg)
+{
+/* apply the write MSG to K's open transaction */
+	const char *pf;
+	char *buf = NULL;
+
+	if (k->rc != NULL && (pf = rc_dirt(msg)) != NULL) {
+		/* replies about PF are history */
+		rcache_bump(k->rc, pf);
+	}
+	(void)interpret_msg(k->dbconn, k->pfc, &buf, 0U, msg);
+	if (buf != NULL) {
+		free(buf);
+	}
+	k->nflush++;
+	return;
+}
+
+static void
+wrk_apply(EV_P_ umpf_wrk_t k, size_t max)
+{
+/* write-behind, apply up to MAX of K's queued writes to its open
+ * transaction, opening one if need be */
+	size_t i;
+
+	if (k->nwbq > 0U && !k->stuck &&
+	    k->nflush == 0U && be_sql_begin(k->dbconn) < 0) {
+		UMPF_CRIT_LOG(
+			"worker %zu cannot write behind, no more\n",
+			(size_t)(k - wrk));
+		k->stuck = true;
+	}
+	for (i = 0; i < k->nwbq && i < max; i++) {
+		if (UNLIKELY(k->stuck)) {
+			/* the journal keeps it for the next start */
+			umpf_free_msg(k->wbq[i]);
+			continue;
+		}
+		wrk_apply1(k, k->wbq[i]);
+	}
+	k->nwbq -= i;
+	memmove(k->wbq, k->wbq + i, k->nwbq * sizeof(*k->wbq));
+	if (k->nwbq == 0U) {
+		ev_idle_stop(EV_A_ k->wb_idle);
+	}
+	return;
+}
+
+static void
+wrk_flush(EV_P_ umpf_wrk_t k)
+{
+/* write-behind, commit K's open transaction along with the journal's
+ * sequence number, the journal can start over then */
+	unsigned int id = (unsigned int)(k - wrk);
+	uint32_t seq;
+
+	ev_timer_stop(EV_A_ k->flush_timer);
+	/* replies needn't wait for this */
+	wrk_commit(EV_A_ k);
+	/* the mark covers all of the journal */
+	wrk_apply(EV_A_ k, k->nwbq);
+	if (k->nflush == 0U) {
+		return;
+	}
+	seq = jnl_seq(k->jnl);
+	if (UNLIKELY(be_sql_set_mark(k->dbconn, id, seq) < 0)) {
+		be_sql_rollback(k->dbconn);
+	} else if (LIKELY(be_sql_commit(k->dbconn) == 0)) {
+		if (jnl_reset(k->jnl) < 0) {
+			/* no harm done, replays skip what's been written */
+			UMPF_ERR_LOG("cannot reset journal %u\n", id);
+		}
+		UMPF_DEBUG("wrote %zu writes behind, %u\n", k->nflush, seq);
+		k->nflush = 0U;
+		return;
+	}
+	UMPF_ERR_LOG("write-behind of %zu writes failed\n", k->nflush);
+	k->nflush = 0U;
+	/* the portfolio cache has seen what the database hasn't */
+	if (k->pfc != NULL) {
+		free_pfc(k->pfc);
+		k->pfc = make_pfc(umpf_pf_cache / nwrk);
+	}
+	/* the writes have been replied to, the journal has them all */
+	if (umpf_wb_catch_up(k->dbconn, k->jnl, id) < 0) {
+		UMPF_CRIT_LOG("worker %u cannot write behind, no more\n", id);
+		k->stuck = true;
+	}
+	return;
+}
+
+static void
+wrk_flush_cb(EV_P_ ev_timer *w, int UNUSED(re))
+{
+/* runs in the worker thread, time to write behind */
+	wrk_flush(EV_A_ w->data);
+	return;
+}
+
+static void
+wrk_apply_cb(EV_P_ ev_idle *w, int UNUSED(re))
+{
+/* runs in the worker thread, nothing else to do but write behind */
+	umpf_wrk_t k = w->data;
+
+	wrk_apply(EV_A_ k, UMPF_WB_BATCH);
+	if (k->nflush >= UMPF_FLUSH_MAX) {
+		wrk_flush(EV_A_ k);
+	} else if (k->nflush > 0U && !ev_is_active(k->flush_timer)) {
+		ev_timer_set(k->flush_timer, umpf_wb_ival, 0.0);
+		ev_timer_start(EV_A_ k->flush_timer);
+	}
+	return;
+}
+
+static void
+wrk_wb(EV_P_ umpf_wrk_t k, umpf_job_t job)
+{
+/* write-behind, JOB's write is replied to once it's in the journal,
+ * it's applied to K's open transaction when the worker's idle and
+ * that's committed every so often
+ * The reply is made from the request alone, it carries no tag ids
+ * or hashes as those are the database's to hand out and aren't
+ * certain before the commit, a get_pf will tell. */
+	umpf_msg_t msg = job->msg;
+
+	if (UNLIKELY(k->stuck) || UNLIKELY(jnl_add(k->jnl, msg) < 0)) {
+		/* nowhere to write to, nothing to reply */
+		if (!k->stuck) {
+			UMPF_ERR_LOG("cannot journal write\n");
+		}
+		umpf_free_msg(msg);
+		job->msg = NULL;
+		job->lost = true;
+		wrk_reply(k, job);
 		return;
 	}
-	/* check if we want stuff written */
-	if (qio->rsp != NULL &&
-	    (nwr = write(w->fd, qio->rsp, qio->rsz)) < (ssize_t)qio->rsz) {
-		ev_qio_t qwr = make_qio();
+	if (umpf_get_msg_type(msg) == UMPF_MSG_SET_PF) {
+		msg->pf.tag_id = 0UL;
+		msg->pf.hash = 0U;
+	}
+	msg->hdr.mt++;
+	job->rsz = umpf_seria_msg(&job->rsp, job->rbsz, msg);
+	msg->hdr.mt--;
+	if (job->rsz >= job->rbsz) {
+		/* buffer's been resized, it's at least this big */
+		job->rbsz = job->rsz + 1U;
+	}
+	job->msg = NULL;
+
+	if (k->nwbq >= k->wbqall) {
+		size_t nu_all = k->wbqall ? k->wbqall * 2U : UMPF_WB_BATCH;
+		umpf_msg_t *nu = realloc(k->wbq, nu_all * sizeof(*nu));
+
+		if (UNLIKELY(nu == NULL)) {
+			/* can't put it off, apply what's queued */
+			wrk_apply(EV_A_ k, k->nwbq);
+		} else {
+			k->wbq = nu;
+			k->wbqall = nu_all;
+		}
+	}
+	if (LIKELY(k->nwbq < k->wbqall)) {
+		k->wbq[k->nwbq++] = msg;
+		ev_idle_start(EV_A_ k->wb_idle);
+	} else if (UNLIKELY(k->stuck)) {
+		/* the journal keeps it for the next start */
+		umpf_free_msg(msg);
+	} else if (k->nflush > 0U || be_sql_begin(k->dbconn) == 0) {
+		/* no queue at all, right away then */
+		wrk_apply1(k, msg);
+		/* so the flush gets scheduled */
+		ev_idle_start(EV_A_ k->wb_idle);
+	} else {
+		UMPF_CRIT_LOG(
+			"worker %zu cannot write behind, no more\n",
+			(size_t)(k - wrk));
+		k->stuck = true;
+		umpf_free_msg(msg);
+	}
+	*k->grp_tail = job;
+	k->grp_tail = &job->next;
+	if (++k->ngrp >= umpf_group_max) {
+		wrk_commit(EV_A_ k);
+	}
+	return;
+}
 
-		UMPF_DEBUG("instantiating write buffer\n");
-		ev_io_init(qwr->w, dccp_dtwr_cb, w->fd, EV_WRITE);
-		qwr->w->data = qwr;
-		ev_io_start(EV_A_ qwr->w);
+static void
+snap_cb(EV_P_ ev_timer *w, int UNUSED(re))
+{
+/* runs in whatever thread owns the in-memory database */
+	umpf_wrk_t k = w->data;
 
-		/* we've done nwr bytes already */
-		qwr->nwr = nwr > 0 ? (size_t)nwr : 0U;
-		/* move rsp/rsz pair to qwr */
-		qwr->rsp = qio->rsp;
-		qwr->rsz = qio->rsz;
-		qio->rsp = NULL;
-		qio->rsz = 0UL;
-	} else if (qio->rsp != NULL) {
-		UMPF_DEBUG("no write buffer needed\n");
+	if (k != NULL) {
+		/* half a group isn't worth a snapshot */
+		wrk_commit(EV_A_ k);
+		umpf_snapshot(k->dbconn, k->pfc);
+	} else {
+		umpf_snapshot(umpf_dbconn, umpf_pfc);
+	}
+	return;
+}
+
+static void
+wrk_wake_cb(EV_P_ ev_async *w, int UNUSED(re))
+{
+/* runs in the worker thread */
+	umpf_wrk_t k = w->data;
+	umpf_job_t job;
+
+	while ((job = spsc_pop(k->req)) != NULL) {
+		if (k->wb && rc_dirt(job->msg) != NULL) {
+			/* no bulk profile, the transaction's always open */
+			wrk_wb(EV_A_ k, job);
+			continue;
+		} else if (k->wb) {
+			/* reads see the writes replied to so far */
+			wrk_apply(EV_A_ k, k->nwbq);
+		}
+		if (!k->bulk && umpf_bulkp(job->msg)) {
+			/* the bulk profile applies to the whole group */
+			wrk_commit(EV_A_ k);
+			umpf_tune_bulk_p(k->dbconn, true);
+			k->bulk = true;
+		}
+		if (umpf_group_max <= 1U || rc_dirt(job->msg) == NULL) {
+			/* reads mustn't see writes that might not stick */
+			wrk_commit(EV_A_ k);
+		} else if (k->ngrp > 0U || be_sql_begin(k->dbconn) == 0) {
+			/* join the group, each write is a savepoint of
+			 * its own so it succeeds or fails on its own */
+			run_job(k->dbconn, k->pfc, k->rc, k->jnl, job);
+			*k->grp_tail = job;
+			k->grp_tail = &job->next;
+			if (++k->ngrp >= umpf_group_max) {
+				wrk_commit(EV_A_ k);
+			}
+			continue;
+		}
+		run_job(k->dbconn, k->pfc, k->rc, k->jnl, job);
+		if (umpf_jnl_lost(k->jnl)) {
+			job->lost = true;
+		}
+		wrk_reply(k, job);
+		if (k->bulk && k->ngrp == 0U) {
+			umpf_tune_bulk_p(k->dbconn, false);
+			k->bulk = false;
+		}
+	}
+	if (__atomic_load_n(&k->quit, __ATOMIC_ACQUIRE)) {
+		wrk_commit(EV_A_ k);
+		wrk_flush(EV_A_ k);
+		if (k->dbconn == umpf_memconn) {
+			umpf_snapshot(k->dbconn, k->pfc);
+		}
+		ev_unloop(EV_A_ EVUNLOOP_ALL);
+	} else if (k->ngrp > 0U && umpf_group_window <= 0.0) {
+		/* commit whatever piled up while we were busy */
+		wrk_commit(EV_A_ k);
+	} else if (k->ngrp > 0U && !ev_is_active(k->grp_timer)) {
+		ev_timer_set(k->grp_timer, umpf_group_window, 0.0);
+		ev_timer_start(EV_A_ k->grp_timer);
+	}
+	return;
+}
+
+static void*
+wrk_main(void *clo)
+{
+	umpf_wrk_t k = clo;
+
+	be_sql_thread_init();
+	ev_loop(k->loop, 0);
+	be_sql_thread_fini();
+	return NULL;
+}
+
+static void
+wrk_flush_bklg(umpf_wrk_t k)
+{
+/* move as much of K's backlog into its request ring as fits */
+	umpf_job_t j;
+	bool pushedp = false;
+
+	while ((j = k->bklg) != NULL && spsc_push(k->req, j) == 0) {
+		if ((k->bklg = j->next) == NULL) {
+			k->bklg_tail = &k->bklg;
+		}
+		j->next = NULL;
+		pushedp = true;
+	}
+	if (pushedp) {
+		ev_async_send(k->loop, k->wake);
+	}
+	return;
+}
+
+static void
+wrk_submit(umpf_wrk_t k, umpf_job_t j)
+{
+	k->nbusy++;
+	if (LIKELY(k->bklg == NULL) && LIKELY(spsc_push(k->req, j) == 0)) {
+		ev_async_send(k->loop, k->wake);
+		return;
+	}
+	/* ring's full, keep the order by going through the backlog */
+	UMPF_DEBUG("worker %zu backlogged\n", (size_t)(k - wrk));
+	*k->bklg_tail = j;
+	k->bklg_tail = &j->next;
+	return;
+}
+
+static void
+wrk_unwind(umpf_wrk_t k)
+{
+/* undo what init_wrk() did to K before its thread got going */
+	if (k->req != NULL) {
+		free_spsc(k->req);
+	}
+	if (k->rpl != NULL) {
+		free_spsc(k->rpl);
+	}
+	if (k->dbconn != NULL && k->dbconn != umpf_memconn) {
+		be_sql_close(k->dbconn);
+	}
+	if (k->pfc != NULL) {
+		free_pfc(k->pfc);
+	}
+	if (k->rc != NULL) {
+		free_rcache(k->rc);
+	}
+	if (k->jnl != NULL && k->jnl != umpf_jnl) {
+		free_jnl(k->jnl);
+	}
+	return;
+}
+
+static int
+init_wrk(
+	size_t n, size_t nr,
+	const char *h, const char *u, const char *pw, const char *sch)
+{
+/* start N workers, connecting to the database H/U/PW/SCH, and NR
+ * workers with read-only connexions to the sqlite database SCH */
+	if ((wrk = calloc(n + nr, sizeof(*wrk))) == NULL) {
+		UMPF_CRIT_LOG("cannot allocate %zu workers\n", n + nr);
+		return -1;
+	}
+	for (size_t i = 0; i < n + nr; i++) {
+		umpf_wrk_t k = wrk + i;
+
+		/* each worker gets its own connexion */
+		if (i == 0U && umpf_memconn != NULL) {
+			/* but there's only one in-memory database */
+			k->dbconn = umpf_memconn;
+			k->jnl = umpf_jnl;
+		} else if (i >= n) {
+			/* readers go without caches, the writers would
+			 * have to keep them current */
+			k->dbconn = be_sql_open_ro(sch);
+			umpf_tune(k->dbconn, true);
+		} else if (umpf_mmap_dir != NULL) {
+			/* there's only one of those too */
+			k->dbconn = be_sql_open_mmap(umpf_mmap_dir);
+		} else if (h || u || pw || sch) {
+			k->dbconn = be_sql_open(h, u, pw, sch);
+			umpf_tune(k->dbconn, false);
+			if (nr && k->dbconn && be_sql_wal(k->dbconn) < 0) {
+				UMPF_ERR_LOG("cannot switch to wal mode\n");
+			}
+		}
+		if (i < n && umpf_wb_file != NULL && k->dbconn != NULL) {
+			/* catch up on what didn't make it last time */
+			k->wb = true;
+			k->stuck = (k->jnl = umpf_wb_open(k->dbconn, i)) == NULL;
+			if (i == 0U) {
+				umpf_wb_leftovers(k->dbconn, n);
+			}
+		}
+		/* cache budgets are split evenly */
+		if (i < n && umpf_pf_cache) {
+			k->pfc = make_pfc(umpf_pf_cache / n);
+		}
+		if (i < n && umpf_reply_cache) {
+			k->rc = make_rcache(umpf_reply_cache / n);
+		}
+		if ((k->req = make_spsc(UMPF_WRK_RING)) == NULL ||
+		    (k->rpl = make_spsc(UMPF_WRK_RING)) == NULL) {
+			UMPF_CRIT_LOG("cannot set up worker %zu\n", i);
+			wrk_unwind(k);
+			break;
+		}
+		k->bklg_tail = &k->bklg;
+		k->grp_tail = &k->grp;
+		k->loop = ev_loop_new(EVFLAG_AUTO);
+		ev_async_init(k->wake, wrk_wake_cb);
+		k->wake->data = k;
+		ev_async_start(k->loop, k->wake);
+		ev_timer_init(k->grp_timer, wrk_grp_cb, 0.0, 0.0);
+		k->grp_timer->data = k;
+		ev_timer_init(k->flush_timer, wrk_flush_cb, 0.0, 0.0);
+		k->flush_timer->data = k;
+		ev_idle_init(k->wb_idle, wrk_apply_cb);
+		k->wb_idle->data = k;
+		if (k->dbconn != NULL && k->dbconn == umpf_memconn) {
+			ev_timer_init(
+				k->snap_timer, snap_cb,
+				umpf_snap_ival, umpf_snap_ival);
+			k->snap_timer->data = k;
+			ev_timer_start(k->loop, k->snap_timer);
+		}
+
+		if (pthread_create(&k->thr, NULL, wrk_main, k)) {
+			UMPF_CRIT_LOG("cannot start worker %zu\n", i);
+			ev_async_stop(k->loop, k->wake);
+			ev_loop_destroy(k->loop);
+			wrk_unwind(k);
+			break;
+		} else if (i < n) {
+			nwrk++;
+		} else {
+			nrdr++;
+		}
+	}
+	UMPF_INFO_LOG("%zu workers, %zu readers running\n", nwrk, nrdr);
+	if (nwrk == 0U) {
+		/* the caller serves requests in the I/O thread then */
+		free(wrk);
+		wrk = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+fini_wrk(void)
+{
+	/* let the workers finish what they've got and stop */
+	for (size_t i = 0; i < nwrk + nrdr; i++) {
+		umpf_wrk_t k = wrk + i;
+
+		__atomic_store_n(&k->quit, 1, __ATOMIC_RELEASE);
+		ev_async_send(k->loop, k->wake);
+	}
+	for (size_t i = 0; i < nwrk + nrdr; i++) {
+		umpf_wrk_t k = wrk + i;
+		umpf_job_t j;
+
+		pthread_join(k->thr, NULL);
+		ev_async_stop(k->loop, k->wake);
+		ev_loop_destroy(k->loop);
+
+		/* whatever's left in the pipes is for nobody */
+		while ((j = spsc_pop(k->rpl)) != NULL) {
+			free_job(j);
+		}
+		for (umpf_job_t nx; (j = k->bklg) != NULL; k->bklg = nx) {
+			nx = j->next;
+			free_job(j);
+		}
+		free_spsc(k->req);
+		free_spsc(k->rpl);
+		if (k->dbconn != NULL && k->dbconn == umpf_memconn) {
+			/* snapshot's been taken by the worker */
+			be_sql_close(k->dbconn);
+			umpf_memconn = NULL;
+		} else if (k->dbconn != NULL) {
+			be_sql_close(k->dbconn);
+		}
+		if (k->pfc != NULL) {
+			free_pfc(k->pfc);
+		}
+		if (k->rc != NULL) {
+			free_rcache(k->rc);
+		}
+		if (k->jnl != NULL && k->jnl != umpf_jnl) {
+			free_jnl(k->jnl);
+		}
+		if (k->wbq != NULL) {
+			/* flushed on the way out, all that's left is this */
+			free(k->wbq);
+		}
+	}
+	free(wrk);
+	wrk = NULL;
+	nwrk = 0U;
+	nrdr = 0U;
+	return;
+}
+
+
+/* callbacks */
+static ssize_t
+dccp_flush(EV_P_ ev_qio_t qio)
+{
+/* writev() as much of QIO's output queue as the socket takes, return
+ * the number of replies still queued or -1 on error, EV_WRITE is only
+ * watched for while there's something queued */
+	ev_io *w = qio->w;
+	ssize_t res = 0;
+	int ev;
+
+	while (qio->oq != NULL) {
+		struct iovec iov[2U * UMPF_OQ_IOV];
+		size_t niov = 0U;
+		size_t skip = qio->nwr;
+		umpf_job_t j;
+		ssize_t nwr;
+
+		/* a job takes up to 2 iovecs, its header and its reply */
+		for (j = qio->oq;
+		     j != NULL && niov + 2U <= countof(iov); j = j->next) {
+			/* the head might be written partially */
+			if (skip < j->hsz) {
+				iov[niov].iov_base = j->hdr + skip;
+				iov[niov].iov_len = j->hsz - skip;
+				niov++;
+				skip = 0U;
+			} else {
+				skip -= j->hsz;
+			}
+			if (skip < j->rsz) {
+				char *rsp = j->shr ? j->shr->data : j->rsp;
+
+				iov[niov].iov_base = rsp + skip;
+				iov[niov].iov_len = j->rsz - skip;
+				niov++;
+			}
+			skip = 0U;
+		}
+
+		if (niov == 0U) {
+			/* empty replies, nothing to write */
+			nwr = 0;
+		} else if ((nwr = writev(w->fd, iov, niov)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			return -1;
+		}
+
+		/* dequeue what's been written */
+		qio->nwr += nwr;
+		while ((j = qio->oq) != NULL && qio->nwr >= j->hsz + j->rsz) {
+			qio->nwr -= j->hsz + j->rsz;
+			if ((qio->oq = j->next) == NULL) {
+				qio->oq_tail = &qio->oq;
+			}
+			free_job(j);
+		}
+	}
+
+	/* blob connexions don't read anymore once they're replying */
+	ev = qio->mode == QIO_MODE_FRAME ? EV_READ : 0;
+	if (qio->oq != NULL) {
+		ev |= EV_WRITE;
+		for (umpf_job_t j = qio->oq; j != NULL; j = j->next) {
+			res++;
+		}
+	}
+	if (ev == 0) {
+		ev_io_stop(EV_A_ w);
+	} else if ((w->events & (EV_READ | EV_WRITE)) != ev ||
+		   !ev_is_active(w)) {
+		ev_io_stop(EV_A_ w);
+		ev_io_set(w, w->fd, ev);
+		ev_io_start(EV_A_ w);
+	}
+	return res;
+}
+
+static void
+qio_enq(ev_qio_t qio, umpf_job_t j)
+{
+	j->next = NULL;
+	*qio->oq_tail = j;
+	qio->oq_tail = &j->next;
+	return;
+}
+
+static void
+dccp_close(EV_P_ ev_qio_t qio)
+{
+	/* notify the blob parser about the conn close */
+	handle_close(qio);
+	if (qio->npend > 0) {
+		/* workers still have requests of ours, the last one
+		 * to come back will free the qio */
+		ev_io_shut(EV_A_ qio->w);
+		return;
+	}
+	ev_qio_shut(EV_A_ qio->w);
+	return;
+}
+
+static ev_qio_t
+qio_complete(EV_P_ umpf_job_t job)
+{
+/* hand the reply in JOB back to its connexion, return the connexion
+ * if it's still open and has output pending, NULL otherwise */
+	ev_qio_t qio = job->qio;
+
+	qio->npend--;
+	if (job->wr) {
+		qio->nwpend--;
+	}
+	if (UNLIKELY(qio->w->fd < 0)) {
+		/* connexion's gone in the meantime */
+		free_job(job);
+		if (qio->npend == 0) {
+			free_io(qio);
+		}
+		return NULL;
+	} else if (UNLIKELY(job->lost)) {
+		/* the reply would be a lie, hang up instead */
+		free_job(job);
+		dccp_close(EV_A_ qio);
+		return NULL;
+	} else if (qio->mode != QIO_MODE_FRAME) {
+		/* just the one request, reply and be done */
+		qio_enq(qio, job);
+		if (dccp_flush(EV_A_ qio) <= 0) {
+			/* all written, or never will be */
+			dccp_close(EV_A_ qio);
+		}
+		return NULL;
+	}
+
+	/* replies go out in the order requests came in */
+	job->next = qio->parked;
+	qio->parked = job;
+	for (umpf_job_t *jp = &qio->parked; *jp != NULL;) {
+		umpf_job_t j = *jp;
+
+		if (j->seq != qio->wseq) {
+			jp = &j->next;
+			continue;
+		}
+		/* unpark and start over */
+		*jp = j->next;
+		qio->wseq++;
+		if (j->rsz) {
+			j->hsz = umpf_seria_frame_hdr(
+				j->hdr, j->rsz, UMPF_CODEC_FIXML);
+			qio_enq(qio, j);
+		} else {
+			free_job(j);
+		}
+		jp = &qio->parked;
+	}
+	return qio;
+}
+
+static void
+cmpl_cb(EV_P_ ev_async *UNUSED(w), int UNUSED(re))
+{
+/* workers have finished jobs */
+	for (size_t i = 0; i < nwrk + nrdr; i++) {
+		umpf_wrk_t k = wrk + i;
+		umpf_job_t job;
+
+		while ((job = spsc_pop(k->rpl)) != NULL) {
+			ev_qio_t qio;
+
+			k->nbusy--;
+			if ((qio = qio_complete(EV_A_ job)) != NULL &&
+			    dccp_flush(EV_A_ qio) < 0) {
+				dccp_close(EV_A_ qio);
+			}
+		}
+		/* that made room in the request ring */
+		if (k->bklg != NULL) {
+			wrk_flush_bklg(k);
+		}
+	}
+	return;
+}
+
+static int
+umpf_submit(EV_P_ ev_qio_t qio, umpf_msg_t msg)
+{
+/* have MSG executed on behalf of QIO, either by the workers
+ * or, if there are none, right here, return -1 if QIO is to be
+ * closed by the caller, which is still looking at it */
+	umpf_job_t job = make_job();
+
+	job->qio = qio;
+	job->seq = qio->rseq++;
+	job->msg = msg;
+	qio->npend++;
+
+	if (nwrk == 0) {
+		bool bulkp = umpf_bulkp(msg);
+
+		if (bulkp) {
+			umpf_tune_bulk_p(umpf_dbconn, true);
+		}
+		run_job(umpf_dbconn, umpf_pfc, umpf_rc, umpf_jnl, job);
+		if (bulkp) {
+			umpf_tune_bulk_p(umpf_dbconn, false);
+		}
+		if (umpf_jnl_lost(umpf_jnl)) {
+			job->lost = true;
+		}
+		if (UNLIKELY(job->lost)) {
+			/* the reply would be a lie, hang up, but leave
+			 * that to the caller */
+			qio->npend--;
+			free_job(job);
+			return -1;
+		}
+		(void)qio_complete(EV_A_ job);
+		return 0;
+	} else if (nrdr && qio->nwpend == 0 && umpf_readp(msg)) {
+		/* nothing of ours is still with the writers, so the
+		 * readers see everything this connexion has written */
+		wrk_submit(wrk + wrk_least_busy(nwrk, nrdr), job);
+		return 0;
+	}
+	job->wr = true;
+	qio->nwpend++;
+	wrk_submit(wrk + umpf_shard(msg), job);
+	return 0;
+}
+
+/**
+ * Take the stuff in MSG of size MSGLEN coming from FD and process it.
+ * Return values <0 cause the handler caller to close down the socket,
+ * values >0 mean a request has been submitted and the connexion must
+ * not be touched anymore. */
+static int
+handle_data(EV_P_ ev_qio_t qio, char *msg, size_t msglen)
+{
+	umpf_ctx_t p = qio->ctx;
+	umpf_msg_t umsg;
+
+	UMPF_DEBUG("/ctx: %p %zu\n", p, msglen);
+#if defined DEBUG_FLAG
+	/* safely write msg to logerr now */
+	fwrite(msg, msglen, 1, umpf_logout);
+#endif	/* DEBUG_FLAG */
+
+	if ((umsg = umpf_parse_blob_r(&p, msg, msglen)) != NULL) {
+		/* definite success */
+		qio->ctx = NULL;
+		/* no more reading, the reply comes and then we close */
+		ev_io_stop(EV_A_ qio->w);
+		return umpf_submit(EV_A_ qio, umsg) < 0 ? -1 : 1;
+
+	} else if (/* umsg == NULL && */p == NULL) {
+		/* error occurred */
+		UMPF_DEBUG("ERROR\n");
+		qio->ctx = NULL;
+		/* request connection close */
+		return -1;
+	}
+	UMPF_DEBUG("need more grub\n");
+	qio->ctx = p;
+	return 0;
+}
+
+/**
+ * Like `handle_data()' but for framed connexions.
+ * Complete frames in QIO's input buffer are parsed in place and
+ * submitted right away, a partial frame is moved to the front of the
+ * buffer, and the buffer is grown to hold it in its entirety.
+ * Return values <0 cause the handler caller to close down the socket. */
+static int
+handle_frame(EV_P_ ev_qio_t qio)
+{
+	struct umpf_frame_s fr = {.len = 0U};
+	size_t off = 0U;
+	int hsz = 0;
+
+	while (off < qio->ilen) {
+		const char *p = qio->ibuf + off;
+		size_t n = qio->ilen - off;
+		umpf_msg_t umsg;
+
+		if ((hsz = umpf_parse_frame_hdr(&fr, p, n)) < 0) {
+			UMPF_ERR_LOG("invalid frame header\n");
+			return -1;
+		} else if (hsz == 0) {
+			/* header's incomplete */
+			break;
+		} else if (fr.len > umpf_max_request) {
+			UMPF_ERR_LOG("\
+frame of %zu bytes exceeds limit, rejecting\n", fr.len);
+			return -1;
+		} else if (n < hsz + fr.len) {
+			/* payload's incomplete */
+			break;
+		}
+
+		/* frame is complete, only now bother the parser */
+		if ((umsg = umpf_parse_frame(&fr, p + hsz)) == NULL) {
+			UMPF_ERR_LOG("cannot parse frame payload\n");
+			return -1;
+		}
+		if (umpf_submit(EV_A_ qio, umsg) < 0) {
+			/* a write's been lost, qio's still ours to close */
+			return -1;
+		}
+		off += hsz + fr.len;
+		hsz = 0;
+	}
+
+	/* keep the partial frame */
+	if (off > 0U) {
+		memmove(qio->ibuf, qio->ibuf + off, qio->ilen - off);
+		qio->ilen -= off;
+	}
+	if (hsz > 0 && hsz + fr.len > qio->ibsz) {
+		/* we know exactly how much we need */
+		size_t nu = hsz + fr.len;
+		char *tmp;
+
+		if (UNLIKELY((tmp = realloc(qio->ibuf, nu)) == NULL)) {
+			/* the old buffer's freed along with QIO */
+			UMPF_ERR_LOG("cannot grow buffer to %zu bytes\n", nu);
+			return -1;
+		}
+		qio->ibuf = tmp;
+		qio->ibsz = nu;
+	} else if (qio->ilen == 0U && qio->ibsz > 16U * UMPF_INI_RBUF) {
+		/* don't sit on huge buffers after huge frames */
+		free(qio->ibuf);
+		qio->ibuf = NULL;
+		qio->ibsz = 0U;
+	}
+	return 0;
+}
+
+static ssize_t
+dccp_fill(ev_qio_t qio, int fd)
+{
+/* read what's on the wire into QIO's input buffer, a read that fills
+ * the buffer up doubles its size (capped by the request limit) and
+ * we go again, return the number of bytes read or -1 on error */
+	const size_t cap = umpf_max_request + UMPF_FRAME_HDR_SIZE;
+	ssize_t tot = 0;
+
+	for (;;) {
+		ssize_t nrd;
+
+		if (qio->ilen >= qio->ibsz) {
+			size_t nsz = qio->ibsz ? 2U * qio->ibsz : UMPF_INI_RBUF;
+			char *tmp;
+
+			if (UNLIKELY(qio->ibsz >= cap)) {
+				/* let the handlers decide */
+				break;
+			} else if (nsz > cap) {
+				nsz = cap;
+			}
+			if (UNLIKELY((tmp = realloc(qio->ibuf, nsz)) == NULL)) {
+				/* caller closes, the old buffer goes with it */
+				errno = ENOMEM;
+				return -1;
+			}
+			qio->ibuf = tmp;
+			qio->ibsz = nsz;
+		}
+
+		nrd = read(fd, qio->ibuf + qio->ilen, qio->ibsz - qio->ilen);
+		if (nrd > 0) {
+			qio->ilen += nrd;
+			tot += nrd;
+			if (qio->ilen < qio->ibsz) {
+				/* short read, socket's drained */
+				break;
+			}
+		} else if (nrd == 0 || tot > 0) {
+			/* eof, or nothing more for now */
+			break;
+		} else {
+			return -1;
+		}
+	}
+	return tot;
+}
+
+static void
+dccp_data_cb(EV_P_ ev_io *w, int re)
+{
+	ev_qio_t qio = w->data;
+	ssize_t nrd;
+	size_t len;
+
+	if (re & EV_WRITE) {
+		ssize_t rc = dccp_flush(EV_A_ qio);
+
+		if (rc < 0 || (rc == 0 && qio->mode != QIO_MODE_FRAME)) {
+			/* trouble, or a blob reply that's out completely */
+			goto clo;
+		} else if (!(re & EV_READ)) {
+			return;
+		}
+	}
+
+	if (UNLIKELY((nrd = dccp_fill(qio, w->fd)) <= 0)) {
+		if (nrd < 0 && errno == EAGAIN) {
+			return;
+		}
+		goto clo;
+	} else if (UNLIKELY(qio->mode == QIO_MODE_UNK)) {
+		/* first bytes on this connexion, decide on the mode */
+		if ((unsigned char)*qio->ibuf == UMPF_FRAME_MAGIC) {
+			UMPF_DEBUG("framed connexion on %d\n", w->fd);
+			qio->mode = QIO_MODE_FRAME;
+		} else {
+			qio->mode = QIO_MODE_BLOB;
+		}
+	}
+
+	if (qio->mode == QIO_MODE_FRAME) {
+		/* connexion stays open unless there's trouble */
+		if (handle_frame(EV_A_ qio) < 0 ||
+		    dccp_flush(EV_A_ qio) < 0) {
+			goto clo;
+		}
+		return;
+	} else if (UNLIKELY((qio->itot += nrd) > umpf_max_request)) {
+		UMPF_ERR_LOG("\
+request exceeds %zu bytes, rejecting\n", umpf_max_request);
+		goto clo;
+	}
+
+	/* the parser keeps what it needs, the buffer's free again */
+	len = qio->ilen;
+	qio->ilen = 0U;
+	/* see what the handler makes of it */
+	if (handle_data(EV_A_ qio, qio->ibuf, len) >= 0) {
+		/* connection shall not be closed, or at least not by us */
+		return;
 	}
 
 clo:
-	/* notify the blob parser about the conn close */
-	handle_close(qio);
-	ev_qio_shut(EV_A_ w);
+	dccp_close(EV_A_ qio);
 	return;
 }
 
 static void
 dccp_cb(EV_P_ ev_io *w, int UNUSED(re))
 {
-	union ud_sockaddr_u sa;
-	socklen_t sasz = sizeof(sa);
-	ev_qio_t qio;
-	int s;
+/* accept what's queued up (within reason) and try reading straight
+ * away, with deferred accepts the request is usually there already */
+	for (size_t i = 0; i < UMPF_ACCEPT_BATCH; i++) {
+		union ud_sockaddr_u sa;
+		socklen_t sasz = sizeof(sa);
+		ev_qio_t qio;
+		int s;
 
-	if ((s = accept(w->fd, &sa.sa, &sasz)) < 0) {
-		return;
-	}
-	log_conn(s, &sa);
+#if defined SOCK_NONBLOCK && defined SOCK_CLOEXEC
+		s = accept4(w->fd, &sa.sa, &sasz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else  /* !SOCK_NONBLOCK || !SOCK_CLOEXEC */
+		if ((s = accept(w->fd, &sa.sa, &sasz)) >= 0) {
+			setsock_nonblock(s);
+		}
+#endif	/* SOCK_NONBLOCK && SOCK_CLOEXEC */
+		if (s < 0) {
+			return;
+		}
+		log_conn(s, &sa);
 
-	qio = make_qio();
-	ev_io_init(qio->w, dccp_data_cb, s, EV_READ);
-	qio->w->data = qio;
-	ev_io_start(EV_A_ qio->w);
+		if (UNLIKELY((qio = make_qio()) == NULL)) {
+			UMPF_ERR_LOG("cannot allocate client, dropping\n");
+			close(s);
+			continue;
+		}
+		ev_io_init(qio->w, dccp_data_cb, s, EV_READ);
+		qio->w->data = qio;
+		ev_io_start(EV_A_ qio->w);
+		/* speculative read, saves a round through the loop */
+		dccp_data_cb(EV_A_ qio->w, EV_READ);
+	}
 	return;
 }
 
@@ -799,6 +3000,158 @@ sighup_cb(EV_P_ ev_signal *UNUSED(w), int UNUSED(revents))
 	return;
 }
 
+
+/* prefork */
+struct umpf_slot_s {
+	ev_child c[1];
+	ev_timer t[1];
+	ev_tstamp born;
+};
+
+/* non-zero in processes forked off by the prefork master */
+static int umpf_childp;
+static struct umpf_slot_s *slots;
+static size_t nslots;
+
+static int
+umpf_spawn(EV_P_ struct umpf_slot_s *s)
+{
+/* fork a child for slot S, return 0 in the child and the child's pid
+ * in the master, or -1 if forking failed */
+	pid_t pid;
+
+	switch ((pid = fork())) {
+	case -1:
+		UMPF_CRIT_LOG("cannot fork child: %s\n", strerror(errno));
+		return -1;
+	case 0:
+		/* the child doesn't supervise anyone */
+		umpf_childp = 1;
+		for (size_t i = 0; i < nslots; i++) {
+			ev_child_stop(EV_A_ slots[i].c);
+			ev_timer_stop(EV_A_ slots[i].t);
+		}
+		ev_loop_fork(EV_A);
+		return 0;
+	default:
+		UMPF_INFO_LOG("child %d started\n", pid);
+		ev_child_set(s->c, pid, 0);
+		ev_child_start(EV_A_ s->c);
+		s->born = ev_now(EV_A);
+		return pid;
+	}
+}
+
+static void
+respawn_cb(EV_P_ ev_timer *w, int UNUSED(re))
+{
+	struct umpf_slot_s *s = w->data;
+
+	ev_timer_stop(EV_A_ w);
+	if (umpf_spawn(EV_A_ s) == 0) {
+		/* we're the new child, leave the master's loop */
+		ev_unloop(EV_A_ EVUNLOOP_ALL);
+	}
+	return;
+}
+
+static void
+chld_cb(EV_P_ ev_child *w, int UNUSED(re))
+{
+	struct umpf_slot_s *s = w->data;
+
+	ev_child_stop(EV_A_ w);
+	UMPF_ERR_LOG("child %d exited, status %d\n", w->rpid, w->rstatus);
+
+	if (ev_now(EV_A) - s->born < 1.0) {
+		/* died young, don't fork-bomb the box */
+		ev_timer_set(s->t, 1.0, 0.0);
+		ev_timer_start(EV_A_ s->t);
+		return;
+	} else if (umpf_spawn(EV_A_ s) == 0) {
+		/* we're the new child, leave the master's loop */
+		ev_unloop(EV_A_ EVUNLOOP_ALL);
+	}
+	return;
+}
+
+static int
+umpf_prefork(EV_P_ size_t k, uint16_t port, ev_io lstn[static 2])
+{
+/* become the master of K children, return 0 in a child once it's ready
+ * to serve, or 1 in the master when it's time to shut down */
+	/* the master does no accepting */
+	if (lstn[0].fd >= 0) {
+		/* children bind their own tcp sockets */
+		ev_io_stop(EV_A_ lstn + 0);
+		close(lstn[0].fd);
+		lstn[0].fd = -1;
+	}
+	if (lstn[1].fd >= 0) {
+		/* the unix socket is shared, it's non-blocking so children
+		 * don't block on an accept that a sibling has won */
+		ev_io_stop(EV_A_ lstn + 1);
+	}
+
+	slots = calloc(k, sizeof(*slots));
+	nslots = k;
+	for (size_t i = 0; i < k; i++) {
+		ev_child_init(slots[i].c, chld_cb, 0, 0);
+		slots[i].c->data = slots + i;
+		ev_timer_init(slots[i].t, respawn_cb, 0.0, 0.0);
+		slots[i].t->data = slots + i;
+	}
+	for (size_t i = 0; i < k; i++) {
+		if (umpf_spawn(EV_A_ slots + i) == 0) {
+			goto child;
+		}
+	}
+
+	UMPF_NOTI_LOG("umpfd master ready, %zu children\n", k);
+	ev_loop(EV_A_ 0);
+	if (umpf_childp) {
+		goto child;
+	}
+
+	/* master is shutting down, take the children with us */
+	for (size_t i = 0; i < k; i++) {
+		if (ev_is_active(slots[i].c)) {
+			ev_child_stop(EV_A_ slots[i].c);
+			kill(slots[i].c->pid, SIGTERM);
+		}
+		ev_timer_stop(EV_A_ slots[i].t);
+	}
+	for (size_t i = 0; i < k; i++) {
+		if (slots[i].c->pid > 0) {
+			waitpid(slots[i].c->pid, NULL, 0);
+		}
+	}
+	free(slots);
+	slots = NULL;
+	nslots = 0U;
+	return 1;
+
+child:
+	free(slots);
+	slots = NULL;
+	nslots = 0U;
+	/* own reuseport tcp socket, inherited unix socket */
+	if (port) {
+		int s;
+
+		if ((s = make_tcp_conn(port)) < 0) {
+			UMPF_ERR_LOG("cannot bind tcp port %hu\n", port);
+		} else {
+			ev_io_init(lstn + 0, dccp_cb, s, EV_READ);
+			ev_io_start(EV_A_ lstn + 0);
+		}
+	}
+	if (lstn[1].fd >= 0) {
+		ev_io_start(EV_A_ lstn + 1);
+	}
+	return 0;
+}
+
 
 /* config glue */
 struct dbnfo_s {
@@ -814,6 +3167,18 @@ struct dbnfo_s {
 	char *u;
 	char *p;
 	char *s;
+	/* sqlite knobs, normal and for bulk loads */
+	char *tune[UMPF_NKNOBS];
+	char *bulk[UMPF_NKNOBS];
+	size_t bulk_min;
+	/* in-memory mode and seconds between snapshots */
+	bool memp;
+	unsigned int snap;
+	/* memory-mapped store, in directory F */
+	bool mmapp;
+	/* write-behind journal and seconds between flushes */
+	char *wb;
+	unsigned int flush;
 };
 
 #define GLOB_CFG_PRE	"/etc/unserding"
@@ -931,34 +3296,223 @@ out:
 	return strndup(res, rsz);
 }
 
-static uint16_t
-umpf_get_port(cfg_t ctx)
+static int
+umpf_get_int(cfg_t ctx, const char *key)
 {
+/* look up integer KEY in the module sets, then in the root domain */
 	cfgset_t *cs;
 	int res;
 
 	if (UNLIKELY(ctx == NULL)) {
-		goto dflt;
+		return 0;
 	}
 
 	/* start out with an empty target */
 	for (size_t i = 0, n = cfg_get_sets(&cs, ctx); i < n; i++) {
-		if ((res = cfg_tbl_lookup_i(ctx, cs[i], "port"))) {
-			goto out;
+		if ((res = cfg_tbl_lookup_i(ctx, cs[i], key))) {
+			return res;
 		}
 	}
 
 	/* otherwise try the root domain */
-	res = cfg_glob_lookup_i(ctx, "port");
+	return cfg_glob_lookup_i(ctx, key);
+}
+
+static uint16_t
+umpf_get_port(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "port");
 
-out:
 	if (res > 0 && res < 65536) {
 		return (uint16_t)res;
 	}
-dflt:
 	return 0U;
 }
 
+static size_t
+umpf_get_workers(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "workers");
+
+	if (res > 0) {
+		return (size_t)res;
+	} else if (res < 0) {
+		/* explicitly asked to do it all in the I/O thread */
+		return 0U;
+	}
+	return UMPF_WORKERS;
+}
+
+static size_t
+umpf_get_readers(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "readers");
+
+	if (res > 0) {
+		return (size_t)res;
+	}
+	return 0U;
+}
+
+static size_t
+umpf_get_max_request(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "max_request");
+
+	if (res > 0) {
+		return (size_t)res;
+	}
+	return UMPF_MAX_REQUEST;
+}
+
+static size_t
+umpf_get_pf_cache(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "pf_cache");
+
+	if (res > 0) {
+		return (size_t)res;
+	} else if (res < 0) {
+		/* explicitly switched off */
+		return 0U;
+	}
+	return UMPF_PF_CACHE;
+}
+
+static size_t
+umpf_get_reply_cache(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "reply_cache");
+
+	if (res > 0) {
+		return (size_t)res;
+	} else if (res < 0) {
+		/* explicitly switched off */
+		return 0U;
+	}
+	return UMPF_REPLY_CACHE;
+}
+
+static size_t
+umpf_get_group_max(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "group_commit");
+
+	if (res > 0) {
+		return (size_t)res;
+	} else if (res < 0) {
+		/* explicitly switched off */
+		return 1U;
+	}
+	return UMPF_GROUP_MAX;
+}
+
+static double
+umpf_get_group_window(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "group_window");
+
+	if (res > 0) {
+		return (double)res / 1000000.0;
+	}
+	return UMPF_GROUP_WINDOW / 1000000.0;
+}
+
+static size_t
+umpf_get_ledger(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "ledger");
+
+	if (res > 0) {
+		return (size_t)res;
+	}
+	return UMPF_LEDGER;
+}
+
+static size_t
+umpf_get_prefork(cfg_t ctx)
+{
+	int res = umpf_get_int(ctx, "prefork");
+
+	if (res > 0) {
+		return (size_t)res;
+	}
+	return 0U;
+}
+
+static unsigned int
+umpf_backend_flags(const char *name)
+{
+/* map backend NAME to libev loop flags */
+	static const struct {
+		const char *name;
+		unsigned int flags;
+	} bes[] = {
+		{"auto", EVFLAG_AUTO},
+		{"select", EVBACKEND_SELECT},
+		{"poll", EVBACKEND_POLL},
+#if defined EVBACKEND_EPOLL
+		{"epoll", EVBACKEND_EPOLL},
+#endif	/* EVBACKEND_EPOLL */
+#if defined EVBACKEND_LINUXAIO
+		{"linuxaio", EVBACKEND_LINUXAIO},
+#endif	/* EVBACKEND_LINUXAIO */
+#if defined EVBACKEND_IOURING
+		{"iouring", EVBACKEND_IOURING},
+		{"io_uring", EVBACKEND_IOURING},
+#endif	/* EVBACKEND_IOURING */
+#if defined EVBACKEND_KQUEUE
+		{"kqueue", EVBACKEND_KQUEUE},
+#endif	/* EVBACKEND_KQUEUE */
+	};
+
+	if (name == NULL) {
+		return EVFLAG_AUTO;
+	}
+	for (size_t i = 0; i < countof(bes); i++) {
+		if (strcmp(name, bes[i].name)) {
+			continue;
+		} else if (bes[i].flags == EVFLAG_AUTO) {
+			return EVFLAG_AUTO;
+		} else if (!(ev_supported_backends() & bes[i].flags)) {
+			UMPF_ERR_LOG("\
+backend %s not supported by this libev/kernel, using default\n", name);
+			return EVFLAG_AUTO;
+		}
+		return bes[i].flags;
+	}
+	UMPF_ERR_LOG("unknown backend %s, using default\n", name);
+	return EVFLAG_AUTO;
+}
+
+static char*
+umpf_get_backend(cfg_t ctx)
+{
+	cfgset_t *cs;
+	size_t rsz;
+	const char *res = NULL;
+
+	if (UNLIKELY(ctx == NULL)) {
+		return NULL;
+	}
+
+	for (size_t i = 0, n = cfg_get_sets(&cs, ctx); i < n; i++) {
+		if ((rsz = cfg_tbl_lookup_s(&res, ctx, cs[i], "backend"))) {
+			goto out;
+		}
+	}
+
+	/* otherwise try the root domain */
+	if ((rsz = cfg_glob_lookup_s(&res, ctx, "backend"))) {
+		goto out;
+	}
+	return NULL;
+
+out:
+	/* make sure the return value is freeable */
+	return strndup(res, rsz);
+}
+
 static struct dbnfo_s
 __get_dbnfo(cfg_t ctx, cfgset_t s)
 {
@@ -978,8 +3532,43 @@ __get_dbnfo(cfg_t ctx, cfgset_t s)
 
 	} else if ((cfg_tbl_lookup_s(&tmp, ctx, db, "file"), tmp) != NULL) {
 		/* sqlite again */
+		void *bulk;
+
 		res.f = strdup(tmp);
 		res.t = DBNFO_SQLITE;
+		for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+			const char *k = umpf_knobs[i].key;
+
+			if ((cfg_tbl_lookup_s(&tmp, ctx, db, k), tmp)) {
+				res.tune[i] = strdup(tmp);
+			}
+		}
+		if ((bulk = cfg_tbl_lookup(ctx, db, "bulk")) != NULL) {
+			int min = cfg_tbl_lookup_i(ctx, bulk, "positions");
+
+			for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+				const char *k = umpf_knobs[i].key;
+
+				if (!umpf_knobs[i].bulk) {
+					continue;
+				}
+				cfg_tbl_lookup_s(&tmp, ctx, bulk, k);
+				if (tmp != NULL) {
+					res.bulk[i] = strdup(tmp);
+				}
+			}
+			res.bulk_min = min > 0 ? (size_t)min : 0U;
+			cfg_tbl_free(ctx, bulk);
+		}
+		if ((cfg_tbl_lookup_s(&tmp, ctx, db, "mode"), tmp) &&
+		    !strcmp(tmp, "memory")) {
+			int snap = cfg_tbl_lookup_i(ctx, db, "snapshot");
+
+			res.memp = true;
+			res.snap = snap > 0 ? (unsigned int)snap : UMPF_SNAPSHOT;
+		} else if (tmp && !strcmp(tmp, "mmap")) {
+			res.mmapp = true;
+		}
 
 	} else {
 		res.t = DBNFO_MYSQL;
@@ -996,6 +3585,12 @@ __get_dbnfo(cfg_t ctx, cfgset_t s)
 			res.s = strdup(tmp);
 		}
 	}
+	if ((cfg_tbl_lookup_s(&tmp, ctx, db, "journal"), tmp)) {
+		int flush = cfg_tbl_lookup_i(ctx, db, "flush");
+
+		res.wb = strdup(tmp);
+		res.flush = flush > 0 ? (unsigned int)flush : UMPF_FLUSH;
+	}
 	/* free our settings */
 	cfg_tbl_free(ctx, db);
 
@@ -1075,6 +3670,8 @@ main(int argc, char *argv[])
 	static ev_signal ALGN16(sighup_watcher)[1];
 	static ev_signal ALGN16(sigterm_watcher)[1];
 	static ev_signal ALGN16(sigpipe_watcher)[1];
+	/* snapshots of the in-memory database, without workers */
+	static ev_timer ALGN16(snap_watcher)[1];
 	/* our communication sockets */
 	ev_io lstn[2];
 	/* args */
@@ -1084,6 +3681,10 @@ main(int argc, char *argv[])
 	struct dbnfo_s db;
 	char *sock;
 	uint16_t port;
+	size_t nworkers;
+	size_t nreaders;
+	size_t nprefork;
+	unsigned int evflags;
 	cfg_t cfg;
 
 	/* whither to log */
@@ -1128,6 +3729,102 @@ main(int argc, char *argv[])
 	sock = umpf_get_sock(cfg);
 	port = umpf_get_port(cfg);
 	db = umpf_get_dbnfo(cfg);
+	if (argi->workers_given) {
+		/* command line has precedence */
+		nworkers = argi->workers_arg > 0 ? argi->workers_arg : 0;
+	} else {
+		nworkers = umpf_get_workers(cfg);
+	}
+	if (argi->readers_given) {
+		/* command line has precedence */
+		nreaders = argi->readers_arg > 0 ? argi->readers_arg : 0;
+	} else {
+		nreaders = umpf_get_readers(cfg);
+	}
+	if (argi->prefork_given) {
+		/* command line has precedence */
+		nprefork = argi->prefork_arg > 0 ? argi->prefork_arg : 0;
+	} else {
+		nprefork = umpf_get_prefork(cfg);
+	}
+	if (argi->max_request_given && argi->max_request_arg > 0) {
+		/* command line has precedence */
+		umpf_max_request = argi->max_request_arg;
+	} else {
+		umpf_max_request = umpf_get_max_request(cfg);
+	}
+	umpf_pf_cache = umpf_get_pf_cache(cfg);
+	umpf_reply_cache = umpf_get_reply_cache(cfg);
+	umpf_group_max = umpf_get_group_max(cfg);
+	umpf_group_window = umpf_get_group_window(cfg);
+	if (db.t == DBNFO_SQLITE && db.memp) {
+		/* one connexion, all in one process */
+		if (nworkers > 1U || nreaders || nprefork) {
+			UMPF_NOTI_LOG("in-memory mode, 1 worker at most\n");
+		}
+		nworkers = nworkers ? 1U : 0U;
+		nreaders = 0U;
+		nprefork = 0U;
+	} else if (db.t == DBNFO_SQLITE && db.mmapp) {
+		/* the store's indexes live with its one connexion */
+		if (nworkers > 1U || nreaders || nprefork) {
+			UMPF_NOTI_LOG("mmap store, 1 worker at most\n");
+		}
+		nworkers = nworkers ? 1U : 0U;
+		nreaders = 0U;
+		nprefork = 0U;
+		umpf_mmap_dir = db.f;
+	}
+	if (nprefork && (umpf_pf_cache || umpf_reply_cache)) {
+		/* processes can't see each other's caches */
+		UMPF_NOTI_LOG("caches disabled in prefork mode\n");
+		umpf_pf_cache = 0U;
+		umpf_reply_cache = 0U;
+	}
+	if ((umpf_ledger = umpf_get_ledger(cfg)) && !umpf_pf_cache) {
+		/* only the cache can tell positions without tags */
+		UMPF_NOTI_LOG("ledger needs the portfolio cache\n");
+		umpf_ledger = 0U;
+	} else if (umpf_ledger && db.mmapp) {
+		UMPF_NOTI_LOG("no ledger with the mmap store\n");
+		umpf_ledger = 0U;
+	} else if (umpf_ledger && nreaders) {
+		/* readers would only see what's been folded */
+		UMPF_NOTI_LOG("no readers with a ledger\n");
+		nreaders = 0U;
+	}
+	if (db.wb == NULL) {
+		;
+	} else if (db.memp || db.mmapp || !nworkers || nprefork) {
+		/* the workers write behind, the in-memory database has
+		 * a journal of its own */
+		UMPF_NOTI_LOG("write-behind needs workers and a database\n");
+	} else {
+		/* readers would only see what's been flushed */
+		if (nreaders) {
+			UMPF_NOTI_LOG("no readers with write-behind\n");
+		}
+		if (db.t == DBNFO_SQLITE && nworkers > 1U) {
+			/* every worker keeps a write transaction open, on
+			 * sqlite they'd take turns waiting for the lock */
+			UMPF_NOTI_LOG("write-behind on sqlite, 1 worker\n");
+			nworkers = 1U;
+		}
+		nreaders = 0U;
+		umpf_wb_file = db.wb;
+		umpf_wb_ival = (double)db.flush;
+	}
+	if (argi->backend_given) {
+		/* command line has precedence */
+		evflags = umpf_backend_flags(argi->backend_arg);
+	} else {
+		char *be = umpf_get_backend(cfg);
+
+		evflags = umpf_backend_flags(be);
+		if (be != NULL) {
+			free(be);
+		}
+	}
 
 	/* free cmdline parser goodness */
 	cmdline_parser_free(argi);
@@ -1135,7 +3832,9 @@ main(int argc, char *argv[])
 	umpf_free_config(cfg);
 
 	/* initialise the main loop */
-	loop = ev_default_loop(EVFLAG_AUTO);
+	loop = ev_default_loop(evflags);
+	umpf_ioloop = loop;
+	UMPF_INFO_LOG("event loop backend %x\n", ev_backend(EV_A));
 
 	/* initialise a sig C-c handler */
 	ev_signal_init(sigint_watcher, sigint_cb, SIGINT);
@@ -1179,18 +3878,79 @@ main(int argc, char *argv[])
 		lstn[1].fd = -1;
 	}
 
+	/* in prefork mode only the children get past here */
+	if (nprefork && umpf_prefork(EV_A_ nprefork, port, lstn)) {
+		goto fin;
+	}
+
+	/* storage tuning, applied whenever a connexion's opened */
+	for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+		umpf_tune_norm[i] = db.tune[i];
+		umpf_tune_bulk[i] = db.bulk[i];
+		if (db.tune[i] != NULL) {
+			UMPF_INFO_LOG(
+				"sqlite %s = %s\n",
+				umpf_knobs[i].key, db.tune[i]);
+		}
+		if (db.bulk[i] != NULL) {
+			UMPF_INFO_LOG(
+				"sqlite %s = %s for %zu positions or more\n",
+				umpf_knobs[i].key, db.bulk[i], db.bulk_min);
+		}
+	}
+	umpf_bulk_min = db.bulk_min;
+
 	/* connect to our database */
 	switch (db.t) {
 	case DBNFO_UNK:
 	default:
 		break;
 	case DBNFO_SQLITE:
+		if (db.memp && umpf_open_mem(db.f, db.snap) < 0) {
+			break;
+		} else if (nworkers &&
+			   init_wrk(nworkers, nreaders,
+				    NULL, NULL, NULL, db.f) == 0) {
+			break;
+		} else if (db.memp) {
+			umpf_dbconn = umpf_memconn;
+			ev_timer_init(
+				snap_watcher, snap_cb,
+				umpf_snap_ival, umpf_snap_ival);
+			ev_timer_start(EV_A_ snap_watcher);
+			break;
+		} else if (db.mmapp) {
+			umpf_dbconn = be_sql_open_mmap(db.f);
+			break;
+		}
 		umpf_dbconn = be_sql_open(NULL, NULL, NULL, db.f);
+		umpf_tune(umpf_dbconn, false);
 		break;
 	case DBNFO_MYSQL:
+		if (nreaders) {
+			UMPF_NOTI_LOG("readers need the sqlite backend\n");
+		}
+		if (nworkers &&
+		    init_wrk(nworkers, 0U, db.h, db.u, db.p, db.s) == 0) {
+			break;
+		}
 		umpf_dbconn = be_sql_open(db.h, db.u, db.p, db.s);
 		break;
 	}
+	if (umpf_dbconn) {
+		/* every query stalls the event loop now */
+		UMPF_NOTI_LOG("serving requests in the I/O thread\n");
+	}
+	if (umpf_dbconn && umpf_pf_cache) {
+		umpf_pfc = make_pfc(umpf_pf_cache);
+	}
+	if (umpf_dbconn && umpf_reply_cache) {
+		umpf_rc = make_rcache(umpf_reply_cache);
+	}
+
+	/* workers report back through this one */
+	ev_async_init(cmpl_watcher, cmpl_cb);
+	ev_async_start(EV_A_ cmpl_watcher);
 
 	UMPF_NOTI_LOG("umpfd ready\n");
 
@@ -1199,46 +3959,87 @@ main(int argc, char *argv[])
 
 	UMPF_NOTI_LOG("shutting down umpfd\n");
 
+fin:
 	/* stuff that was in dso_deinit() formerly */
 	if (lstn[0].fd >= 0) {
 		ev_io_shut(EV_A_ lstn + 0);
 	}
-	if (lstn[1].fd >= 0) {
+	if (lstn[1].fd >= 0 && nprefork) {
+		/* shared with our siblings, a shutdown() would
+		 * stop their listening too */
+		ev_io_stop(EV_A_ lstn + 1);
+		close(lstn[1].fd);
+	} else if (lstn[1].fd >= 0) {
 		ev_io_shut(EV_A_ lstn + 1);
 	}
 
+	/* wait for the workers to finish their business */
+	if (nwrk) {
+		fini_wrk();
+	}
+	ev_async_stop(EV_A_ cmpl_watcher);
+	fini_jobs();
+
 	/* destroy the default evloop */
 	ev_default_destroy();
+	/* only now that no watcher can be looked at anymore */
+	fini_gq(ioq.q);
 
 	/* close our db connection */
+	if (umpf_pfc) {
+		free_pfc(umpf_pfc);
+	}
+	if (umpf_rc) {
+		free_rcache(umpf_rc);
+	}
+	if (umpf_dbconn && umpf_dbconn == umpf_memconn) {
+		/* the cache is gone already */
+		umpf_snapshot(umpf_dbconn, NULL);
+	}
 	if (umpf_dbconn) {
 		be_sql_close(umpf_dbconn);
-		switch (db.t) {
-		case DBNFO_UNK:
-		default:
-			break;
-		case DBNFO_SQLITE:
-			free(db.f);
-			break;
-		case DBNFO_MYSQL:
-			if (db.h) {
-				free(db.h);
-			}
-			if (db.u) {
-				free(db.u);
-			}
-			if (db.p) {
-				free(db.p);
+	}
+	if (umpf_jnl) {
+		free_jnl(umpf_jnl);
+	}
+	if (db.wb) {
+		free(db.wb);
+	}
+	switch (db.t) {
+	case DBNFO_UNK:
+	default:
+		break;
+	case DBNFO_SQLITE:
+		free(db.f);
+		for (size_t i = 0; i < UMPF_NKNOBS; i++) {
+			if (db.tune[i] != NULL) {
+				free(db.tune[i]);
 			}
-			if (db.s) {
-				free(db.s);
+			if (db.bulk[i] != NULL) {
+				free(db.bulk[i]);
 			}
-			break;
 		}
+		break;
+	case DBNFO_MYSQL:
+		if (db.h) {
+			free(db.h);
+		}
+		if (db.u) {
+			free(db.u);
+		}
+		if (db.p) {
+			free(db.p);
+		}
+		if (db.s) {
+			free(db.s);
+		}
+		break;
 	}
-	/* unlink the unix domain socket */
+	/* unlink the unix domain socket, the master's job in prefork mode */
 	if (sock != NULL) {
-		unlink(sock);
+		if (!umpf_childp) {
+			unlink(sock);
+		}
 		free(sock);
 	}
 